@@ -18,6 +18,45 @@ Command line argument usage: \n\
   -t  --time      use absolute time instead of ticks \n\
   -i  --inc       write/read incremental time or tick values to/from ascii file \n\
   -fN --fold=N    fold sysex data at N columns \n\
+  --durations     print each On and its Off as one Note line with dur= \n\
+  --ramps         print runs of Par or Pb with a constant step in time \n\
+                  and value as one Ramp line \n\
+  --packed        decode to, or with -c compile from, a binary event \n\
+                  stream: midicomp --packed [stages] in.mid [out] \n\
+  --json          the same as --packed with a stream of JSON objects, \n\
+                  one per line (NDJSON) \n\
+  --export-columns=DIR add the events of each file named (or listed on \n\
+                  stdin) to a column file per field in DIR \n\
+  --terse         print the terse dialect: delta times, left out when 0, \n\
+                  and bare values, the channel only when it changes \n\
+  --merge         merge all tracks into one, in time order \n\
+  --to-format0    write the merged tracks as a format 0 SMF \n\
+  --split-channels write a format 1 SMF with a track per channel \n\
+  --concat        play in.mid... one after another: --concat a b out.mid \n\
+  --layer         stack the tracks of in.mid...: --layer a b out.mid \n\
+  --in-place      apply the stages to file.mid itself, patching it \n\
+                  where the edits don't change its size \n\
+  --check         only check that each file named is a valid SMF \n\
+  --info          show the header and chunk sizes of each file named \n\
+  --max-events=N, --max-payload=BYTES, --max-output-bytes=BYTES, \n\
+  --time-budget-ms=MS  stop with exit status 3 when a limit is reached \n\
+  --max-errors=N  with -c, stop after N bad lines (default: report all) \n\
+  --sort[=N]      with -c, accept times out of order and sort each track, \n\
+                  N events at a time in memory (default 1048576) \n\
+  --compact[=offs] write the smallest SMF: running status, no empty \n\
+                  events; =offs also writes Off as On v=0 \n\
+  -wE --where=E   only pass events matching expression E, e.g. \n\
+                  'ch==10 && type==on && v>100' or 'type==par && c==64' \n\
+\n\
+Transform stages for SMF to SMF (applied in the order given): \n\
+\n\
+  --transpose=N   shift note numbers by N semitones \n\
+  --velocity=PCT  scale note-on velocities to PCT percent \n\
+  --chmap=A:B,..  move channel A to channel B \n\
+  --drop=T,..     drop event types (on,par,pb,sysex,meta,tempo,lyric...) \n\
+  --tempo-scale=F multiply the playback speed by F \n\
+  --thin[=TOL]    drop repeated, dead and (within TOL) ramp Par/Pb events \n\
+  --plugin=P.so[:ARGS] run the events through a plugin (see midicomp_plugin.h) \n\
 \n\
 To translate a SMF file to plain ascii format: \n\
 \n\
@@ -29,7 +68,11 @@ To translate a plain ascii formatted file to SMF: \n\
   midicomp -c some.asc some.mid   # input and output filenames \n\
   midicomp -c some.mid < some.asc # input from stdin with one arg \n\
 \n\
-  midicomp some.mid | somefilter | midicomp -c some2.mid \n";
+  midicomp some.mid | somefilter | midicomp -c some2.mid \n\
+\n\
+To edit a SMF file directly, without the text round trip: \n\
+\n\
+  midicomp --transpose=-12 --velocity=80 some.mid some2.mid \n";
 
 #include <setjmp.h>
 #include <errno.h>
@@ -40,6 +83,16 @@ To translate a plain ascii formatted file to SMF: \n\
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef HAVE_DLFCN
+#include <dlfcn.h>
+#endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 #include "midicomp.h"
 
 int main(int argc, char **argv) {
@@ -58,11 +111,40 @@ int main(int argc, char **argv) {
     {"time",  no_argument,     0, 't'},
     {"inc",     no_argument,       0, 'i'},
     {"fold",  required_argument, 0, 'f'},
+    {"where", required_argument, 0, 'w'},
+    {"transpose", required_argument, 0, OPT_TRANSPOSE},
+    {"velocity", required_argument, 0, OPT_VELOCITY},
+    {"chmap", required_argument, 0, OPT_CHMAP},
+    {"drop", required_argument, 0, OPT_DROP},
+    {"tempo-scale", required_argument, 0, OPT_TEMPO},
+    {"plugin", required_argument, 0, OPT_PLUGIN},
+    {"compact", optional_argument, 0, OPT_COMPACT},
+    {"thin", optional_argument, 0, OPT_THIN},
+    {"merge", no_argument, 0, OPT_MERGE},
+    {"to-format0", no_argument, 0, OPT_FORMAT0},
+    {"split-channels", no_argument, 0, OPT_SPLIT},
+    {"concat", no_argument, 0, OPT_CONCAT},
+    {"layer", no_argument, 0, OPT_LAYER},
+    {"in-place", no_argument, 0, OPT_INPLACE},
+    {"check", no_argument, 0, OPT_CHECK},
+    {"info", no_argument, 0, OPT_INFO},
+    {"max-events", required_argument, 0, OPT_MAXEVENTS},
+    {"max-payload", required_argument, 0, OPT_MAXPAYLOAD},
+    {"max-output-bytes", required_argument, 0, OPT_MAXOUT},
+    {"time-budget-ms", required_argument, 0, OPT_BUDGET},
+    {"max-errors", required_argument, 0, OPT_MAXERRORS},
+    {"durations", no_argument, 0, OPT_DURATIONS},
+    {"sort", optional_argument, 0, OPT_SORT},
+    {"terse", no_argument, 0, OPT_TERSE},
+    {"ramps", no_argument, 0, OPT_RAMPS},
+    {"packed", no_argument, 0, OPT_PACKED},
+    {"json", no_argument, 0, OPT_JSON},
+    {"export-columns", required_argument, 0, OPT_EXPORT},
     {0, 0, 0, 0}
   };
   int option_index = 0;
 
-  while ((c = getopt_long(argc, argv, "dvcntif:", long_options, &option_index)) != -1) {
+  while ((c = getopt_long(argc, argv, "dvcntif:w:", long_options, &option_index)) != -1) {
     switch (c) {
     case 0:
       if (long_options[option_index].flag != 0)
@@ -86,6 +168,104 @@ int main(int argc, char **argv) {
     case 'm':
       Mf_nomerge = 0;
       break;
+    case 'w':
+      wherecompile(optarg);
+      break;
+    case OPT_TRANSPOSE:
+      xtranspose(optarg);
+      break;
+    case OPT_VELOCITY:
+      xvelocity(optarg);
+      break;
+    case OPT_CHMAP:
+      xchmap(optarg);
+      break;
+    case OPT_DROP:
+      xdrop(optarg);
+      break;
+    case OPT_TEMPO:
+      xtempo(optarg);
+      break;
+    case OPT_PLUGIN:
+      xplugin(optarg);
+      break;
+    case OPT_MERGE:
+      if (!merge) merge = 1;
+      break;
+    case OPT_FORMAT0:
+      merge = 2;
+      break;
+    case OPT_SPLIT:
+      splitch = 1;
+      break;
+    case OPT_INPLACE:
+      inplace = 1;
+      break;
+    case OPT_CHECK:
+      check = 1;
+      break;
+    case OPT_INFO:
+      info = 1;
+      break;
+    case OPT_MAXEVENTS:
+      limitarg(&Lmaxevents, "max-events", optarg);
+      break;
+    case OPT_MAXPAYLOAD:
+      limitarg(&Lmaxpayload, "max-payload", optarg);
+      break;
+    case OPT_MAXOUT:
+      limitarg(&Lmaxout, "max-output-bytes", optarg);
+      break;
+    case OPT_BUDGET:
+      limitarg(&Lbudget, "time-budget-ms", optarg);
+      break;
+    case OPT_SORT:
+      sortrun = optarg ? atol(optarg) : SORTRUN;
+      if (sortrun < 1) {
+        fprintf(stderr, "--sort takes the events to sort in memory, at least 1\n");
+        return 1;
+      }
+      break;
+    case OPT_RAMPS:
+      ramps = 1;
+      break;
+    case OPT_PACKED:
+      packed = 1;
+      break;
+    case OPT_JSON:
+      json = 1;
+      break;
+    case OPT_EXPORT:
+      exportdir = optarg;
+      break;
+    case OPT_TERSE:
+      terse = 1;
+      break;
+    case OPT_DURATIONS:
+      durations = 1;
+      break;
+    case OPT_MAXERRORS:
+      Maxerrors = atoi(optarg);
+      if (Maxerrors < 1) {
+        fprintf(stderr, "--max-errors needs a positive number\n");
+        exit(1);
+      }
+      break;
+    case OPT_CONCAT:
+    case OPT_LAYER:
+      combine = c;
+      break;
+    case OPT_THIN:
+      xthin(optarg);
+      break;
+    case OPT_COMPACT:
+      if (optarg && strcmp(optarg, "offs") != 0) {
+        fprintf(stderr, "compact takes no argument or =offs\n");
+        return 1;
+      }
+      compact = optarg ? 2 : 1;
+      Mf_RunStat = compact;
+      break;
     case 'n':
       notes++;
       break;
@@ -109,6 +289,11 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (packed && json) {
+    fprintf(stderr, "--packed and --json don't go together\n");
+    return 1;
+  }
+
   if (dbg) fprintf(stderr, "main()\n");
 
   TrkNr = 0;
@@ -156,10 +341,49 @@ if (dbg) fprintf(stderr, "Compiling %s to %s\n", infile, outfile);
 
     Mf_putc = fileputc;
     Mf_wtrack = mywritetrack;
-    translate();
+    if (packed || json) pktranslate();
+    else translate();
+    if (compact) compactreport(F);
     fclose(F);
     fclose(yyin);
+    if (Errors) {
+      fprintf(stderr, "%s: %d error%s\n", infile, Errors, Errors > 1 ? "s" : "");
+      return 1;
+    }
+  } else if (info) {
+    return infofiles(argv + optind, argc - optind) ? 1 : 0;
+  } else if (check) {
+    return checkfiles(argv + optind, argc - optind) ? 1 : 0;
+  } else if (exportdir) {
+    return exportcolumns(argv + optind, argc - optind) ? 1 : 0;
+  } else if (inplace) {
+    if (optind + 1 != argc || strcmp(argv[optind], "-") == 0) {
+      fprintf(stderr, "usage: midicomp --in-place [stages] file.mid\n");
+      return 1;
+    }
+    xinplace(argv[optind]);
+  } else if (combine) {
+    if (argc - optind < 2) {
+      fprintf(stderr, "usage: midicomp --concat|--layer in.mid... out.mid\n");
+      return 1;
+    }
+    xcombine(argv + optind, argc - optind - 1, argv[argc-1]);
+  } else if (packed || json) {
+    pkdecode(optind < argc ? argv[optind] : "-",
+             optind + 1 < argc ? argv[optind+1] : "-");
+  } else if (optind+1 < argc) {
+    xform(argv[optind], argv[optind+1]);
   } else {
+    if (Xnstages || merge > 1 || splitch) {
+      fprintf(stderr, "transform stages need an output file: "
+              "midicomp [stages] in.mid out.mid\n");
+      return 1;
+    }
+    if (terse) {
+      verbose = 0;
+      times = 0;
+      incs = 1;
+    }
     if (verbose) {
       Onmsg   = "On      ch=%-2d  note=%-3s  vol=%-3d\n";
       Offmsg  = "Off     ch=%-2d  note=%-3s  vol=%-3d\n";
@@ -168,6 +392,14 @@ if (dbg) fprintf(stderr, "Compiling %s to %s\n", infile, outfile);
       Pbmsg   = "Pb      ch=%-2d  val=%-3d\n";
       PrChmsg = "ProgCh  ch=%-2d  prog=%-3d\n";
       ChPrmsg = "ChanPr  ch=%-2d  val=%-3d\n";
+      Notemsg = "Note    ch=%-2d  note=%-3s  vol=%-3d  dur=%ld";
+      NoteOffmsg = "  off=%d\n";
+      Rampmsg = "Ramp Param  ch=%-2d  con=%-3d   val=%-3d  dv=%ld  dt=%ld  count=%ld\n";
+      RampPbmsg = "Ramp Pb  ch=%-2d  val=%-3d  dv=%ld  dt=%ld  count=%ld\n";
+    }
+    if (merge) {
+      mergetext(optind < argc ? argv[optind] : "-");
+      return 0;
     }
     if (optind < argc && strcmp(argv[optind], "-") != 0)
       F = efopen(argv[optind], "rb");
@@ -178,35 +410,163 @@ if (dbg) fprintf(stderr, "Compiling %s to %s\n", infile, outfile);
     Mf_getc = filegetc;
     mfread();
     if (ferror(F)) { fprintf(stderr, "Input file error\n"); exit(1); }
+    if (Mf_skipped)
+      fprintf(stderr, "Skipped %d unknown chunk%s\n", Mf_skipped,
+              Mf_skipped == 1 ? "" : "s");
     fclose(F);
   }
   return 0;
 }
 
+/* Resource limits. Every event read (readevent()) or compiled
+   (mywritetrack()), and every track, goes through limitevent() while a
+   limit is set; payload lengths are checked as they're read and output
+   bytes counted as they're written (Lout). The clock is only read every
+   256 events. A tripped limit ends the run with LIMIT_EXIT. */
+
+static long limitms() {
+
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+#else
+  return (long) (clock() / (CLOCKS_PER_SEC / 1000));
+#endif
+}
+
+void limit(char *what, long n) {
+
+  fflush(stdout);
+  fprintf(stderr, "Limit exceeded: %s=%ld\n", what, n);
+  exit(LIMIT_EXIT);
+}
+
+void limitevent() {
+
+  if (Lmaxevents && ++Levents > Lmaxevents) limit("max-events", Lmaxevents);
+  if (Lmaxout && Lout > Lmaxout) limit("max-output-bytes", Lmaxout);
+  if (Lbudget && (++Lticks & 0xff) == 0 && limitms() - Lstart > Lbudget)
+    limit("time-budget-ms", Lbudget);
+}
+
+static void limitpayload(long n) {
+
+  if (Lmaxpayload && n > Lmaxpayload) limit("max-payload", Lmaxpayload);
+}
+
+static void limitarg(long *l, char *opt, char *arg) {
+
+  char *endp;
+  long v = strtol(arg, &endp, 10);
+
+  if (*arg == '\0' || *endp != '\0' || v < 1) {
+    fprintf(stderr, "--%s needs a positive number\n", opt);
+    exit(1);
+  }
+  *l = v;
+  Llimits = 1;
+  Lstart = limitms();
+}
+
 void mfread() {
 
   if (Mf_getc == NULLFUNC)
     mferror("mfread() called without setting Mf_getc");
+  if (Mf_model) {
+    mfmodelread(Mf_model);
+    return;
+  }
 
   readheader();
   while(readtrack()) ;
 }
 
-static int readmt(char *s) {
+/* Read a chunk type, or return EOF at the end of the input. */
+static long readid() {
 
-  int n = 0;
-  char *p = s;
-  int c;
+  long id = 0;
+  int n, c;
 
-  while ( n++<4 && (c=(*Mf_getc)()) != EOF ) {
-    if ( c != *p++ ) {
-      char buff[32];
-      (void) strcpy(buff, "expecting ");
-      (void) strcat(buff, s);
-      mferror(buff);
+  for (n = 0; n < 4; n++) {
+    if ((c = (*Mf_getc)()) == EOF) {
+      if (n == 0) return(EOF);
+      mferror("premature EOF");
     }
+    id = (id << 8) | c;
+  }
+  return(id);
+}
+
+/* Step over n bytes of input, seeking where the input allows it. */
+static void skipbytes(long n) {
+
+  int c;
+
+  if (Mf_getc == riffgetc) {
+    if (n > Mf_riffleft) mferror("premature EOF");
+    Mf_riffleft -= n;
+    Mf_getc = Mf_riffgetc;
+    skipbytes(n);
+    Mf_getc = riffgetc;
+    return;
+  }
+  if (Mf_getc == memgetc) {
+    if (n > Mend - Mp) mferror("premature EOF");
+    Mp += n;
+    return;
+  }
+  if ((Mf_getc == filegetc || Mf_getc == infogetc) && fseek(F, n, SEEK_CUR) == 0) {
+    if (Mf_getc == infogetc) Ipos += n;
+    return;
+  }
+  while (n-- > 0)
+    if ((c = (*Mf_getc)()) == EOF) mferror("premature EOF");
+}
+
+/* An RMID file is a RIFF container whose "data" chunk is the SMF. Skip the
+   RIFF chunks before it and make the input end where it does. */
+int riffgetc() {
+
+  if (Mf_riffleft <= 0) return(EOF);
+  Mf_riffleft--;
+  return((*Mf_riffgetc)());
+}
+
+static long readle32() {
+
+  long v = 0;
+  int i, c;
+
+  for (i = 0; i < 4; i++) {
+    if ((c = (*Mf_getc)()) == EOF) mferror("premature EOF");
+    v |= (long) c << (8 * i);
+  }
+  return(v);
+}
+
+static void readriff() {
+
+  long id, len;
+  int i;
+
+  for (i = 0; i < 4; i++) (void) (*Mf_getc)();    /* the RIFF length */
+  if (readid() != RMID) mferror("RIFF file isn't RMID");
+  while ((id = readid()) != RIFFDATA) {
+    if (id == EOF) mferror("RMID file has no data chunk");
+    len = readle32();
+    skipbytes(len + (len & 1));
+    Mf_skipped++;
+  }
+  len = readle32();
+  if (Mf_getc == memgetc) {
+    if (len < Mend - Mp) Mend = Mp + len;
+  } else {
+    Mf_riffgetc = Mf_getc;
+    Mf_riffleft = len;
+    Mf_getc = riffgetc;
   }
-  return(c);
 }
 
 static int egetc() {
@@ -222,98 +582,229 @@ static int egetc() {
 static void readheader() {
 
   int format, ntrks, division;
+  long id;
 
-  if (readmt("MThd") == EOF) return;
+  Mf_skipped = 0;
+  if ((id = readid()) == RIFF) {
+    readriff();
+    id = readid();
+  }
+  if (id == EOF) return;
+  if (id != MThd) mferror("expecting MThd");
   Mf_toberead = read32bit();
   format      = read16bit();
   ntrks       = read16bit();
   division    = read16bit();
+  if (Mf_check && Mf_toberead < 0) mferror("MThd chunk is too short");
   if (Mf_header) (*Mf_header)(format, ntrks, division);
   while(Mf_toberead > 0) (void) egetc();
 }
 
 static int readtrack() {
 
-  long length;
-  int c, c1, type;
-  int sysexcontinue = 0;
-  int running = 0;
-  int status = 0;
-  int needed;
-  static int chantype[] = {
-    0, 0, 0, 0, 0, 0, 0, 0,
-    2, 2, 2, 2, 1, 1, 2, 0
-  };
+  struct trkstate ts;
+  long id;
 
-  if (readmt("MTrk") == EOF) return(0);
+  /* chunks of other types are skipped, as the SMF spec asks */
+  while ((id = readid()) != MTrk) {
+    if (id == EOF) return(0);
+    skipbytes(read32bit());
+    Mf_skipped++;
+  }
   Mf_toberead = read32bit();
   Mf_currtime = 0;
   old_Mf_currtime = 0;
+  Mf_trackno++;
+  if (Llimits) limitevent();
   if (Mf_starttrack) (*Mf_starttrack)();
 
+  ts.status = 0;
+  ts.sysexcontinue = 0;
+  Mf_eotseen = 0;
   while (Mf_toberead > 0) {
-    old_Mf_currtime=Mf_currtime;
     Mf_currtime += readvarinum();
-    c = egetc();
-    if (sysexcontinue && c != 0xf7)
-      mferror("didn't find expected continuation of a sysex");
-    if ((c & 0x80) == 0) {
-      if (status == 0) mferror("unexpected running status");
-      running = 1;
-      c1 = c;
-      c = status;
-    } else if (c < 0xf0) {
-      status = c;
-      running = 0;
-    }
-    needed = chantype[ (c>>4) & 0xf ];
-    if (needed) {
-      if (!running) c1 = egetc();
-      chanmessage(status, c1, (needed>1) ? egetc() : 0 );
-      continue;
+    readevent(&ts);
+  }
+  if (Mf_check) {
+    if (Mf_toberead < 0) mferror("last event runs past the end of the track");
+    if (!Mf_eotseen) mferror("track doesn't end with an end of track");
+  }
+  if ( Mf_endtrack ) (*Mf_endtrack)();
+  return(1);
+}
+
+/* Read one event (after its delta time) and hand it to the callbacks.
+   The running status and an unfinished SysEx live in *ts, so that several
+   tracks can be read interleaved (see the track merge). */
+static void readevent(struct trkstate *ts) {
+
+  long length;
+  int c, c1 = 0, c2, type;
+  int running = 0;
+  int needed;
+  static int chantype[] = {
+    0, 0, 0, 0, 0, 0, 0, 0,
+    2, 2, 2, 2, 1, 1, 2, 0
+  };
+
+  if (Llimits) limitevent();
+  if (Mf_check && Mf_eotseen) mferror("event after the end of track");
+  c = egetc();
+  if (ts->sysexcontinue && c != 0xf7)
+    mferror("didn't find expected continuation of a sysex");
+  if ((c & 0x80) == 0) {
+    if (ts->status == 0) mferror("unexpected running status");
+    running = 1;
+    c1 = c;
+    c = ts->status;
+  } else if (c < 0xf0) {
+    ts->status = c;
+    running = 0;
+  }
+  needed = chantype[ (c>>4) & 0xf ];
+  if (needed) {
+    if (!running) c1 = egetc();
+    c2 = (needed > 1) ? egetc() : 0;
+    if (Mf_check) {
+      if ((c1 | c2) & 0x80) mferror("data byte with the top bit set");
+      return;
     }
+    chanmessage(ts->status, c1, c2);
+    return;
+  }
+  if (Mf_check) {
+    checkevent(ts, c);
+    return;
+  }
 
-    switch(c) {
-     case 0xff:
-      type = egetc();
-      length = readvarinum();
-      if (length > Mf_toberead) length = Mf_toberead;
-      msginit();
-      while (length-- > 0) msgadd(egetc());
-      metaevent(type);
-      break;
-     case 0xf0:
-      length = readvarinum();
-      if (length > Mf_toberead) length = Mf_toberead;
-      msginit();
-      msgadd(0xf0);
-      c = 0;
-      while (length-- > 0) msgadd(c=egetc());
-      if (c == 0xf7 || Mf_nomerge == 0)
-        sysex();
-      else
-        sysexcontinue = 1;
-      break;
-     case 0xf7:
-      length = readvarinum();
-      if (length > Mf_toberead) length = Mf_toberead;
-      if (! sysexcontinue) msginit();
-      c = 0;
-      while (length-- > 0)  msgadd(c=egetc());
-      if (! sysexcontinue) {
-        if (Mf_arbitrary) (*Mf_arbitrary)(msgleng(), msg());
-      } else if (c == 0xf7) {
-        sysex();
-        sysexcontinue = 0;
-      }
+  switch(c) {
+   case 0xff:
+    type = egetc();
+    length = readvarinum();
+    limitpayload(length);
+    if (length > Mf_toberead) length = Mf_toberead;
+    msginit();
+    while (length-- > 0) msgadd(egetc());
+    metaevent(type);
+    break;
+   case 0xf0:
+    length = readvarinum();
+    limitpayload(length);
+    if (length > Mf_toberead) length = Mf_toberead;
+    if (Mf_sxbegin) {
+      sxstream(ts, c, length);
       break;
-     default:
-      badbyte(c);
+    }
+    msginit();
+    msgadd(0xf0);
+    c = 0;
+    while (length-- > 0) msgadd(c=egetc());
+    if (c == 0xf7 || Mf_nomerge == 0)
+      sysex();
+    else
+      ts->sysexcontinue = 1;
+    break;
+   case 0xf7:
+    length = readvarinum();
+    limitpayload(length);
+    if (length > Mf_toberead) length = Mf_toberead;
+    if (Mf_sxbegin) {
+      sxstream(ts, c, length);
       break;
     }
+    if (! ts->sysexcontinue) msginit();
+    c = 0;
+    while (length-- > 0)  msgadd(c=egetc());
+    if (! ts->sysexcontinue) {
+      if (Mf_arbitrary && WHERE(0xf7, 0, 0, Mf_trackno, Mf_currtime))
+        (*Mf_arbitrary)(msgleng(), msg());
+    } else if (c == 0xf7) {
+      Mf_sxjoined = 1;
+      sysex();
+      Mf_sxjoined = 0;
+      ts->sysexcontinue = 0;
+    }
+    break;
+   default:
+    badbyte(c);
+    break;
+  }
+}
+
+/* Streaming SysEx and Arb, used instead of Mf_sysex and Mf_arbitrary when
+   Mf_sxbegin is set: each packet is handed over as Mf_sxbegin(status,
+   length), Mf_sxdata() for every SXCHUNK bytes and Mf_sxend(more), so a
+   dump of any size is passed on with a fixed buffer and never copied into
+   Msgbuff. A SysEx split into packets is begun by an F0 packet ending with
+   more set, followed by F7 packets up to the one that ends in F7; --where
+   decides on the F0 packet for all of them (sysexcontinue is 2 while a
+   dropped SysEx goes on). */
+static void sxstream(struct trkstate *ts, int status, long length) {
+
+  unsigned char buf[SXCHUNK];
+  int n = 0, c = 0, keep, more;
+
+  if (status == 0xf7 && ts->sysexcontinue)
+    keep = (ts->sysexcontinue == 1);
+  else
+    keep = WHERE(status, 0, 0, Mf_trackno, Mf_currtime);
+  if (keep) (*Mf_sxbegin)(status, length);
+  while (length-- > 0) {
+    buf[n++] = c = egetc();
+    if (n == SXCHUNK) {
+      if (keep && Mf_sxdata) (*Mf_sxdata)(buf, n);
+      n = 0;
+    }
+  }
+  if (keep && n > 0 && Mf_sxdata) (*Mf_sxdata)(buf, n);
+  if (status == 0xf0)
+    more = !(c == 0xf7 || Mf_nomerge == 0);
+  else
+    more = ts->sysexcontinue && c != 0xf7;
+  if (keep && Mf_sxend) (*Mf_sxend)(more);
+  ts->sysexcontinue = more ? (keep ? 1 : 2) : 0;
+}
+
+/* The --check half of readevent() for SysEx, Arb and meta events: the
+   payload is stepped over, not copied, and has to fit in the track. The
+   meta events with a fixed layout must have its length, but a time
+   signature may stop after the denominator, as some writers (and ex1.mid)
+   have it. */
+static void checkevent(struct trkstate *ts, int c) {
+
+  long length;
+  int type = 0, last = 0, want;
+  char buff[64];
+
+  if (c == 0xff) type = egetc();
+  else if (c != 0xf0 && c != 0xf7) badbyte(c);
+  length = readvarinum();
+  limitpayload(length);
+  if (length > Mf_toberead) mferror("event runs past the end of the track");
+  if (c == 0xff) {
+    switch (type) {
+     case sequence_number: want = (length == 0) ? 0 : 2; break;
+     case channel_prefix:  want = 1; break;
+     case end_of_track:    want = 0; break;
+     case set_tempo:       want = 3; break;
+     case smpte_offset:    want = 5; break;
+     case time_signature:  want = (length == 2) ? 2 : 4; break;
+     case key_signature:   want = 2; break;
+     default:              want = length;
+    }
+    if (length != want) {
+      sprintf(buff, "meta event 0x%02x of length %ld, not %d", type, length, want);
+      mferror(buff);
+    }
+  }
+  while (length-- > 0) last = egetc();
+  if (c == 0xff) {
+    if (type == end_of_track) Mf_eotseen = 1;
+  } else if (c == 0xf0) {
+    ts->sysexcontinue = (last != 0xf7);
+  } else if (ts->sysexcontinue && last == 0xf7) {
+    ts->sysexcontinue = 0;
   }
-  if ( Mf_endtrack ) (*Mf_endtrack)();
-  return(1);
 }
 
 static void badbyte(int c) {
@@ -339,6 +830,11 @@ static void metaevent(int type) {
   int leng = msgleng();
   char *m = msg();
 
+  if (!WHERE(0xff, type, 0, Mf_trackno, Mf_currtime)) return;
+  if (Mf_metaraw) {
+    (*Mf_metaraw)(type, leng, m);
+    return;
+  }
   switch (type) {
   case 0x00:
     if (Mf_seqnum)
@@ -393,6 +889,7 @@ static void metaevent(int type) {
 
 static void sysex() {
 
+  if (!WHERE(0xf0, 0, 0, Mf_trackno, Mf_currtime)) return;
   if (Mf_sysex) (*Mf_sysex)(msgleng(), msg());
 }
 
@@ -400,6 +897,7 @@ static void chanmessage(int status, int c1, int c2) {
 
   int chan = status & 0xf;
 
+  if (!WHERE(status, c1, c2, Mf_trackno, Mf_currtime)) return;
   switch(status & 0xf0) {
    case 0x80: if (Mf_off) (*Mf_off)(chan, c1, c2); break;
    case 0x90: if (Mf_on) (*Mf_on)(chan, c1, c2); break;
@@ -518,6 +1016,288 @@ static void biggermsg() {
   Msgbuff = newmess;
 }
 
+/* --where: an event predicate such as "ch==10 && type==on && v>100".
+
+   The expression is compiled once into a small postfix program, then folded
+   against every status byte the reader can deliver (0x80..0xef channel
+   messages, 0xf0 SysEx, 0xf7 Arb, 0xff Meta) with channel and type known.
+   Most statuses fold to a constant, so Wtab[] decides them with one lookup
+   inside chanmessage()/metaevent(); only the rest run the program. */
+
+static char *Wpos;
+static long Wcode[W_MAXCODE];
+static int Wlen = 0, Wdepth, Wnest;
+signed char Wtab[256];
+
+static struct {
+  char *name;
+  long val;
+} Wnames[] = {
+  {"ch", -WF_CH}, {"type", -WF_TYPE}, {"note", -WF_NOTE}, {"n", -WF_NOTE},
+  {"con", -WF_CON}, {"c", -WF_CON}, {"val", -WF_VAL}, {"v", -WF_VAL},
+  {"track", -WF_TRK}, {"trk", -WF_TRK}, {"time", -WF_TIME},
+  {"meta", -WF_META},
+  {"on", 0x90}, {"off", 0x80}, {"popr", 0xa0}, {"par", 0xb0},
+  {"prch", 0xc0}, {"chpr", 0xd0}, {"pb", 0xe0}, {"sysex", 0xf0},
+  {"arb", 0xf7}, {"meta", 0xff},
+  {"seqnr", sequence_number}, {"text", text_event}, {"trkname", sequence_name},
+  {"lyric", lyric}, {"marker", marker}, {"eot", end_of_track},
+  {"tempo", set_tempo}, {"smpte", smpte_offset}, {"timesig", time_signature},
+  {"keysig", key_signature}, {"seqspec", sequencer_specific},
+  {NULL, 0}
+};
+
+static void wherefail(char *s) {
+
+  fprintf(stderr, "--where: %s at '%s'\n", s, Wpos);
+  exit(1);
+}
+
+static void wemit(long op) {
+
+  if (Wlen >= W_MAXCODE) wherefail("expression too long");
+  Wcode[Wlen++] = op;
+}
+
+/* Operands push one value, binary operators pop one; bound the depth so
+   wrun() can use a fixed stack. */
+static void wpush(int n) {
+
+  Wdepth += n;
+  if (Wdepth > W_MAXSTACK) wherefail("expression nested too deeply");
+}
+
+static void wskip() {
+
+  while (*Wpos == ' ' || *Wpos == '\t') Wpos++;
+}
+
+/* Scan a name or number. On the left of a comparison names are fields;
+   on the right they are constants (type, meta type or symbolic note). */
+static long wterm(int *isfield, int rhs) {
+
+  char word[16];
+  int i = 0, k;
+  char *endp;
+  long v;
+
+  wskip();
+  *isfield = 0;
+  if (isdigit((unsigned char)*Wpos) || *Wpos == '-') {
+    v = strtol(Wpos, &endp, 0);
+    if (endp == Wpos) wherefail("number expected");
+    Wpos = endp;
+    return v;
+  }
+  while ((isalnum((unsigned char)*Wpos) || *Wpos == '#') && i < 15)
+    word[i++] = tolower((unsigned char)*Wpos++);
+  word[i] = '\0';
+  if (i == 0) wherefail("name or number expected");
+  for (k = 0; Wnames[k].name; k++)
+    if ((Wnames[k].val < 0) != rhs && strcmp(word, Wnames[k].name) == 0) {
+      *isfield = Wnames[k].val < 0;
+      return *isfield ? -Wnames[k].val : Wnames[k].val;
+    }
+  /* a symbolic note, as accepted by the compiler (c4, f#2, bb3) */
+  if (word[0] >= 'a' && word[0] <= 'g') {
+    static int notes[] = {9, 11, 0, 2, 4, 5, 7};
+    char *p = word + 1;
+    v = notes[word[0] - 'a'];
+    if (*p == '#') { v++; p++; }
+    else if (*p == 'b' && p[1] != '\0') { v--; p++; }
+    if (isdigit((unsigned char)*p)) return v + 12 * atoi(p);
+  }
+  wherefail("unknown name");
+  return 0;
+}
+
+static void wor();
+
+static void wprimary() {
+
+  int isfield, op;
+  long a;
+
+  wskip();
+  if (++Wnest > W_MAXSTACK) wherefail("expression nested too deeply");
+  if (*Wpos == '!') {
+    Wpos++;
+    wprimary();
+    wemit(WOP_NOT);
+    Wnest--;
+    return;
+  }
+  if (*Wpos == '(') {
+    Wpos++;
+    wor();
+    wskip();
+    if (*Wpos++ != ')') wherefail("')' expected");
+    Wnest--;
+    return;
+  }
+  Wnest--;
+  a = wterm(&isfield, 0);
+  if (!isfield) wherefail("field expected");
+  wskip();
+  switch (*Wpos) {
+   case '=': op = WOP_EQ; if (Wpos[1] == '=') Wpos++; break;
+   case '!': op = WOP_NE; if (Wpos[1] != '=') wherefail("'!=' expected");
+     Wpos++; break;
+   case '<': op = WOP_LT; if (Wpos[1] == '=') { op = WOP_LE; Wpos++; } break;
+   case '>': op = WOP_GT; if (Wpos[1] == '=') { op = WOP_GE; Wpos++; } break;
+   default: wherefail("comparison expected"); return;
+  }
+  Wpos++;
+  wemit(WOP_FIELD);
+  wemit(a);
+  wemit(WOP_CONST);
+  wemit(wterm(&isfield, 1));
+  wpush(2);
+  wemit(op);
+  wpush(-1);
+}
+
+static void wand() {
+
+  wprimary();
+  for (;;) {
+    wskip();
+    if (Wpos[0] != '&' || Wpos[1] != '&') return;
+    Wpos += 2;
+    wprimary();
+    wemit(WOP_AND);
+    wpush(-1);
+  }
+}
+
+static void wor() {
+
+  wand();
+  for (;;) {
+    wskip();
+    if (Wpos[0] != '|' || Wpos[1] != '|') return;
+    Wpos += 2;
+    wand();
+    wemit(WOP_OR);
+    wpush(-1);
+  }
+}
+
+/* Run the program. With known == NULL every field is known; otherwise
+   only the fields flagged in known[] are, and the result is three-valued
+   (1 true, 0 false, -1 depends on the event). */
+static int wrun(long *f, int *known) {
+
+  long st[W_MAXSTACK];
+  int kn[W_MAXSTACK];
+  int sp = 0, pc = 0;
+  long a, b;
+  int ka, kb;
+
+  while (pc < Wlen) {
+    switch (Wcode[pc++]) {
+     case WOP_FIELD:
+      kn[sp] = known ? known[Wcode[pc]] : 1;
+      st[sp++] = f[Wcode[pc++]];
+      break;
+     case WOP_CONST:
+      kn[sp] = 1;
+      st[sp++] = Wcode[pc++];
+      break;
+     case WOP_NOT:
+      st[sp-1] = !st[sp-1];
+      break;
+     case WOP_AND:
+     case WOP_OR:
+      b = st[--sp]; kb = kn[sp];
+      a = st[sp-1]; ka = kn[sp-1];
+      if (Wcode[pc-1] == WOP_AND) {
+        if ((ka && !a) || (kb && !b)) { st[sp-1] = 0; kn[sp-1] = 1; }
+        else { st[sp-1] = 1; kn[sp-1] = ka && kb; }
+      } else {
+        if ((ka && a) || (kb && b)) { st[sp-1] = 1; kn[sp-1] = 1; }
+        else { st[sp-1] = 0; kn[sp-1] = ka && kb; }
+      }
+      break;
+     default:
+      b = st[--sp]; kb = kn[sp];
+      a = st[sp-1]; ka = kn[sp-1];
+      switch (Wcode[pc-1]) {
+       case WOP_EQ: a = (a == b); break;
+       case WOP_NE: a = (a != b); break;
+       case WOP_LT: a = (a < b); break;
+       case WOP_LE: a = (a <= b); break;
+       case WOP_GT: a = (a > b); break;
+       default:     a = (a >= b); break;
+      }
+      st[sp-1] = a;
+      kn[sp-1] = ka && kb;
+    }
+  }
+  return kn[0] ? (int) st[0] : -1;
+}
+
+/* Fill the field vector for one event; fields that don't apply are -1. */
+static void wfields(long *f, int status, int c1, int c2) {
+
+  int i;
+
+  for (i = 0; i < WF_N; i++) f[i] = -1;
+  if (status < 0xf0) {
+    f[WF_CH] = (status & 0xf) + 1;
+    f[WF_TYPE] = status & 0xf0;
+    switch (status & 0xf0) {
+     case 0x80: case 0x90: case 0xa0:
+      f[WF_NOTE] = c1; f[WF_VAL] = c2; break;
+     case 0xb0:
+      f[WF_CON] = c1; f[WF_VAL] = c2; break;
+     case 0xe0:
+      f[WF_VAL] = 128*c2 + c1; break;
+     default:
+      f[WF_VAL] = c1; break;
+    }
+  } else {
+    f[WF_TYPE] = status;
+    if (status == 0xff) f[WF_META] = c1;
+  }
+}
+
+int whereeval(int status, int c1, int c2, int trk, long t) {
+
+  long f[WF_N];
+
+  wfields(f, status, c1, c2);
+  f[WF_TRK] = trk;
+  f[WF_TIME] = t;
+  return wrun(f, NULL);
+}
+
+/* Compile a --where expression and build the per-status decision table. */
+void wherecompile(char *s) {
+
+  int known[WF_N];
+  long f[WF_N];
+  int st, m, i;
+
+  Wpos = s;
+  Wlen = Wdepth = Wnest = 0;
+  wor();
+  wskip();
+  if (*Wpos) wherefail("unexpected text");
+  for (st = 0; st < 256; st++) {
+    if (st < 0x80 || (st >= 0xf0 && st != 0xf0 && st != 0xf7 && st != 0xff))
+      continue;
+    /* channel and type are fixed by the status byte, and so is every
+       field that doesn't apply to it (-1); the rest vary per event */
+    wfields(f, st, 0, 0);
+    for (i = 0; i < WF_N; i++)
+      known[i] = (i == WF_CH || i == WF_TYPE || f[i] == -1);
+    known[WF_TRK] = known[WF_TIME] = 0;
+    m = wrun(f, known);
+    Wtab[st] = (m < 0) ? W_EVAL : (m ? W_KEEP : W_DROP);
+  }
+}
+
 void mfwrite(int format, int ntracks, int division, FILE *fp) {
 
   int i;
@@ -594,7 +1374,7 @@ int mf_w_midi_event(
   unsigned char *data,
   unsigned long size) {
 
-  int i;
+  int i, fold = 0;
   unsigned char c;
 
   WriteVarLen(delta_time);
@@ -603,13 +1383,21 @@ int mf_w_midi_event(
     fprintf(stderr, "error: MIDI channel %u out of range, masking to 0-15\n", chan);
     chan &= 0x0f;
   }
+  /* Mf_RunStat > 1: a note-off is sent as note-on v=0, which continues a
+     running status run of note-ons (the release velocity is lost) */
+  if (Mf_RunStat > 1 && type == note_off) {
+    type = note_on;
+    fold = 1;
+  }
   c = type | chan;
 
   if (!Mf_RunStat || laststat != c)
     eputc(c);
+  else
+    Mf_rssaved++;
   laststat = c;
   for(i = 0; i < size; i++)
-  eputc(data[i]);
+  eputc((fold && i == 1) ? 0 : data[i]);
 
   return(size);
 }
@@ -655,22 +1443,63 @@ int mf_w_sysex_event(
   return(size);
 }
 
-void mf_w_tempo(unsigned long delta_time, unsigned long tempo) {
+/* An F7 "escape" event: size bytes of data, written after the F7 and its
+   length (the decoder hands these to Mf_arbitrary without the F7). */
+int mf_w_arb_event(
+  unsigned long delta_time,
+  unsigned char *data,
+  unsigned long size) {
+
+  int i;
 
   WriteVarLen(delta_time);
-  eputc(meta_event);
-  laststat = meta_event;
-  eputc(set_tempo);
-  eputc(3);
-  eputc((unsigned)(0xff & (tempo >> 16)));
-  eputc((unsigned)(0xff & (tempo >> 8)));
-  eputc((unsigned)(0xff & tempo));
+  eputc(0xf7);
+  laststat = 0;
+  WriteVarLen(size);
+  for(i = 0; i < size; i++) {
+    if(eputc(data[i]) != data[i]) return(-1);
+  }
+  return(size);
 }
 
-unsigned long mf_sec2ticks(float secs, int division, unsigned int tempo) {
+/* A SysEx or Arb written as it is read: the status and length first, then
+   the payload through mf_w_sysex_data() in as many pieces as it comes. */
+void mf_w_sysex_begin(unsigned long delta_time, int status, unsigned long size) {
 
-   return (long)(((secs * 1000.0) / 4.0 * division) / tempo);
-}
+  WriteVarLen(delta_time);
+  eputc(status);
+  laststat = 0;
+  WriteVarLen(size);
+}
+
+void mf_w_sysex_data(unsigned char *data, int n) {
+
+  if (Lmaxout && Lout + n > Lmaxout) limit("max-output-bytes", Lmaxout);
+  if (Mf_putc == fileputc) {
+    if (fwrite(data, 1, n, F) != n) mferror("error writing sysex");
+    Mf_numbyteswritten += n;
+    Lout += n;
+    return;
+  }
+  while (n-- > 0) eputc(*data++);
+}
+
+void mf_w_tempo(unsigned long delta_time, unsigned long tempo) {
+
+  WriteVarLen(delta_time);
+  eputc(meta_event);
+  laststat = meta_event;
+  eputc(set_tempo);
+  eputc(3);
+  eputc((unsigned)(0xff & (tempo >> 16)));
+  eputc((unsigned)(0xff & (tempo >> 8)));
+  eputc((unsigned)(0xff & tempo));
+}
+
+unsigned long mf_sec2ticks(float secs, int division, unsigned int tempo) {
+
+   return (long)(((secs * 1000.0) / 4.0 * division) / tempo);
+}
 
 void WriteVarLen(unsigned long value) {
 
@@ -732,6 +1561,7 @@ int eputc(unsigned char c) {
 
   if (return_val == EOF) mferror("error writing");
   Mf_numbyteswritten++;
+  Lout++;
   return(return_val);
 }
 
@@ -747,14 +1577,253 @@ char *mknote(int pitch) {
   return buf;
 }
 
+/* --durations: an On is printed as a Note line once its Off is seen, so
+   from the first unpaired On the text after it is held in Nbuf, with a
+   hole (Nhole) where each Note line goes. Pending Notes are found through
+   Nslot[chan][pitch], a stack per key for overlapping notes; noteflush()
+   writes out the text up to the oldest one still unpaired. --ramps holds
+   each Par and Pb the same way, in Rslot[chan][controller] (Pb in 128),
+   and joins the events that follow it at a constant step in time and value
+   to it until one doesn't; the run is printed as a Ramp line. */
+
+static char *Nbuf;
+static long Nlen, Nsize, Nout;
+static struct nhole *Nhole;
+static int Nnhole, Nholesize, Nfirst;
+static int Nslot[16][128];      /* 1 + index of the newest held Note */
+static int Rslot[16][129];      /* 1 + index of the open run */
+static long Rtick = -1;         /* the tick of the last event decoded */
+static long Rkey;               /* the seq of the point before it, if it
+                                   joined a run, or of the Note it was the
+                                   Off of, or else -1 */
+static long Rseq;               /* counts the points of runs, and under
+                                   --durations the Notes */
+
+static void nwrite(char *s, long n) {
+
+  if (n > 0 && fwrite(s, 1, n, stdout) != n) mferror("error writing");
+  Lout += n;
+}
+
+/* The text printers write through these, so --max-output-bytes can count
+   what they print, and --durations can hold it back. */
+int outf(char *fmt, ...) {
+
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  if (Nnhole == 0) {
+    n = vprintf(fmt, ap);
+    if (n > 0) Lout += n;
+  } else {
+    va_list aq;
+    va_copy(aq, ap);
+    n = vsnprintf(Nbuf + Nlen, Nsize - Nlen, fmt, ap);
+    if (n >= Nsize - Nlen) {
+      while (n >= Nsize - Nlen) Nsize = Nsize ? 2 * Nsize : XBUFSIZE;
+      if ((Nbuf = realloc(Nbuf, Nsize)) == NULL) fatal("Out of memory");
+      vsnprintf(Nbuf + Nlen, Nsize - Nlen, fmt, aq);
+    }
+    va_end(aq);
+    if (n > 0) Nlen += n;
+  }
+  va_end(ap);
+  return n;
+}
+
+int outc(int c) {
+
+  if (Nnhole == 0) {
+    Lout++;
+    return putchar(c);
+  }
+  if (Nlen == Nsize) {
+    Nsize = Nsize ? 2 * Nsize : XBUFSIZE;
+    if ((Nbuf = realloc(Nbuf, Nsize)) == NULL) fatal("Out of memory");
+  }
+  Nbuf[Nlen++] = c;
+  return c;
+}
+
+static struct nhole *newhole(int chan, int pitch, int vol) {
+
+  struct nhole *h;
+
+  if (Nnhole == Nholesize) {
+    Nholesize = Nholesize ? 2 * Nholesize : 64;
+    Nhole = realloc(Nhole, Nholesize * sizeof(struct nhole));
+    if (Nhole == NULL) fatal("Out of memory");
+  }
+  h = &Nhole[Nnhole];
+  h->pos = Nlen;
+  h->on = Mf_currtime;
+  h->dur = -1;
+  h->chan = chan;
+  h->pitch = pitch;
+  h->vol = vol;
+  h->ramp = 0;
+  if (terse) strcpy(h->tch, tch(chan));
+  return h;
+}
+
+/* Hold a Note; its time has been printed already. */
+static void notehold(int chan, int pitch, int vol) {
+
+  struct nhole *h = newhole(chan, pitch, vol);
+
+  h->below = Nslot[chan][pitch] - 1;
+  h->seq = ++Rseq;
+  Nslot[chan][pitch] = ++Nnhole;
+}
+
+/* Hold a Par (or a Pb, control 128) as the first point of a run. */
+static void ramphold(int chan, int control, int value) {
+
+  struct nhole *h = newhole(chan, control, value);
+
+  h->ramp = 1;
+  h->count = 1;
+  h->seq = ++Rseq;
+  Rslot[chan][control] = ++Nnhole;
+}
+
+/* Join a Par or Pb to the open run on its controller if it steps on from
+   the run's last point, the first step being at most a beat. Returns 0,
+   ending the run, if it doesn't. */
+static int rampjoin(int chan, int control, int value) {
+
+  struct nhole *h;
+  long t = Mf_currtime, dt;
+  int i = Rslot[chan][control] - 1;
+
+  if (i < 0) return 0;
+  h = &Nhole[i];
+  dt = (h->count == 1) ? t - h->on : h->dt;
+  if (h->count == 1 ? dt > 0 && dt <= Beat :
+      t == h->on + h->count * dt && value == h->vol + h->count * h->dv) {
+    /* The compiler writes the Ramp points due at a tick before the line
+       at that tick, each queued as the point before it was written. So a
+       point only joins if nothing but points queued before its own came
+       before it at its tick. */
+    if (t != Rtick || (Rkey >= 0 && h->seq > Rkey)) {
+      if (h->count == 1) {
+        h->dt = dt;
+        h->dv = value - h->vol;
+      }
+      h->count++;
+      Rtick = t;
+      Rkey = h->seq;
+      h->seq = ++Rseq;
+      return 1;
+    }
+  }
+  Rslot[chan][control] = 0;
+  h->dur = 0;
+  if (i == Nfirst) noteflush(0);
+  return 0;
+}
+
+/* An Off (off is its velocity) or On v=0 (off is -1): pair it with the
+   newest Note held on its key. Returns 0 if there is none. */
+static int notepaired(int chan, int pitch, int off) {
+
+  struct nhole *h;
+
+  if (Nslot[chan][pitch] == 0) return 0;
+  h = &Nhole[Nslot[chan][pitch] - 1];
+  Nslot[chan][pitch] = h->below + 1;
+  h->dur = Mf_currtime - h->on;
+  h->off = off;
+  /* The compiler queues the Off as it reads the Note line, so it goes with
+     the points at its tick in that order; a point after it at this tick
+     may only join a run queued after the Note. */
+  if (Mf_currtime != Rtick) {
+    Rtick = Mf_currtime;
+    Rkey = h->seq;
+  } else if (Rkey >= 0 && h->seq > Rkey)
+    Rkey = h->seq;
+  if (h == &Nhole[Nfirst]) noteflush(0);
+  return 1;
+}
+
+/* A held run's line: a Ramp, or the plain Par or Pb of a lone point. */
+static int rampline(char *line, int size, struct nhole *h) {
+
+  if (h->count == 1) {
+    if (h->pitch == 128)
+      return terse ? snprintf(line, size, "Pb%s %d\n", h->tch, h->vol) :
+        snprintf(line, size, Pbmsg, h->chan+1, h->vol);
+    return terse ? snprintf(line, size, "Par%s %d %d\n", h->tch, h->pitch, h->vol) :
+      snprintf(line, size, Parmsg, h->chan+1, h->pitch, h->vol);
+  }
+  if (h->pitch == 128)
+    return terse ? snprintf(line, size, "Ramp Pb%s %d %ld %ld %ld\n", h->tch,
+                            h->vol, h->dv, h->dt, h->count) :
+      snprintf(line, size, RampPbmsg, h->chan+1, h->vol, h->dv, h->dt, h->count);
+  return terse ? snprintf(line, size, "Ramp Par%s %d %d %ld %ld %ld\n", h->tch,
+                          h->pitch, h->vol, h->dv, h->dt, h->count) :
+    snprintf(line, size, Rampmsg, h->chan+1, h->pitch, h->vol, h->dv, h->dt,
+             h->count);
+}
+
+/* Write out the held text up to the oldest unpaired Note or open run (a
+   run is over once its next point is overdue), or with all set (at the end
+   of a track) all of it, unpaired Notes as plain On lines. */
+static void noteflush(int all) {
+
+  struct nhole *h;
+  char line[128];
+  int n;
+
+  for (; Nfirst < Nnhole; Nfirst++) {
+    h = &Nhole[Nfirst];
+    if (h->dur < 0 && !all) {
+      if (!h->ramp ||
+          Mf_currtime <= h->on + (h->count > 1 ? h->count * h->dt : Beat))
+        return;
+      h->dur = 0;
+    }
+    nwrite(Nbuf + Nout, h->pos - Nout);
+    Nout = h->pos;
+    if (h->ramp) {
+      if (Rslot[h->chan][h->pitch] == Nfirst + 1) Rslot[h->chan][h->pitch] = 0;
+      n = rampline(line, sizeof(line), h);
+    } else if (h->dur < 0) {
+      Nslot[h->chan][h->pitch] = 0;
+      if (terse)
+        n = snprintf(line, sizeof(line), "On%s %s %d\n", h->tch,
+                     mknote(h->pitch), h->vol);
+      else
+        n = snprintf(line, sizeof(line), Onmsg, h->chan+1, mknote(h->pitch), h->vol);
+    } else {
+      if (terse)
+        n = snprintf(line, sizeof(line), "Note%s %s %d %ld", h->tch,
+                     mknote(h->pitch), h->vol, h->dur);
+      else
+        n = snprintf(line, sizeof(line), Notemsg, h->chan+1, mknote(h->pitch),
+                     h->vol, h->dur);
+      if (h->off >= 0)
+        n += snprintf(line + n, sizeof(line) - n, NoteOffmsg, h->off);
+      else
+        line[n++] = '\n';
+    }
+    nwrite(line, n);
+  }
+  nwrite(Nbuf + Nout, Nlen - Nout);
+  Nlen = Nout = 0;
+  Nnhole = Nfirst = 0;
+}
+
 void myheader(int format, int ntrks, int division) {
 
   if (division & 0x8000) {
     times = 0;
-    printf("MFile %d %d %d %d\n",
-      format, ntrks, -((-(division>>8))&0xff), division&0xff);
+    outf("MFile %d %d %d %d%s\n",
+      format, ntrks, -((-(division>>8))&0xff), division&0xff,
+      terse ? " terse" : "");
   } else {
-    printf("MFile %d %d %d\n", format, ntrks, division);
+    outf("MFile %d %d %d%s\n", format, ntrks, division, terse ? " terse" : "");
   }
   if (format > 2) {
     fprintf(stderr, "Can't deal with format %d files\n", format);
@@ -769,76 +1838,112 @@ void myheader(int format, int ntrks, int division) {
 
 void mytrstart() {
 
-  printf("MTrk\n");
+  Tchan = -1;
+  Rtick = -1;
+  outf("MTrk\n");
   TrkNr ++;
 }
 
 void mytrend() {
 
-  printf("TrkEnd\n");
+  mysxflush();
+  if (Nnhole) noteflush(1);
+  outf("TrkEnd\n");
   --TrksToDo;
 }
 
+/* --terse: the channel, printed only when it isn't the last one printed */
+static char *tch(int chan) {
+
+  static char buf[16];
+
+  if (chan == Tchan) return "";
+  Tchan = chan;
+  sprintf(buf, " %d", chan+1);
+  return buf;
+}
+
+/* A note byte above 127 (the reader passes on what it finds) is printed
+   as it is, never held or paired. */
 void mynon(int chan, int pitch, int vol) {
 
+  int hold = durations && pitch < 128;
+
+  if (hold && vol == 0 && notepaired(chan, pitch, -1)) return;
   prtime();
-  printf(Onmsg, chan+1, mknote(pitch), vol);
+  if (hold && vol > 0) notehold(chan, pitch, vol);
+  else if (terse) outf("On%s %s %d\n", tch(chan), mknote(pitch), vol);
+  else outf(Onmsg, chan+1, mknote(pitch), vol);
 }
 
 void mynoff(int chan, int pitch, int vol) {
 
+  if (durations && pitch < 128 && notepaired(chan, pitch, vol)) return;
   prtime();
-  printf(Offmsg, chan+1, mknote(pitch), vol);
+  if (terse) outf("Off%s %s %d\n", tch(chan), mknote(pitch), vol);
+  else outf(Offmsg, chan+1, mknote(pitch), vol);
 }
 
 void mypressure(int chan, int pitch, int press) {
 
   prtime();
-  printf(PoPrmsg, chan+1, mknote(pitch), press);
+  if (terse) outf("PoPr%s %s %d\n", tch(chan), mknote(pitch), press);
+  else outf(PoPrmsg, chan+1, mknote(pitch), press);
 }
 
+/* As with notes, a controller byte above 127 is never part of a run. */
 void myparameter(int chan, int control, int value) {
 
+  int run = ramps && control < 128;
+
+  if (run && rampjoin(chan, control, value)) return;
   prtime();
-  printf(Parmsg, chan+1, control, value);
+  if (run) ramphold(chan, control, value);
+  else if (terse) outf("Par%s %d %d\n", tch(chan), control, value);
+  else outf(Parmsg, chan+1, control, value);
 }
 
 void mypitchbend(int chan, int lsb, int msb) {
 
+  if (ramps && rampjoin(chan, 128, 128*msb+lsb)) return;
   prtime();
-  printf(Pbmsg, chan+1, 128*msb+lsb);
+  if (ramps) ramphold(chan, 128, 128*msb+lsb);
+  else if (terse) outf("Pb%s %d\n", tch(chan), 128*msb+lsb);
+  else outf(Pbmsg, chan+1, 128*msb+lsb);
 }
 
 void myprogram(int chan, int program) {
 
   prtime();
-  printf(PrChmsg, chan+1, program);
+  if (terse) outf("PrCh%s %d\n", tch(chan), program);
+  else outf(PrChmsg, chan+1, program);
 }
 
 void mychanpressure(int chan, int press) {
 
   prtime();
-  printf(ChPrmsg, chan+1, press);
+  if (terse) outf("ChPr%s %d\n", tch(chan), press);
+  else outf(ChPrmsg, chan+1, press);
 }
 
 void mysysex(int leng, char *mess) {
 
   prtime();
-  printf("SysEx");
+  outf("SysEx");
   prhex (mess, leng);
 }
 
 void mymmisc(int type, int leng, char *mess) {
 
   prtime();
-  printf("Meta 0x%02x", type);
+  outf("Meta 0x%02x", type);
   prhex(mess, leng);
 }
 
 void mymspecial(int leng, char *mess) {
 
   prtime();
-  printf("SeqSpec");
+  outf("SeqSpec");
   prhex(mess, leng);
 }
 
@@ -851,36 +1956,36 @@ void mymtext(int type, int leng, char *mess) {
   int unrecognized = (sizeof(ttype)/sizeof(char *)) - 1;
   prtime();
   if (type < 1 || type > unrecognized)
-    printf("Meta 0x%02x ", type);
+    outf("Meta 0x%02x ", type);
   else if (type == 3 && TrkNr == 1)
-    printf("Meta SeqName ");
+    outf("Meta SeqName ");
   else
-    printf("Meta %s ", ttype[type]);
+    outf("Meta %s ", ttype[type]);
   prtext (mess, leng);
 }
 
 void mymseq(int num) {
 
   prtime();
-  printf("SeqNr %d\n", num);
+  outf("SeqNr %d\n", num);
 }
 
 void mymeot() {
 
   prtime();
-  printf("Meta TrkEnd\n");
+  outf("Meta TrkEnd\n");
 }
 
 void mykeysig(int sf, int mi) {
 
   prtime();
-  printf("KeySig %d %s\n", (sf > 127 ? sf-256 : sf), (mi ? "minor" : "major"));
+  outf("KeySig %d %s\n", (sf > 127 ? sf-256 : sf), (mi ? "minor" : "major"));
 }
 
 void mytempo(long tempo) {
 
   prtime();
-  printf("Tempo %ld\n", tempo);
+  outf("Tempo %ld\n", tempo);
 }
 
 void mytimesig(int nn, int dd, int cc, int bb) {
@@ -892,7 +1997,7 @@ void mytimesig(int nn, int dd, int cc, int bb) {
   if (dd > 24) dd = 24;
   while (dd-- > 0) denom *= 2;
   prtime();
-  printf("TimeSig %d/%d %d %d\n", nn, denom, cc, bb);
+  outf("TimeSig %d/%d %d %d\n", nn, denom, cc, bb);
   /* Beat/Measure are kept >= 1 below, so this divisor is never zero. */
   M0 += (Mf_currtime-T0)/(Beat*Measure);
   T0 = Mf_currtime;
@@ -905,37 +2010,90 @@ void mytimesig(int nn, int dd, int cc, int bb) {
 void mysmpte(int hr, int mn, int se, int fr, int ff) {
 
   prtime();
-  printf("SMPTE %d %d %d %d %d\n", hr, mn, se, fr, ff);
+  outf("SMPTE %d %d %d %d %d\n", hr, mn, se, fr, ff);
 }
 
 void myarbitrary(int leng, char *mess) {
 
   prtime();
-  printf("Arb");
+  outf("Arb");
   prhex(mess, leng);
 }
 
+/* The streaming forms of mysysex() and myarbitrary(). A SysEx's line is
+   printed when its last packet has been read, at that packet's time, as
+   when it was read whole: its bytes are held in Sxhold until then. One too
+   big for Sxhold is begun at the time of the packet that overflows it,
+   and the rest of it streams. The F7 packets that continue a SysEx carry
+   on its line. */
+static unsigned char Sxhold[XBUFSIZE];
+static long Sxn = -1;           /* bytes held, -1 once the line is begun */
+static int Sxmore = 0, Sxstatus;
+
+static void mysxline() {
+
+  prtime();
+  outf(Sxstatus == 0xf0 ? "SysEx" : "Arb");
+  Hexpos = 25;
+  prhexdata(Sxhold, Sxn);
+  Sxn = -1;
+}
+
+void mysxbegin(int status, long leng) {
+
+  if (Sxmore) return;
+  Sxstatus = status;
+  Sxhold[0] = 0xf0;
+  Sxn = (status == 0xf0);
+}
+
+void mysxdata(unsigned char *p, int n) {
+
+  if (Sxn >= 0 && Sxn + n > sizeof(Sxhold)) mysxline();
+  if (Sxn < 0) {
+    prhexdata(p, n);
+    return;
+  }
+  memcpy(Sxhold + Sxn, p, n);
+  Sxn += n;
+}
+
+void mysxend(int more) {
+
+  Sxmore = more;
+  if (more) return;
+  if (Sxn >= 0) mysxline();
+  outf("\n");
+}
+
+/* At the end of a track: a SysEx whose last packet never came. */
+static void mysxflush() {
+
+  if (Sxmore) mysxend(0);
+}
+
 void prtime() {
+    if (ramps && Nnhole) noteflush(0);
     if (times) 
       {
 	if (incs)
 	  {
 	    long m = (Mf_currtime-old_Mf_currtime)/Beat;
 	    if (verbose)
-	      printf("%03ld:%02ld:%03ld ",
+	      outf("%03ld:%02ld:%03ld ",
 		     m/Measure+M0,m%Measure,(Mf_currtime-old_Mf_currtime)%Beat);
 	    else
-	      printf("%ld:%ld:%ld ",
+	      outf("%ld:%ld:%ld ",
 		     m/Measure+M0,m%Measure,(Mf_currtime-old_Mf_currtime)%Beat);
 	  }
 	else
 	  {
 	    long m = (Mf_currtime-T0)/Beat;
 	    if (verbose)
-	      printf("%03ld:%02ld:%03ld ",
+	      outf("%03ld:%02ld:%03ld ",
 		     m/Measure+M0,m%Measure,(Mf_currtime-T0)%Beat);
 	    else
-	      printf("%ld:%ld:%ld ",
+	      outf("%ld:%ld:%ld ",
 		     m/Measure+M0,m%Measure,(Mf_currtime-T0)%Beat);
 	  }
       } 
@@ -944,18 +2102,25 @@ void prtime() {
 	if (incs)
 	  {
 	    if (verbose)
-	      printf("%-10ld ", Mf_currtime - old_Mf_currtime);
-	    else
-	      printf("%ld ", Mf_currtime - old_Mf_currtime);
+	      outf("%-10ld ", Mf_currtime - old_Mf_currtime);
+	    else if (!terse || Mf_currtime != old_Mf_currtime)
+	      outf("%ld ", Mf_currtime - old_Mf_currtime);
 	  }
 	else
 	  {
 	    if (verbose)
-	      printf("%-10ld ", Mf_currtime);
+	      outf("%-10ld ", Mf_currtime);
 	    else
-	      printf("%ld ", Mf_currtime);
+	      outf("%ld ", Mf_currtime);
 	  }
       }
+    /* incremental times are relative to the last event actually printed,
+       so events dropped by --where fold their delta into the next one. */
+    old_Mf_currtime = Mf_currtime;
+    if (ramps) {
+      Rtick = Mf_currtime;
+      Rkey = -1;
+    }
 }
 
 void prtext(unsigned char *p, int leng) {
@@ -963,63 +2128,70 @@ void prtext(unsigned char *p, int leng) {
   int n, c;
   int pos = 25;
 
-  printf("\"");
+  outf("\"");
   for ( n=0; n<leng; n++ ) {
     c = *p++;
     if (fold && pos >= fold) {
-      printf ("\\\n\t");
+      outf("\\\n\t");
       pos = 13;  /* tab + \xab + \ */
       if (c == ' ' || c == '\t') {
-        putchar ('\\');
+        outc('\\');
         ++pos;
       }
     }
     switch (c) {
      case '\\':
      case '"':
-      printf ("\\%c", c);
+      outf("\\%c", c);
       pos += 2;
       break;
      case '\r':
-      printf ("\\r");
+      outf("\\r");
       pos += 2;
       break;
      case '\n':
-      printf ("\\n");
+      outf("\\n");
       pos += 2;
       break;
      case '\0':
-      printf ("\\0");
+      outf("\\0");
       pos += 2;
       break;
      default:
       if (isprint(c)) {
-        putchar(c);
+        outc(c);
         ++pos;
       } else {
-        printf("\\x%02x" , c);
+        outf("\\x%02x" , c);
         pos += 4;
       }
     }
   }
-  printf("\"\n");
+  outf("\"\n");
 }
 
 void prhex(unsigned char *p, int leng) {
 
+  Hexpos = 25;
+  prhexdata(p, leng);
+  outf("\n");
+}
+
+/* The bytes of prhex(), which can come in several calls (Hexpos keeps the
+   column for --fold across them). */
+void prhexdata(unsigned char *p, int leng) {
+
   int n;
-  int pos = 25;
 
   for(n = 0; n < leng; n++, p++) {
-    if (fold && pos >= fold) {
-      printf ("\\\n\t%02x", *p);
-      pos = 14;
+    if (fold && Hexpos >= fold) {
+      outf("\\\n\t%02x", *p);
+      Hexpos = 14;
     } else {
-      printf(" %02x", *p);
-      pos += 3;
+      outf(" %02x", *p);
+      Hexpos += 3;
     }
   }
-  printf("\n");
 }
 
 void myerror(char *s) {
@@ -1054,365 +2226,4220 @@ void initfuncs() {
   Mf_sqspecific =  mymspecial;
   Mf_text =  mymtext;
   Mf_arbitrary =  myarbitrary;
+  Mf_sxbegin = mysxbegin;
+  Mf_sxdata = mysxdata;
+  Mf_sxend = mysxend;
 }
 
-void prs_error(char *s) {
-
-  int c;
-  int count;
-  int ln = (eol_seen? lineno-1 : lineno);
-  fprintf(stderr, "%d: %s\n", ln, s);
-  if (yyleng > 0 && *yytext != '\n')
-    fprintf(stderr, "*** %*s ***\n", yyleng, yytext);
-  count = 0;
-  while (count < 100 &&
-     (c=yylex()) != EOL && c != EOF) count++/* skip rest of line */;
-  if (c == EOF) exit(1);
-  if (err_cont)
-    longjmp(erjump, 1);
+/* Binary transform path: SMF in, SMF out, no text in between.
+
+   mfwrite() pulls one output track at a time through xwritetrack(), which
+   reads the matching input track with readtrack(). Every decoded event is
+   packed into a struct mfevent, passed through the stages given on the
+   command line (in order; a stage returns 0 to drop the event) and written
+   straight back with the mf_w_* writers. */
+
+static int Xformat = -1, Xntrks, Xdivision;
+static long Xwtime, Xeot;
+static int (*Xstage[XMAXSTAGE])();
+static struct xplugin *Xplug[XMAXSTAGE];
+static struct xbuf Xsplit[17];      /* --split-channels: conductor, ch 1-16 */
+static struct xbuf Xsplitnames;     /* track names waiting for their channel */
+static int Xsplitmap[17], Xnsplit, Xsplitting;
+static int *Xsplitfirst, *Xsplitprefix;     /* per input track */
+static long Xoffset = 0, Xmul = 1, Xdiv = 1;
+static struct xinput *Xin;          /* --concat, --layer */
+static int Xnin;
+static int Xpatching;               /* --in-place: xpatch() the events */
+static int Xpacking;                /* --packed: pkrecord() them */
+
+static int Xtranspose = 0;
+static int Xvelocity = 100;
+static int Xchmap[16];
+static char Xdrop[256];
+static char Xdropmeta[256];
+static double Xtempo = 1.0;
+static char Xtouch[256 + 256];      /* statuses, then meta types, a stage edits */
+
+/* --compact: running status, plus dropping events that carry nothing (a
+   text meta or Arb with no bytes, a second end-of-track). Decoding the
+   result gives the same events back, except that --compact=offs turns
+   every Off into On v=0. */
+
+static long Cdropped = 0, Cdropbytes = 0;
+
+/* SMF size of a variable-length quantity */
+int vlqlen(unsigned long v) {
+
+  int n = 1;
+
+  while (v >>= 7) n++;
+  return n;
 }
 
-/* Recoverable parse/validation error (the compile path). Historically the
-   code called a bare error() that was never defined and silently linked to
-   glibc's error(int,int,const char*,...) — undefined behaviour that left
-   range checks non-aborting, so callers proceeded to write attacker-controlled
-   out-of-range data and reach divide-by-zero / NULL-deref paths. This is the
-   real definition: report, resync to end of line, then recover via longjmp
-   inside a track (err_cont) or exit otherwise. It never returns. */
-void mc_error(char *s) {
+int compactempty(int status, int type, long leng) {
+
+  if (leng != 0) return 0;
+  return status == 0xf7 || (status == meta_event && type >= text_event
+                            && type <= 0x0f);
+}
 
-  int c, count;
-  int ln = (eol_seen ? lineno-1 : lineno);
+/* Count an event --compact dropped; its size is what it would have taken
+   with this delta, a one-byte type and no payload. */
+void compactdrop(int status, unsigned long delta) {
 
-  fprintf(stderr, "%d: %s\n", ln, s);
-  if (!eol_seen) {
-    count = 0;
-    while (count < 100 && (c=yylex()) != EOL && c != EOF) count++;
-    if (c == EOF) exit(1);
-  }
-  if (err_cont)
-    longjmp(erjump, 1);
-  exit(1);
+  Cdropped++;
+  Cdropbytes += vlqlen(delta) + ((status == meta_event) ? 3 : 2);
 }
 
-/* Unrecoverable error (resource exhaustion etc.) — always fatal. */
-void fatal(char *s) {
+void compactreport(FILE *fp) {
 
-  fprintf(stderr, "Fatal: %s\n", s);
-  exit(1);
+  long total = ftell(fp);
+
+  fprintf(stderr, "compact: %ld bytes written, %ld saved "
+          "(%ld status bytes by running status, %ld bytes in %ld empty or "
+          "redundant events)\n",
+          total, Mf_rssaved + Cdropbytes, Mf_rssaved, Cdropbytes, Cdropped);
 }
 
-void syntax() {
+static int xscompact(struct mfevent *ev) {
 
-  prs_error("Syntax error");
+  if (!compactempty(ev->status, ev->c1, ev->leng)) return 1;
+  compactdrop(ev->status, ev->time - Xwtime);
+  return 0;
 }
 
-void translate() {
+void xaddstage(int (*fn)()) {
 
-  if (yylex() == MTHD) {
-    Format = getint("MFile format");
-    Ntrks = getint("MFile #tracks");
-    Clicks = getint("MFile Clicks");
-    if (Clicks < 0) {
-      /* SMPTE division: negative frames/sec (high byte, -128..-1) and
-         ticks/frame (low byte, 0..255). Validate both operands BEFORE the
-         bitwise OR so a malformed resolution can't slip a bogus value
-         through; the reconstructed 16-bit value is 0x8000..0xffff. */
-      int res;
-      if (Clicks < -128)
-        error("MFile SMPTE frames/sec out of range");
-      res = getint("MFile SMPTE division");
-      if (res < 0 || res > 255)
-        error("MFile SMPTE ticks/frame out of range (0..255)");
-      Clicks = ((Clicks & 0xff) << 8) | res;
-    } else if (Clicks > 32767) {
-      error("MFile division out of range (0..32767)");
-    }
-    /* Clicks is now a 16-bit value (0..65535); this keeps the later
-       4 * Clicks / denom (TimeSig) computation from overflowing int. */
-    checkeol();
-    mfwrite(Format, Ntrks, Clicks, F);
-  } else {
-    fprintf (stderr, "Missing MFile - can't continue\n");
+  if (Xnstages >= XMAXSTAGE) {
+    fprintf(stderr, "too many transform stages (max %d)\n", XMAXSTAGE);
     exit(1);
   }
+  Xstage[Xnstages++] = fn;
 }
 
-static int mywritetrack() {
+/* Mark what a stage can change: a channel message type on every channel,
+   or SysEx, Arb or (0xff) every meta type. */
+static void xtouchtype(int type) {
 
-  int opcode, c;
-  long currtime = 0;
-  long newtime, delta;
-  int i, k;
+  int i;
 
-  while ((opcode = yylex()) == EOL) ;
-  if (opcode != MTRK) prs_error("Missing MTrk");
-  checkeol();
-  while(1) {
-    err_cont = 1;
-    setjmp (erjump);
-    switch(yylex()) {
-     case MTRK:
-      prs_error("Unexpected MTrk");
-     case EOF:
-      err_cont = 0;
-      error("Unexpected EOF");
-      return -1;
-     case TRKEND:
-      err_cont = 0;
-      checkeol();
-      return 1;
-     case INT:
-      /* Bound every parsed time component to the 28-bit SMF range before it
-         feeds the measure/beat multiplications, so a hostile but parseable
-         long can't signed-overflow newtime (undefined behaviour). */
-      newtime = yyval;
-      if (newtime < 0 || newtime > 0x0fffffffL)
-        prs_error("Time value out of range");
-      if ((opcode = yylex()) == '/') {
-        if (yylex() != INT) prs_error("Illegal time value");
-        if (yyval < 0 || yyval > 0x0fffffffL) prs_error("Time value out of range");
-        newtime = (newtime - M0) * Measure + yyval;
-        if (yylex() != '/' || yylex() != INT) prs_error("Illegal time value");
-        if (yyval < 0 || yyval > 0x0fffffffL) prs_error("Time value out of range");
-        newtime = T0 + newtime * Beat + yyval;
-        opcode = yylex();
-      }
-      if (incs)
-	delta = newtime;
-      else
-	delta = newtime - currtime;
-      if (delta < 0) prs_error("Illegal time value, did you forget -i option ?");
-      switch(opcode) {
-       case ON:
-       case OFF:
-       case POPR:
-        checkchan();
-        checknote();
-        checkval();
-        mf_w_midi_event(delta, opcode, chan, data, 2L);
-        break;
-       case PAR:
-        checkchan();
-        checkcon();
-        checkval();
-        mf_w_midi_event(delta, opcode, chan, data, 2L);
-        break;
-       case PB:
-        checkchan();
-        splitval();
-        mf_w_midi_event(delta, opcode, chan, data, 2L);
-        break;
-       case PRCH:
-        checkchan();
-        checkprog();
-        mf_w_midi_event(delta, opcode, chan, data, 1L);
-        break;
-       case CHPR:
-        checkchan();
-        checkval();
-        data[0] = data[1];
-        mf_w_midi_event(delta, opcode, chan, data, 1L);
-        break;
-       case SYSEX:
-       case ARB:
-        gethex();
-        mf_w_sysex_event(delta, buffer, (long)buflen);
-        break;
-       case TEMPO:
-        if (yylex() != INT) syntax();
-        mf_w_tempo (delta, yyval);
-        break;
-       case TIMESIG: {
-          int nn, denom, cc, bb;
-          if (yylex() != INT || yylex() != '/') syntax();
-          nn = yyval;
-          /* numerator is written as one byte and also becomes Measure (a
-             multiplier in time math); keep it in a sane byte range. */
-          if (nn < 1 || nn > 255) error("TimeSig numerator out of range (1..255)");
-          denom = getbyte("Denom");
-          cc = getbyte("clocks per click");
-          bb = getbyte("32nd notes per 24 clocks");
-          for(i = 0, k = 1 ; k < denom; i++, k <<= 1);
-          if (k != denom) error("Illegal TimeSig");
-          data[0] = nn;
-          data[1] = i;
-          data[2] = cc;
-          data[3] = bb;
-          /* Beat/Measure are kept >= 1 (below and via the initial main()
-             defaults), so this divisor is never zero even for a hostile
-             header with a tiny Clicks or a zero/negative numerator. */
-          M0 += (newtime - T0) / (Beat * Measure);
-          T0 = newtime;
-          Measure = nn;
-          if (Measure < 1) Measure = 1;
-          Beat = 4 * Clicks / denom;
-          if (Beat < 1) Beat = 1;
-          mf_w_meta_event(delta, time_signature, data, 4L);
-        }
-        break;
-       case SMPTE:
-        for(i = 0; i < 5; i++) data[i] = getbyte("SMPTE");
-        mf_w_meta_event(delta, smpte_offset, data, 5L);
-        break;
-       case KEYSIG:
-        data[0] = i = getint("Keysig");
-        if (i < -7 || i > 7)
-          error("Key Sig must be between -7 and 7");
-        if ((c=yylex()) != MINOR && c != MAJOR)
-          syntax();
-        data[1] = (c == MINOR);
-        mf_w_meta_event(delta, key_signature, data, 2L);
-        break;
-       case SEQNR:
-        get16val("SeqNr");
-        mf_w_meta_event(delta, sequence_number, data, 2L);
-        break;
-       case META: {
-          int type = yylex();
-          switch(type) {
-           case TRKEND: type = end_of_track; break;
-           case TEXT:
-           case COPYRIGHT:
-           case SEQNAME:
-           case INSTRNAME:
-           case LYRIC:
-           case MARKER:
-           case CUE: type -= (META+1); break;
-           case INT:
-            /* Accept any 0..255 meta type to match the decoder (which
-               round-trips arbitrary meta bytes via Mf_metamisc); reject
-               larger values rather than silently truncating to a byte. */
-            if (yyval < 0 || yyval > 255)
-              error("Meta type must be between 0 and 255");
-            type = yyval;
-            break;
-           default: prs_error("Illegal Meta type");
-          }
-          if (type == end_of_track)
-            buflen = 0;
-          else
-            gethex();
-          mf_w_meta_event(delta, type, buffer, (long)buflen);
-          break;
-        }
-       case SEQSPEC:
-        gethex();
-        mf_w_meta_event(delta, sequencer_specific, buffer, (long)buflen);
-        break;
-       default:
-        prs_error("Unknown input");
-        break;
-      }
-      currtime = newtime;
-     case EOL:
-      break;
-     default:
-      prs_error("Unknown input");
-      break;
-    }
-    checkeol();
-  }
+  if (type < 0xf0)
+    for (i = 0; i < 16; i++) Xtouch[type + i] = 1;
+  else if (type != meta_event)
+    Xtouch[type] = 1;
+  else
+    memset(Xtouch + meta_event, 1, 1 + 256);
 }
 
-int getbyte(char *mess) {
+/* Track pass-through. A track none of whose events the stages (or --where)
+   can touch is copied from the mapped input as it is, one fwrite(), instead
+   of being decoded and written again; the scan below only steps over the
+   events. It also insists on a well formed track ending in one
+   end-of-track, so anything the writer would have repaired is re-encoded.
+   With any of the --max-* or --time-budget-ms limits set every track is
+   read, so its events and payloads count against them. */
+static void xtouchinit() {
+
+  int st;
+
+  if (compact) memset(Xtouch, 1, sizeof(Xtouch));
+  for (st = 0x80; st < 0x100; st++)
+    if (Wtab[st] != W_KEEP) xtouchtype(st < 0xf0 ? st & 0xf0 : st);
+}
+
+static int xuntouched(unsigned char *p, long len) {
+
+  unsigned char *end = p + len;
+  int status = 0, type, i;
+  unsigned long n;
+  static int chanlen[] = {2, 2, 2, 2, 1, 1, 2};
+
+  while (p < end) {
+    for (i = 0; i < 4 && p < end && (*p & 0x80); i++) p++;
+    if (i == 4 || ++p >= end) return 0;
+    if (*p & 0x80) status = *p++;
+    else if (status == 0) return 0;
+    if (status < 0xf0) {
+      if (Xtouch[status]) return 0;
+      p += chanlen[(status >> 4) - 8];
+      continue;
+    }
+    if (status == meta_event) {
+      if (p >= end) return 0;
+      type = *p++;
+      if (Xtouch[256 + type]) return 0;
+    } else if (status == system_exclusive || status == 0xf7) {
+      if (Xtouch[status]) return 0;
+      type = -1;
+    } else {
+      return 0;
+    }
+    status = 0;
+    for (n = 0, i = 0; i < 4 && p < end; i++) {
+      n = (n << 7) | (*p & 0x7f);
+      if (!(*p++ & 0x80)) break;
+    }
+    if (i == 4 || n > end - p) return 0;
+    p += n;
+    if (type == end_of_track) return p == end;
+  }
+  return 0;
+}
+
+static int xpassthru(unsigned char *p, long len) {
+
+  if (Llimits || !xuntouched(p, len)) return 0;
+  if (Lmaxout && Lout + len > Lmaxout) limit("max-output-bytes", Lmaxout);
+  if (fwrite(p, 1, len, F) != len) mferror("error writing track");
+  Mf_numbyteswritten += len;
+  Lout += len;
+  laststat = meta_event;
+  lastmeta = end_of_track;
+  return 1;
+}
+
+static int xstranspose(struct mfevent *ev) {
+
+  int n;
+
+  if (ev->status >= 0xb0) return 1;
+  n = ev->c1 + Xtranspose;
+  if (n < 0 || n > 127) return 0;
+  ev->c1 = n;
+  return 1;
+}
+
+static int xsvelocity(struct mfevent *ev) {
+
+  long v;
+
+  if ((ev->status & 0xf0) != note_on || ev->c2 == 0) return 1;
+  /* a scaled note-on never becomes a note-off (v=0) */
+  v = ((long) ev->c2 * Xvelocity + 50) / 100;
+  ev->c2 = (v < 1) ? 1 : (v > 127) ? 127 : v;
+  return 1;
+}
+
+static int xschmap(struct mfevent *ev) {
+
+  if (ev->status < 0xf0)
+    ev->status = (ev->status & 0xf0) | Xchmap[ev->status & 0xf];
+  return 1;
+}
+
+static int xsdrop(struct mfevent *ev) {
+
+  if (ev->status == meta_event)
+    return !Xdrop[meta_event] && !Xdropmeta[ev->c1];
+  return !Xdrop[ev->status < 0xf0 ? ev->status & 0xf0 : ev->status];
+}
+
+static int xstempo(struct mfevent *ev) {
+
+  double t;
+
+  if (ev->status != meta_event || ev->c1 != set_tempo || ev->leng != 3)
+    return 1;
+  t = to32bit(0, ev->msg[0], ev->msg[1], ev->msg[2]) / Xtempo + 0.5;
+  if (t < 1) t = 1;
+  if (t > 0xffffff) t = 0xffffff;
+  ev->msg[0] = ((long) t >> 16) & 0xff;
+  ev->msg[1] = ((long) t >> 8) & 0xff;
+  ev->msg[2] = (long) t & 0xff;
+  return 1;
+}
+
+/* --transpose=N */
+void xtranspose(char *arg) {
+
+  char *endp;
+  long v = strtol(arg, &endp, 10);
+
+  if (*arg == '\0' || *endp != '\0' || v < -127 || v > 127) {
+    fprintf(stderr, "transpose must be between -127 and 127\n");
+    exit(1);
+  }
+  Xtranspose = v;
+  xtouchtype(note_off);
+  xtouchtype(note_on);
+  xtouchtype(poly_aftertouch);
+  xaddstage(xstranspose);
+}
+
+/* --velocity=PCT, a percentage applied to note-on velocities */
+void xvelocity(char *arg) {
+
+  char *endp;
+  long v = strtol(arg, &endp, 10);
+
+  if (*arg == '\0' || *endp != '\0' || v < 0 || v > 10000) {
+    fprintf(stderr, "velocity must be a percentage between 0 and 10000\n");
+    exit(1);
+  }
+  Xvelocity = v;
+  xtouchtype(note_on);
+  xaddstage(xsvelocity);
+}
+
+/* --chmap=FROM:TO[,FROM:TO...], channels 1-16 */
+void xchmap(char *arg) {
+
+  int i, from, to, n;
+
+  for (i = 0; i < 16; i++) Xchmap[i] = i;
+  while (*arg) {
+    if (sscanf(arg, "%d:%d%n", &from, &to, &n) != 2
+        || from < 1 || from > 16 || to < 1 || to > 16) {
+      fprintf(stderr, "chmap must be FROM:TO[,FROM:TO...] with channels 1-16\n");
+      exit(1);
+    }
+    Xchmap[from-1] = to-1;
+    if (from != to)
+      for (i = 0x80; i < 0xf0; i += 16) Xtouch[i + from-1] = 1;
+    arg += n;
+    if (*arg == ',') arg++;
+  }
+  xaddstage(xschmap);
+}
+
+/* --drop=TYPE[,TYPE...], using the --where names for types and meta types */
+void xdrop(char *arg) {
+
+  char word[16];
+  int i, k;
+
+  while (*arg) {
+    for (i = 0; *arg && *arg != ',' && i < 15; ) word[i++] = tolower(*arg++);
+    word[i] = '\0';
+    for (k = 0; Wnames[k].name; k++)
+      if (Wnames[k].val >= 0 && strcmp(word, Wnames[k].name) == 0) break;
+    if (Wnames[k].name == NULL) {
+      fprintf(stderr, "drop: unknown event type '%s'\n", word);
+      exit(1);
+    }
+    if (Wnames[k].val >= 0x80) {
+      Xdrop[Wnames[k].val] = 1;
+      xtouchtype(Wnames[k].val);
+    } else {
+      Xdropmeta[Wnames[k].val] = 1;
+      Xtouch[256 + Wnames[k].val] = 1;
+    }
+    while (*arg && *arg != ',') arg++;
+    if (*arg == ',') arg++;
+  }
+  xaddstage(xsdrop);
+}
+
+/* --tempo-scale=F, F > 1 plays faster */
+void xtempo(char *arg) {
+
+  char *endp;
+  double v = strtod(arg, &endp);
+
+  if (*arg == '\0' || *endp != '\0' || !(v > 0.001 && v < 1000.0)) {
+    fprintf(stderr, "tempo-scale must be a factor between 0.001 and 1000\n");
+    exit(1);
+  }
+  Xtempo = v;
+  Xtouch[256 + set_tempo] = 1;
+  xaddstage(xstempo);
+}
+
+/* The in-memory model. mfread() with Mf_model set loads the whole file
+   into it rather than calling back for each event: a chunk-length pass
+   over the mapped input sizes the arena and each track's arrays (an event
+   takes at least 2 bytes, most 3 or more), then the reader fills them
+   through its own callbacks, SysEx and Arb packets as they come (or each
+   SysEx joined into one event when sxwhole is set). The bulk
+   edits below are the stages' edits as loops over the arrays; each marks
+   the tracks holding events of the types it edits dirty (as the stages
+   mark Xtouch), and mfmodelwrite() writes the other tracks back as read
+   when xuntouched() agrees. xform() takes this way for the files up to
+   MODELMAX bytes whose stages all have a bulk edit. */
+
+static struct mftrack *Mdtrk;       /* the track being read */
+
+static void mdroom(long n) {
+
+  struct mfmodel *m = Mf_model;
+
+  if (m->len + n > m->size) {
+    while (m->len + n > m->size) m->size = m->size ? 2 * m->size : XBUFSIZE;
+    if ((m->arena = realloc(m->arena, m->size)) == NULL) fatal("Out of memory");
+  }
+}
+
+static void mdarrays(struct mftrack *t, long size) {
+
+  t->size = size;
+  t->tick = realloc(t->tick, size * sizeof(long));
+  t->off = realloc(t->off, (size + 1) * sizeof(long));
+  t->status = realloc(t->status, size);
+  t->data1 = realloc(t->data1, size);
+  t->data2 = realloc(t->data2, size);
+  if (!t->tick || !t->off || !t->status || !t->data1 || !t->data2)
+    fatal("Out of memory");
+}
+
+static void mdevent(int status, int c1, int c2) {
+
+  struct mftrack *t = Mdtrk;
+  long i = t->n;
+
+  if (i == t->size) mdarrays(t, 2 * t->size);
+  t->tick[i] = Mf_currtime;
+  t->status[i] = status;
+  t->data1[i] = c1;
+  t->data2[i] = c2;
+  t->off[++t->n] = Mf_model->len;
+}
+
+static void mdpayload(unsigned char *data, long n) {
+
+  mdroom(n);
+  memcpy(Mf_model->arena + Mf_model->len, data, n);
+  Mf_model->len += n;
+  Mdtrk->off[Mdtrk->n] = Mf_model->len;
+}
+
+static void mdheader(int format, int ntrks, int division) {
+
+  Mf_model->format = format;
+  Mf_model->ntrks = ntrks;
+  Mf_model->division = division;
+}
+
+static void mdstarttrack() {
+
+  Mdtrk = &Mf_model->trk[Mf_model->nread++];
+  Mdtrk->raw = Mp;
+  Mdtrk->rawlen = Mf_toberead;
+  Mdtrk->off[0] = Mf_model->len;
+}
+
+static void mdnoff(int chan, int c1, int c2) { mdevent(note_off|chan, c1, c2); }
+static void mdnon(int chan, int c1, int c2) { mdevent(note_on|chan, c1, c2); }
+static void mdpressure(int chan, int c1, int c2) { mdevent(poly_aftertouch|chan, c1, c2); }
+static void mdparameter(int chan, int c1, int c2) { mdevent(control_change|chan, c1, c2); }
+static void mdpitchbend(int chan, int c1, int c2) { mdevent(pitch_wheel|chan, c1, c2); }
+static void mdprogram(int chan, int c1) { mdevent(program_chng|chan, c1, 0); }
+static void mdchanpressure(int chan, int c1) { mdevent(channel_aftertouch|chan, c1, 0); }
+
+static void mdmeta(int type, int leng, char *mess) {
+
+  mdevent(meta_event, type, 0);
+  mdpayload((unsigned char *) mess, leng);
+}
+
+static void mdsxbegin(int status, long leng) {
+
+  unsigned char f0 = 0xf0;
+
+  mdevent(status, 0, 0);
+  if (status == system_exclusive) mdpayload(&f0, 1);
+}
+
+static void mdsxdata(unsigned char *data, int n) {
+
+  mdpayload(data, n);
+}
+
+static void mdsysex(int leng, char *mess) {
+
+  mdevent(system_exclusive, 0, 0);
+  mdpayload((unsigned char *) mess, leng);
+}
+
+static void mdarbitrary(int leng, char *mess) {
+
+  mdevent(0xf7, 0, 0);
+  mdpayload((unsigned char *) mess, leng);
+}
+
+static void mfmodelread(struct mfmodel *m) {
+
+  unsigned char *p;
+  long len, total = 0;
+  int n = 0, i, whole = m->sxwhole;
+
+  if (Mf_getc != memgetc) mferror("the model needs the input in memory");
+  memset(m, 0, sizeof(*m));
+  m->format = -1;
+  m->sxwhole = whole;
+  Mf_header = mdheader;
+  Mf_starttrack = mdstarttrack;
+  Mf_endtrack = NULLFUNC;
+  Mf_on = mdnon;
+  Mf_off = mdnoff;
+  Mf_pressure = mdpressure;
+  Mf_parameter = mdparameter;
+  Mf_pitchbend = mdpitchbend;
+  Mf_program = mdprogram;
+  Mf_chanpressure = mdchanpressure;
+  Mf_metaraw = mdmeta;
+  Mf_sysex = mdsysex;
+  Mf_arbitrary = mdarbitrary;
+  Mf_sxbegin = whole ? NULLFUNC : mdsxbegin;
+  Mf_sxdata = whole ? NULLFUNC : mdsxdata;
+  Mf_sxend = NULLFUNC;
+  readheader();
+  if (m->format < 0) mferror("no MThd header");
+
+  for (p = Mp; Mend - p >= 8; p += 8 + len) {
+    len = to32bit(p[4], p[5], p[6], p[7]);
+    if (len > Mend - p - 8) len = Mend - p - 8;
+    if (to32bit(p[0], p[1], p[2], p[3]) == MTrk) {
+      n++;
+      total += len;
+    }
+  }
+  if ((m->trk = calloc(n + 1, sizeof(struct mftrack))) == NULL) fatal("Out of memory");
+  m->size = total + 1;
+  if ((m->arena = malloc(m->size)) == NULL) fatal("Out of memory");
+  for (i = 0, p = Mp; Mend - p >= 8; p += 8 + len) {
+    len = to32bit(p[4], p[5], p[6], p[7]);
+    if (len > Mend - p - 8) len = Mend - p - 8;
+    if (to32bit(p[0], p[1], p[2], p[3]) == MTrk) mdarrays(&m->trk[i++], len / 3 + 1);
+  }
+  while (m->nread < n && readtrack()) ;
+}
+
+void mfmodelfree(struct mfmodel *m) {
+
+  int i;
+
+  for (i = 0; m->trk && m->trk[i].tick; i++) {
+    free(m->trk[i].tick);
+    free(m->trk[i].off);
+    free(m->trk[i].status);
+    free(m->trk[i].data1);
+    free(m->trk[i].data2);
+  }
+  free(m->trk);
+  free(m->arena);
+  memset(m, 0, sizeof(*m));
+}
+
+/* Drop the events marked 0 in keep[], moving the payloads of the rest
+   down over theirs. */
+static void mfsqueeze(struct mfmodel *m, struct mftrack *t, char *keep) {
+
+  long i, j, w = t->off[0], len;
+
+  for (i = j = 0; i < t->n; i++) {
+    if (!keep[i]) continue;
+    t->tick[j] = t->tick[i];
+    t->status[j] = t->status[i];
+    t->data1[j] = t->data1[i];
+    t->data2[j] = t->data2[i];
+    len = t->off[i+1] - t->off[i];
+    if (w != t->off[i]) memmove(m->arena + w, m->arena + t->off[i], len);
+    t->off[j++] = w;
+    w += len;
+  }
+  t->off[j] = w;
+  t->n = j;
+}
+
+/* --transpose: notes moved out of 0-127 are dropped */
+void mftranspose(struct mfmodel *m, int d) {
+
+  struct mftrack *t;
+  char *keep = NULL;
+  long i, size = 0;
+  int k, n, drop;
+
+  for (k = 0; k < m->nread; k++) {
+    t = &m->trk[k];
+    if (t->n > size) {
+      size = t->n;
+      if ((keep = realloc(keep, size)) == NULL) fatal("Out of memory");
+    }
+    for (drop = 0, i = 0; i < t->n; i++) {
+      keep[i] = 1;
+      if (t->status[i] >= control_change) continue;
+      n = t->data1[i] + d;
+      keep[i] = (n >= 0 && n <= 127);
+      drop |= !keep[i];
+      t->data1[i] = n;
+      t->dirty = 1;
+    }
+    if (drop) mfsqueeze(m, t, keep);
+  }
+  free(keep);
+}
+
+/* --velocity: a scaled note-on never becomes a note-off (v=0) */
+void mfvelocity(struct mfmodel *m, int pct) {
+
+  struct mftrack *t;
+  long i, v;
+  int k;
+
+  for (k = 0; k < m->nread; k++)
+    for (t = &m->trk[k], i = 0; i < t->n; i++) {
+      if ((t->status[i] & 0xf0) != note_on) continue;
+      t->dirty = 1;
+      if (t->data2[i] == 0) continue;
+      v = ((long) t->data2[i] * pct + 50) / 100;
+      t->data2[i] = (v < 1) ? 1 : (v > 127) ? 127 : v;
+    }
+}
+
+/* --chmap: map[] gives each channel's new one, 0-15 */
+void mfchmap(struct mfmodel *m, int *map) {
+
+  struct mftrack *t;
+  long i;
+  int k, ch;
+
+  for (k = 0; k < m->nread; k++)
+    for (t = &m->trk[k], i = 0; i < t->n; i++) {
+      if (t->status[i] >= system_exclusive) continue;
+      ch = t->status[i] & 0xf;
+      if (map[ch] == ch) continue;
+      t->status[i] = (t->status[i] & 0xf0) | map[ch];
+      t->dirty = 1;
+    }
+}
+
+/* --tempo-scale: f > 1 plays faster */
+void mftempo(struct mfmodel *m, double f) {
+
+  struct mftrack *t;
+  unsigned char *p;
+  double v;
+  long i;
+  int k;
+
+  for (k = 0; k < m->nread; k++)
+    for (t = &m->trk[k], i = 0; i < t->n; i++) {
+      if (t->status[i] != meta_event || t->data1[i] != set_tempo) continue;
+      t->dirty = 1;
+      if (t->off[i+1] - t->off[i] != 3) continue;
+      p = m->arena + t->off[i];
+      v = to32bit(0, p[0], p[1], p[2]) / f + 0.5;
+      if (v < 1) v = 1;
+      if (v > 0xffffff) v = 0xffffff;
+      p[0] = ((long) v >> 16) & 0xff;
+      p[1] = ((long) v >> 8) & 0xff;
+      p[2] = (long) v & 0xff;
+    }
+}
+
+/* --drop: drop[] is indexed by channel type (0x80-0xe0) or status
+   (0xf0, 0xf7, 0xff), dropmeta[] by meta type. */
+void mfdrop(struct mfmodel *m, char *drop, char *dropmeta) {
+
+  struct mftrack *t;
+  char *keep = NULL;
+  long i, size = 0;
+  int k, s, gone;
+
+  for (k = 0; k < m->nread; k++) {
+    t = &m->trk[k];
+    if (t->n > size) {
+      size = t->n;
+      if ((keep = realloc(keep, size)) == NULL) fatal("Out of memory");
+    }
+    for (gone = 0, i = 0; i < t->n; i++) {
+      s = t->status[i] < system_exclusive ? t->status[i] & 0xf0 : t->status[i];
+      keep[i] = !drop[s] && !(s == meta_event && dropmeta[t->data1[i]]);
+      gone |= !keep[i];
+    }
+    if (!gone) continue;
+    t->dirty = 1;
+    mfsqueeze(m, t, keep);
+  }
+  free(keep);
+}
+
+static struct mfmodel *Mdwrite;
+
+/* Write a track back as xwrite() and xendtrack() would have. */
+static int mdwritetrack(int which) {
+
+  struct mftrack *t;
+  unsigned char d[2], *p;
+  long i, tick, now = 0, eot = -1;
+  int s;
+
+  if (which >= Mdwrite->nread) return 1;
+  t = &Mdwrite->trk[which];
+  if (!t->dirty && xpassthru(t->raw, t->rawlen)) return 1;
+  for (i = 0; i < t->n; i++) {
+    s = t->status[i];
+    p = Mdwrite->arena + t->off[i];
+    tick = t->tick[i] < now ? now : t->tick[i];
+    switch (s) {
+     case system_exclusive:
+      mf_w_sysex_event(tick - now, p, t->off[i+1] - t->off[i]);
+      break;
+     case 0xf7:
+      mf_w_arb_event(tick - now, p, t->off[i+1] - t->off[i]);
+      break;
+     case meta_event:
+      if (t->data1[i] == end_of_track) {
+        if (tick > eot) eot = tick;
+        continue;
+      }
+      mf_w_meta_event(tick - now, t->data1[i], p, t->off[i+1] - t->off[i]);
+      break;
+     default:
+      d[0] = t->data1[i];
+      d[1] = t->data2[i];
+      mf_w_midi_event(tick - now, s & 0xf0, s & 0xf, d,
+                      (s & 0xe0) == 0xc0 ? 1L : 2L);
+    }
+    now = tick;
+  }
+  if (eot >= 0) mf_w_meta_event((eot < now ? now : eot) - now, end_of_track, NULL, 0L);
+  return 1;
+}
+
+/* Write the model to F through Mf_putc, in one pass over its arrays. */
+void mfmodelwrite(struct mfmodel *m) {
+
+  Mdwrite = m;
+  Mf_wtrack = mdwritetrack;
+  mfwrite(m->format, m->ntrks, m->division, F);
+}
+
+/* Can xform() take the model's way: stages that all have a bulk edit,
+   nothing that needs the events in order and an input of at most
+   MODELMAX bytes? */
+static int xbulk() {
+
+  int i;
+
+  if (Xnstages == 0 || merge || splitch || Mlen > MODELMAX) return 0;
+  for (i = 0; i < Xnstages; i++)
+    if (Xstage[i] != xstranspose && Xstage[i] != xsvelocity && Xstage[i] != xschmap
+        && Xstage[i] != xstempo && Xstage[i] != xsdrop)
+      return 0;
+  return 1;
+}
+
+/* Load the input into the model, make the stages' edits in their order
+   and write it back. */
+static void xmodel() {
+
+  struct mfmodel m;
+  int i;
+
+  /* as xstreaminit(): a stage that touches SysEx sees each one whole */
+  m.sxwhole = Xtouch[system_exclusive] || Xtouch[0xf7];
+  Mf_model = &m;
+  mfread();
+  Mf_model = NULL;
+  for (i = 0; i < Xnstages; i++)
+    if (Xstage[i] == xstranspose) mftranspose(&m, Xtranspose);
+    else if (Xstage[i] == xsvelocity) mfvelocity(&m, Xvelocity);
+    else if (Xstage[i] == xschmap) mfchmap(&m, Xchmap);
+    else if (Xstage[i] == xstempo) mftempo(&m, Xtempo);
+    else mfdrop(&m, Xdrop, Xdropmeta);
+  mfmodelwrite(&m);
+  mfmodelfree(&m);
+}
+
+/* --split-channels: put an event in its output track's buffer. A channel
+   prefix, and an instrument name or the track name of any track but the
+   first (whose name is the sequence's), go with the channel they belong
+   to: the one a channel prefix names, or else (in a format 1 file) the
+   first channel their input track uses, which isn't known until the whole
+   input is read. */
+static void xsplitadd(struct mfevent *ev) {
+
+  int t = (ev->track >= 1 && ev->track <= Xntrks) ? ev->track : 0;
+
+  if (ev->status < system_exclusive) {
+    if (Xsplitfirst[t] < 0) Xsplitfirst[t] = ev->status & 0xf;
+    Xsplitprefix[t] = -1;
+    xbufadd(&Xsplit[(ev->status & 0xf) + 1], ev);
+    return;
+  }
+  if (ev->status == meta_event && ev->c1 == channel_prefix && ev->leng == 1
+      && ev->msg[0] < 16)
+    Xsplitprefix[t] = ev->msg[0];
+  else if (ev->status != meta_event || (ev->c1 != instrument_name
+           && !(ev->c1 == sequence_name && (t > 1 || Xsplitprefix[t] >= 0)))) {
+    xbufadd(&Xsplit[0], ev);
+    return;
+  }
+  if (Xsplitprefix[t] >= 0) xbufadd(&Xsplit[Xsplitprefix[t] + 1], ev);
+  else if (t == 0 || Xformat == 0) xbufadd(&Xsplit[0], ev);
+  else xbufadd(&Xsplitnames, ev);
+}
+
+/* The output track of a name held back by xsplitadd(). */
+static int xsplitdest(struct mfevent *ev) {
+
+  return Xsplitfirst[ev->track] + 1;
+}
+
+/* Write an event that made it through every stage. End-of-track is held
+   back and written by xendtrack(), so that events a plugin emits late can't
+   end up behind it. Under --split-channels the event goes to its output
+   track's buffer instead, and is written by xsplittrack(). */
+static void xwrite(struct mfevent *ev) {
+
+  unsigned char d[2];
+
+  if (ev->time < Xwtime) ev->time = Xwtime;
+  if (Xpacking && !(ev->status == meta_event && ev->c1 == end_of_track)) {
+    pkrecord(ev->time, ev->track, ev->status, ev->c1, ev->c2, ev->msg, ev->leng);
+    Xwtime = ev->time;
+    return;
+  }
+  if (Xsplitting && !(ev->status == meta_event && ev->c1 == end_of_track)) {
+    xsplitadd(ev);
+    Xwtime = ev->time;
+    return;
+  }
+  switch (ev->status) {
+   case system_exclusive:
+    mf_w_sysex_event(ev->time - Xwtime, ev->msg, ev->leng);
+    break;
+   case 0xf7:
+    mf_w_arb_event(ev->time - Xwtime, ev->msg, ev->leng);
+    break;
+   case meta_event:
+    if (ev->c1 == end_of_track) {
+      if (Xeot >= 0 && compact) compactdrop(meta_event, 0);
+      if (ev->time > Xeot) Xeot = ev->time;
+      return;
+    }
+    mf_w_meta_event(ev->time - Xwtime, ev->c1, ev->msg, ev->leng);
+    break;
+   default:
+    d[0] = ev->c1;
+    d[1] = ev->c2;
+    mf_w_midi_event(ev->time - Xwtime, ev->status & 0xf0, ev->status & 0xf,
+                    d, (ev->status & 0xe0) == 0xc0 ? 1L : 2L);
+  }
+  Xwtime = ev->time;
+}
+
+/* Run stages from..Xnstages-1 on one event; a plugin stage takes the event
+   into its batch and passes on what it emits when the batch is flushed. */
+static void xrun(struct mfevent *ev, int from) {
+
+  int i;
+
+  for (i = from; i < Xnstages; i++) {
+    if (Xplug[i]) {
+      xplugadd(Xplug[i], ev);
+      return;
+    }
+    if (!(*Xstage[i])(ev)) return;
+  }
+  xwrite(ev);
+}
+
+void xevent(struct mfevent *ev) {
+
+  if (Xpatching) xpatch(ev);
+  else xrun(ev, 0);
+}
+
+/* Event buffers: the events plus a copy of their payloads in one arena.
+   Payloads are kept as offsets while the arena can still move, and turned
+   into pointers by xbuffix() just before the events are used. */
+void xbufadd(struct xbuf *b, struct mfevent *ev) {
+
+  if (b->n >= b->size) {
+    b->size = b->size ? 2 * b->size : XBATCH;
+    b->ev = realloc(b->ev, b->size * sizeof(struct mfevent));
+    b->off = realloc(b->off, b->size * sizeof(long));
+    if (b->ev == NULL || b->off == NULL) fatal("Out of memory");
+  }
+  if (ev->leng > 0) {
+    if (b->len + ev->leng > b->dsize) {
+      while (b->len + ev->leng > b->dsize)
+        b->dsize = b->dsize ? 2 * b->dsize : 4096;
+      b->data = realloc(b->data, b->dsize);
+      if (b->data == NULL) fatal("Out of memory");
+    }
+    memcpy(b->data + b->len, ev->msg, ev->leng);
+  }
+  b->ev[b->n] = *ev;
+  b->off[b->n++] = b->len;
+  b->len += (ev->leng > 0) ? ev->leng : 0;
+}
+
+void xbuffix(struct xbuf *b) {
+
+  int i;
+
+  for (i = 0; i < b->n; i++)
+    b->ev[i].msg = (b->ev[i].leng > 0) ? b->data + b->off[i] : NULL;
+}
+
+void xbufclear(struct xbuf *b) {
+
+  b->n = 0;
+  b->len = 0;
+}
+
+static void xplugemit(struct mc_host *host, struct mfevent *ev) {
+
+  xbufadd(&((struct xplugin *) host->priv)->out, ev);
+}
+
+/* Pass on what a plugin emitted up to time upto, stable-sorted by time.
+   Output is mostly in order already, so an insertion sort is the cheap
+   choice here. What's later is held back, to be sorted in with what the
+   next batch emits: passing it on now would move the next batch's earlier
+   events, which the plugin may not have touched at all, up to its time. */
+static void xplugforward(struct xplugin *p, long upto) {
+
+  struct xbuf *b = &p->out, t;
+  struct mfevent e;
+  long o;
+  int i, j;
+
+  for (i = 1; i < b->n; i++) {
+    if (b->ev[i].time >= b->ev[i-1].time) continue;
+    e = b->ev[i];
+    o = b->off[i];
+    for (j = i; j > 0 && b->ev[j-1].time > e.time; j--) {
+      b->ev[j] = b->ev[j-1];
+      b->off[j] = b->off[j-1];
+    }
+    b->ev[j] = e;
+    b->off[j] = o;
+  }
+  xbuffix(b);
+  for (i = 0; i < b->n && b->ev[i].time <= upto; i++)
+    xrun(&b->ev[i], p->stage + 1);
+  for (j = i; j < b->n; j++) xbufadd(&p->held, &b->ev[j]);
+  xbufclear(b);
+  t = p->out;
+  p->out = p->held;
+  p->held = t;
+}
+
+static void xplugflush(struct xplugin *p) {
+
+  if (p->in.n == 0) return;
+  xbuffix(&p->in);
+  (*p->pl->process)(p->state, p->in.ev, p->in.n, &p->host);
+  xbufclear(&p->in);
+}
+
+/* The first event of a batch is the earliest the rest of the track can
+   hold, so what the last batch emitted up to its time can go on. */
+void xplugadd(struct xplugin *p, struct mfevent *ev) {
+
+  if (p->in.n == 0 && p->out.n > 0) xplugforward(p, ev->time);
+  xbufadd(&p->in, ev);
+  if (p->in.n >= XBATCH) xplugflush(p);
+}
+
+/* Add a batch stage running pl. Built-in passes that need to see a whole
+   track (--thin) use this too, with a static struct mc_plugin. */
+void xaddplugin(struct mc_plugin *pl, char *args) {
+
+  struct xplugin *p;
+
+  p = calloc(1, sizeof(struct xplugin));
+  if (p == NULL) fatal("Out of memory");
+  p->pl = pl;
+  p->args = args;
+  p->host.abi = MC_PLUGIN_ABI;
+  p->host.emit = xplugemit;
+  p->host.priv = p;
+  p->stage = Xnstages;
+  Xplug[Xnstages] = p;
+  xaddstage(NULL);
+}
+
+/* --plugin path.so[:args] */
+void xplugin(char *arg) {
+
+#ifdef HAVE_DLFCN
+  struct mc_plugin *pl;
+  char *colon, *slash, *args = "";
+  void *dl;
+
+  slash = strrchr(arg, '/');
+  colon = strchr(slash ? slash : arg, ':');
+  if (colon) {
+    *colon = '\0';
+    args = colon + 1;
+  }
+  if ((dl = dlopen(arg, RTLD_NOW)) == NULL) {
+    fprintf(stderr, "plugin: %s\n", dlerror());
+    exit(1);
+  }
+  pl = (struct mc_plugin *) dlsym(dl, "midicomp_plugin");
+  if (pl == NULL || pl->abi != MC_PLUGIN_ABI || pl->process == NULL) {
+    fprintf(stderr, "plugin: %s is not a midicomp plugin for ABI %d\n",
+            arg, MC_PLUGIN_ABI);
+    exit(1);
+  }
+  memset(Xtouch, 1, sizeof(Xtouch));
+  xaddplugin(pl, args);
+#else
+  fprintf(stderr, "plugin: this midicomp was built without plugin support\n");
+  exit(1);
+#endif
+}
+
+/* --thin[=TOL]: thin out controller and pitch bend streams.
+
+   A receiver holds the last value it was sent, so an event only matters if
+   it moves that value. Per track, in one pass over the buffered events:
+
+   - a Par or Pb equal to the value last kept for its channel and controller
+     is a repeat and goes;
+   - one within TOL of it is dropped too, but remembered as pending; the
+     last pending value of a ramp is put back before the next note-on on the
+     channel (or at the end of the track), so a sweep still ends exactly
+     where it should and the held value is never more than TOL off;
+   - a change overridden by the next change of the same controller before
+     any note on the channel starts or stops is dead and goes.
+
+   Tracks of a format 1 file can share a channel, and another track may
+   have moved the value in between, so for a channel and controller more
+   than one track uses, repeats and ramp points only count against a value
+   kept at the same tick, and only changes overridden at the same tick
+   count as dead. thinscan() finds those in the file before it is read;
+   one read some other way counts them all as shared. A Reset All Controllers (CC121) forgets
+   the values held on its channel, after putting back any pending ramp end.
+
+   State is kept in flat [16][129] arrays (index 128 is pitch bend). */
+
+static struct xbuf Tbuf;
+static int Ttol = 0;
+static long Tseen, Trepeat, Tramp, Tdead;
+static char Tsole[16][129];     /* set if only one track has the channel
+                                   and controller */
+
+/* Step through the file's MTrk chunks in the mapping, as xuntouched()
+   does, to see which track has each channel and controller. A track that
+   can't be stepped through leaves every one shared. */
+static void thinscan() {
+
+  static int chanlen[] = {2, 2, 2, 2, 1, 1, 2};
+  int owner[16][129];
+  unsigned char *p, *end;
+  unsigned long n, len;
+  int track = 0, status, st, ch, c, i;
+
+  memset(Tsole, 0, sizeof(Tsole));
+  if (Mbase == NULL || Mf_toberead < 0 || Mf_toberead > Mend - Mp) return;
+  memset(owner, 0, sizeof(owner));
+  for (p = Mp + Mf_toberead; Mend - p >= 8; p = end) {
+    len = to32bit(p[4], p[5], p[6], p[7]);
+    p += 8;
+    end = p + ((len < Mend - p) ? len : Mend - p);
+    if (to32bit(p[-8], p[-7], p[-6], p[-5]) != MTrk) continue;
+    for (track++, status = 0; p < end; ) {
+      for (i = 0; i < 4 && p < end && (*p & 0x80); i++) p++;
+      if (i == 4 || ++p >= end) return;
+      if (*p & 0x80) st = *p++;
+      else if ((st = status) == 0) return;
+      if (st < 0xf0) {
+        status = st;
+        if (end - p < chanlen[(st >> 4) - 8]) return;
+        c = (st & 0xf0) == pitch_wheel ? 128 :
+          (st & 0xf0) == control_change && *p < 128 ? *p : -1;
+        ch = st & 0xf;
+        if (c >= 0)
+          owner[ch][c] = (owner[ch][c] == 0 || owner[ch][c] == track) ? track : -1;
+        p += chanlen[(st >> 4) - 8];
+        continue;
+      }
+      if (st == meta_event) {
+        if (p++ >= end) return;
+      } else if (st != system_exclusive && st != 0xf7) {
+        return;
+      }
+      for (n = 0, i = 0; i < 4 && p < end; i++) {
+        n = (n << 7) | (*p & 0x7f);
+        if (!(*p++ & 0x80)) break;
+      }
+      if (i == 4 || n > end - p) return;
+      p += n;
+    }
+  }
+  for (ch = 0; ch < 16; ch++)
+    for (c = 0; c < 129; c++) Tsole[ch][c] = (owner[ch][c] >= 0);
+}
+
+static void *thininit(char *args, struct mc_host *host) {
+
+  thinscan();
+  return &Tbuf;
+}
+
+static void thinprocess(void *state, struct mfevent *ev, int n,
+                        struct mc_host *host) {
+
+  int i;
+
+  for (i = 0; i < n; i++) xbufadd(&Tbuf, &ev[i]);
+}
+
+static int Tlast[16][129], Tpend[16][129];
+static long Tlasttime[16][129];
+
+/* Put back the pending ramp ends of channel ch. */
+static void thinpending(int ch, char *keep) {
+
+  int c, p;
+
+  for (c = 0; c < 129; c++)
+    if ((p = Tpend[ch][c]) >= 0) {
+      keep[p] = 1;
+      Tlast[ch][c] = (c < 128) ? Tbuf.ev[p].c2 : 128*Tbuf.ev[p].c2 + Tbuf.ev[p].c1;
+      Tlasttime[ch][c] = Tbuf.ev[p].time;
+      Tpend[ch][c] = -1;
+      Tramp--;
+    }
+}
+
+static void thinendtrack(void *state, int track, struct mc_host *host) {
+
+  static int prev[16][129];
+  static long prevepoch[16][129];
+  long epoch[16];
+  int sounding[16];
+  char *keep;
+  struct mfevent *e;
+  int i, ch, c, v, p, d, known;
+
+  if (Tbuf.n == 0) return;
+  if ((keep = malloc(Tbuf.n)) == NULL) fatal("Out of memory");
+  for (ch = 0; ch < 16; ch++) {
+    for (c = 0; c < 129; c++) Tlast[ch][c] = Tpend[ch][c] = prev[ch][c] = -1;
+    epoch[ch] = 0;
+    sounding[ch] = 0;
+  }
+  for (i = 0; i < Tbuf.n; i++) {
+    e = &Tbuf.ev[i];
+    keep[i] = 1;
+    if (e->status >= 0xf0) continue;
+    ch = e->status & 0xf;
+    switch (e->status & 0xf0) {
+     case note_on:
+     case note_off:
+      /* pending ramp ends must sound before the note does */
+      if ((e->status & 0xf0) == note_on && e->c2 > 0) thinpending(ch, keep);
+      if ((e->status & 0xf0) == note_on && e->c2 > 0) sounding[ch]++;
+      else if (sounding[ch] > 0) sounding[ch]--;
+      epoch[ch]++;
+      continue;
+     case control_change:
+      c = e->c1;
+      if (c == 121) {
+        thinpending(ch, keep);
+        for (c = 0; c < 129; c++) Tlast[ch][c] = prev[ch][c] = -1;
+        continue;
+      }
+      /* bank select, data entry, (N)RPN and channel mode messages act in
+         sequence rather than as a held value; leave them alone */
+      if (c == 0 || c == 32 || c == 6 || c == 38 || (c >= 96 && c <= 101)
+          || c >= 120)
+        continue;
+      v = e->c2;
+      break;
+     case pitch_wheel:
+      c = 128;
+      v = 128*e->c2 + e->c1;
+      break;
+     default:
+      continue;
+    }
+    Tseen++;
+    d = v - Tlast[ch][c];
+    known = Tlast[ch][c] >= 0 && (Xformat == 0 || Tsole[ch][c]
+                                  || Tlasttime[ch][c] == e->time);
+    if (known && d == 0) {
+      keep[i] = 0;
+      Tpend[ch][c] = -1;
+      Trepeat++;
+    } else if (known && d >= -Ttol && d <= Ttol) {
+      keep[i] = 0;
+      Tpend[ch][c] = i;
+      Tramp++;
+    } else {
+      if ((p = prev[ch][c]) >= 0 && keep[p] && prevepoch[ch][c] == epoch[ch]
+          && sounding[ch] == 0
+          && (Xformat == 0 || Tsole[ch][c] || Tbuf.ev[p].time == e->time)) {
+        keep[p] = 0;
+        Tdead++;
+      }
+      Tlast[ch][c] = v;
+      Tlasttime[ch][c] = e->time;
+      Tpend[ch][c] = -1;
+      prev[ch][c] = i;
+      prevepoch[ch][c] = epoch[ch];
+    }
+  }
+  /* a ramp still pending at the end of the track keeps its final value */
+  for (ch = 0; ch < 16; ch++)
+    for (c = 0; c < 129; c++)
+      if ((p = Tpend[ch][c]) >= 0) {
+        keep[p] = 1;
+        Tramp--;
+      }
+  xbuffix(&Tbuf);
+  for (i = 0; i < Tbuf.n; i++)
+    if (keep[i]) (*host->emit)(host, &Tbuf.ev[i]);
+  free(keep);
+  xbufclear(&Tbuf);
+}
+
+static void thinfinish(void *state) {
+
+  fprintf(stderr, "thin: %ld controller/pitch bend events, %ld removed "
+          "(%ld repeats, %ld ramp points, %ld dead changes)\n",
+          Tseen, Trepeat + Tramp + Tdead, Trepeat, Tramp, Tdead);
+}
+
+static struct mc_plugin Thin = {
+  MC_PLUGIN_ABI, "thin", thininit, thinprocess, thinendtrack, thinfinish
+};
+
+void xthin(char *arg) {
+
+  char *endp;
+  long v = 0;
+
+  if (arg) {
+    v = strtol(arg, &endp, 10);
+    if (*arg == '\0' || *endp != '\0' || v < 0 || v > 16383) {
+      fprintf(stderr, "thin tolerance must be between 0 and 16383\n");
+      exit(1);
+    }
+  }
+  Ttol = v;
+  xtouchtype(control_change);
+  xtouchtype(pitch_wheel);
+  xaddplugin(&Thin, "");
+}
+
+/* Flush every plugin batch, in stage order so that what one plugin emits
+   at the end of a track still goes through the plugins after it, then
+   write the held end-of-track. */
+static void xendtrack(int track) {
+
+  int i;
+  struct xplugin *p;
+
+  for (i = 0; i < Xnstages; i++) {
+    if ((p = Xplug[i]) == NULL) continue;
+    xplugflush(p);
+    if (p->pl->endtrack) (*p->pl->endtrack)(p->state, track, &p->host);
+    xplugforward(p, LONG_MAX);
+  }
+  if (Xsplitting) return;
+  if (Xeot >= 0) {
+    if (Xeot < Xwtime) Xeot = Xwtime;
+    if (Xpacking) pkrecord(Xeot, track, meta_event, end_of_track, 0, NULL, 0L);
+    else mf_w_meta_event(Xeot - Xwtime, end_of_track, NULL, 0L);
+  }
+}
+
+/* An input event's time on the output: --concat and --layer rescale each
+   input to the common division and --concat offsets it. */
+static long xtime() {
+
+  if (Xmul == Xdiv) return Xoffset + Mf_currtime;
+  return Xoffset + (Mf_currtime * Xmul + Xdiv / 2) / Xdiv;
+}
+
+static void xchan(int status, int c1, int c2) {
+
+  struct mfevent ev;
+
+  ev.time = xtime();
+  ev.track = Mf_trackno;
+  ev.status = status;
+  ev.c1 = c1;
+  ev.c2 = c2;
+  ev.leng = 0;
+  ev.msg = NULL;
+  xevent(&ev);
+}
+
+static void xmsg(int status, int type, int leng, char *mess) {
+
+  struct mfevent ev;
+
+  ev.time = xtime();
+  ev.track = Mf_trackno;
+  ev.status = status;
+  ev.c1 = type;
+  ev.c2 = 0;
+  ev.leng = leng;
+  ev.msg = (unsigned char *) mess;
+  xevent(&ev);
+}
+
+static void xnon(int chan, int c1, int c2)  { xchan(note_on|chan, c1, c2); }
+static void xnoff(int chan, int c1, int c2) { xchan(note_off|chan, c1, c2); }
+static void xpressure(int chan, int c1, int c2) {
+  xchan(poly_aftertouch|chan, c1, c2);
+}
+static void xparameter(int chan, int c1, int c2) {
+  xchan(control_change|chan, c1, c2);
+}
+static void xpitchbend(int chan, int c1, int c2) {
+  xchan(pitch_wheel|chan, c1, c2);
+}
+static void xprogram(int chan, int c1) { xchan(program_chng|chan, c1, 0); }
+static void xchanpressure(int chan, int c1) {
+  xchan(channel_aftertouch|chan, c1, 0);
+}
+static void xsysex(int leng, char *mess) {
+  xmsg(system_exclusive, 0, leng, mess);
+}
+static void xarbitrary(int leng, char *mess) { xmsg(0xf7, 0, leng, mess); }
+static void xmeta(int type, int leng, char *mess) {
+  xmsg(meta_event, type, leng, mess);
+}
+
+/* SysEx and Arb go straight from the reader to the writer, a piece at a
+   time, when nothing in between could change them or hold other events
+   back: no stage touches them and there's no plugin batching events. */
+static void xsxbegin(int status, long leng) {
+
+  long t = xtime();
+
+  if (t < Xwtime) t = Xwtime;
+  mf_w_sysex_begin(t - Xwtime, status, leng);
+  Xwtime = t;
+}
+
+static void xstreaminit() {
+
+  int i;
+
+  for (i = 0; i < Xnstages; i++)
+    if (Xplug[i]) return;
+  if (Xtouch[system_exclusive] || Xtouch[0xf7]) return;
+  Mf_sxbegin = Xpacking ? pksxbegin : xsxbegin;
+  Mf_sxdata = Xpacking ? pksxdata : mf_w_sysex_data;
+}
+
+static void xheader(int format, int ntrks, int division) {
+
+  int i;
+  struct xplugin *p;
+
+  Xformat = format;
+  Xntrks = ntrks;
+  Xdivision = division;
+  for (i = 0; i < Xnstages; i++) {
+    if ((p = Xplug[i]) == NULL) continue;
+    p->host.format = format;
+    p->host.ntrks = ntrks;
+    p->host.division = division;
+    if (p->pl->init && (p->state = (*p->pl->init)(p->args, &p->host)) == NULL) {
+      fprintf(stderr, "plugin %s: refused arguments '%s'\n",
+              p->pl->name ? p->pl->name : "", p->args);
+      exit(1);
+    }
+  }
+}
+
+static int xwritetrack(int which) {
+
+  int more;
+  long len;
+
+  while (Mend - Mp >= 8 && to32bit(Mp[0], Mp[1], Mp[2], Mp[3]) != MTrk) {
+    len = to32bit(Mp[4], Mp[5], Mp[6], Mp[7]);
+    if (len > Mend - Mp - 8) break;
+    Mp += 8 + len;
+    Mf_skipped++;
+  }
+  if (Mend - Mp >= 8 && to32bit(Mp[0], Mp[1], Mp[2], Mp[3]) == MTrk) {
+    len = to32bit(Mp[4], Mp[5], Mp[6], Mp[7]);
+    if (len <= Mend - Mp - 8 && xpassthru(Mp + 8, len)) {
+      Mp += 8 + len;
+      Mf_trackno++;
+      return 1;
+    }
+  }
+  Xwtime = 0;
+  Xeot = -1;
+  more = readtrack();
+  xendtrack(which + 1);
+  return more;
+}
+
+/* midicomp [stages] in.mid out.mid */
+void xform(char *infile, char *outfile) {
+
+  static char obuf[XBUFSIZE];
+  int i;
+
+  mapinput(infile);
+  Mf_getc = memgetc;
+  if (strcmp(outfile, "-") == 0) F = fdopen(fileno(stdout), "wb");
+  else F = efopen(outfile, "wb");
+  setvbuf(F, obuf, _IOFBF, sizeof(obuf));
+
+  Mf_error = myerror;
+  Mf_header = xheader;
+  Mf_on = xnon;
+  Mf_off = xnoff;
+  Mf_pressure = xpressure;
+  Mf_parameter = xparameter;
+  Mf_pitchbend = xpitchbend;
+  Mf_program = xprogram;
+  Mf_chanpressure = xchanpressure;
+  Mf_sysex = xsysex;
+  Mf_arbitrary = xarbitrary;
+  Mf_metaraw = xmeta;
+  Mf_putc = fileputc;
+  Mf_wtrack = xwritetrack;
+  if (compact) xaddstage(xscompact);
+  xtouchinit();
+  if (!splitch) xstreaminit();
+
+  if (xbulk()) {
+    xmodel();
+  } else {
+    readheader();
+    if (Xformat < 0) mferror("no MThd header");
+    if (merge || splitch) {
+      if (Xformat == 2) mferror("can't merge the independent tracks of format 2");
+    }
+    if (splitch) {
+      Xsplitfirst = malloc((Xntrks + 1) * sizeof(int));
+      Xsplitprefix = malloc((Xntrks + 1) * sizeof(int));
+      if (Xsplitfirst == NULL || Xsplitprefix == NULL) fatal("Out of memory");
+      for (i = 0; i <= Xntrks; i++) Xsplitfirst[i] = Xsplitprefix[i] = -1;
+      Xsplitting = 1;
+      xmergetrack(0);
+      Xsplitting = 0;
+      Mf_wtrack = xsplittrack;
+      for (Xnsplit = 1, i = 1; i <= 16; i++)
+        if (Xsplit[i].n > 0) Xsplitmap[Xnsplit++] = i;
+      mfwrite(1, Xnsplit, Xdivision, F);
+    } else if (merge) {
+      Mf_wtrack = xmergetrack;
+      mfwrite(0, 1, Xdivision, F);
+    } else {
+      mfwrite(Xformat, Xntrks, Xdivision, F);
+    }
+  }
+  for (i = 0; i < Xnstages; i++)
+    if (Xplug[i] && Xplug[i]->pl->finish) (*Xplug[i]->pl->finish)(Xplug[i]->state);
+  if (compact) compactreport(F);
+  if (Mf_skipped)
+    fprintf(stderr, "Skipped %d unknown chunk%s\n", Mf_skipped,
+            Mf_skipped == 1 ? "" : "s");
+  if (fclose(F) == EOF) { fprintf(stderr, "Output file error\n"); exit(1); }
+}
+
+/* --packed: the events as a binary stream, for another midicomp to read
+   without formatting or lexing them. PK_HDRLEN bytes of header: "MCPK",
+   the version and the MThd's format, ntrks and division; then a record
+   per event: tick (absolute in its track, 4 bytes), track (1-based, 2),
+   status, c1, c2 (1 each), payload length (4) and the payload, all
+   little-endian. The fields are those of a struct mfevent, so a Meta's
+   type is c1 and a SysEx payload starts with its F0. A record of status 0
+   starts each track. The decoder writes them from the transform path, so
+   the stages apply; -c --packed writes them with the compiler's cwrite(). */
+
+static void pkle(unsigned char *p, unsigned long v, int n) {
+
+  while (n-- > 0) {
+    *p++ = v & 0xff;
+    v >>= 8;
+  }
+}
+
+static unsigned long pkget(unsigned char *p, int n) {
+
+  unsigned long v = 0;
+
+  while (n-- > 0) v = (v << 8) | p[n];
+  return v;
+}
+
+/* --json: the same stream as NDJSON, one object per line, for programs
+   that would rather not read binary. The first line is the header,
+   {"type":"MThd","version":1,"format":1,"ntrks":2,"division":96}, then
+   {"type":"MTrk","track":1} starts each track, and an event is
+   {"tick":0,"track":1,"type":"On","ch":1,"n":60,"v":100}, named and keyed
+   as in the text (Pb's v is 14 bits and ch is 1-16). SysEx, Arb and Meta
+   (with "meta" its type) carry their payload as hex in "data", except a
+   text Meta, which carries it as a string in "text": bytes outside ASCII
+   and the control characters are escaped as \u0000-\u00ff, so the bytes
+   read back as they were. The objects are put out a character at a time
+   here and read by jsread(), neither going through printf or the lexer. */
+
+static struct {
+  char *name;
+  int k1, k2;               /* Jskey[] of the data bytes, -1 for none */
+} Jschan[7] = {
+  {"Off", 3, 4}, {"On", 3, 4}, {"PoPr", 3, 4}, {"Par", 5, 4},
+  {"PrCh", 6, -1}, {"ChPr", 4, -1}, {"Pb", 4, -1}
+};
+static char *Jskey[] = {"tick", "track", "ch", "n", "v", "c", "p", "meta",
+                        "format", "ntrks", "division", "version"};
+#define JS_NKEY  (int)(sizeof(Jskey) / sizeof(Jskey[0]))
+static long Jsleft;                 /* bytes of a streamed payload to come */
+
+static void jsputc(int c) {
+
+  if (putc(c, F) == EOF) mferror("error writing");
+  Lout++;
+}
+
+static void jsputs(char *s) {
+
+  while (*s) jsputc(*s++);
+}
+
+/* ,"key":v, or without the comma for the first member */
+static void jsint(char *key, long v, int first) {
+
+  char d[24];
+  int n = 0;
+  unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+
+  if (!first) jsputc(',');
+  jsputc('"');
+  jsputs(key);
+  jsputs("\":");
+  if (v < 0) jsputc('-');
+  do d[n++] = '0' + u % 10; while ((u /= 10) > 0);
+  while (n > 0) jsputc(d[--n]);
+}
+
+static void jsstring(unsigned char *s, long n) {
+
+  static char hex[] = "0123456789abcdef";
+  int c;
+
+  jsputc('"');
+  while (n-- > 0) {
+    c = *s++;
+    if (c == '"' || c == '\\') {
+      jsputc('\\');
+      jsputc(c);
+    } else if (c == '\n') jsputs("\\n");
+    else if (c == '\t') jsputs("\\t");
+    else if (c == '\r') jsputs("\\r");
+    else if (c < 0x20 || c >= 0x7f) {
+      jsputs("\\u00");
+      jsputc(hex[c >> 4]);
+      jsputc(hex[c & 0xf]);
+    } else jsputc(c);
+  }
+  jsputc('"');
+}
+
+/* Hex payload bytes, closing the object after the last of a streamed one. */
+static void jsdata(unsigned char *data, long n) {
+
+  static char hex[] = "0123456789abcdef";
+
+  Jsleft -= n;
+  while (n-- > 0) {
+    jsputc(hex[*data >> 4]);
+    jsputc(hex[*data++ & 0xf]);
+  }
+  if (Jsleft <= 0) jsputs("\"}\n");
+}
+
+static void jsrecord(long time, int track, int status, int c1, int c2,
+                     unsigned char *msg, long leng) {
+
+  int i;
+
+  jsputc('{');
+  if (status == 0) {
+    jsputs("\"type\":\"MTrk\"");
+    jsint("track", track, 0);
+    jsputs("}\n");
+    return;
+  }
+  jsint("tick", time, 1);
+  jsint("track", track, 0);
+  jsputs(",\"type\":\"");
+  if (status < system_exclusive) {
+    i = (status >> 4) - 8;
+    jsputs(Jschan[i].name);
+    jsputc('"');
+    jsint("ch", (status & 0xf) + 1, 0);
+    if (status >= pitch_wheel) jsint("v", c1 + 128 * c2, 0);
+    else {
+      jsint(Jskey[Jschan[i].k1], c1, 0);
+      if (Jschan[i].k2 >= 0) jsint(Jskey[Jschan[i].k2], c2, 0);
+    }
+    jsputs("}\n");
+    return;
+  }
+  jsputs(status == system_exclusive ? "SysEx\"" : status == 0xf7 ? "Arb\"" : "Meta\"");
+  if (status == meta_event) {
+    jsint("meta", c1, 0);
+    if (c1 >= text_event && c1 <= 0x0f) {
+      jsputs(",\"text\":");
+      jsstring(msg, leng);
+      jsputs("}\n");
+      return;
+    }
+  }
+  jsputs(",\"data\":\"");
+  Jsleft = leng;
+  if (msg || leng == 0) jsdata(msg, leng);
+}
+
+/* A record, with its payload unless msg is NULL (a streamed SysEx). */
+static void pkrecord(long time, int track, int status, int c1, int c2,
+                     unsigned char *msg, long leng) {
+
+  unsigned char r[PK_RECLEN];
+
+  if (exportdir) {
+    colrecord(time, track, status, c1, c2, msg, leng);
+    return;
+  }
+  if (json) {
+    jsrecord(time, track, status, c1, c2, msg, leng);
+    return;
+  }
+  pkle(r, time, 4);
+  pkle(r + 4, track, 2);
+  r[6] = status;
+  r[7] = c1;
+  r[8] = c2;
+  pkle(r + 9, leng, 4);
+  if (fwrite(r, 1, PK_RECLEN, F) != PK_RECLEN) mferror("error writing");
+  Lout += PK_RECLEN;
+  if (msg) pksxdata(msg, leng);
+}
+
+/* SysEx and Arb packets are streamed into their records as xsxbegin()
+   streams them to the SMF, each at its own time. */
+static void pksxdata(unsigned char *data, int n) {
+
+  if (exportdir) {
+    coldata(data, n);
+    return;
+  }
+  if (json) {
+    jsdata(data, n);
+    return;
+  }
+  if (n > 0 && fwrite(data, 1, n, F) != n) mferror("error writing");
+  Lout += n;
+}
+
+static void pksxbegin(int status, long leng) {
+
+  unsigned char f0 = 0xf0;
+  long t = xtime();
+
+  if (t < Xwtime) t = Xwtime;
+  pkrecord(t, Mf_trackno, status, 0, 0, NULL, leng + (status == 0xf0));
+  if (status == 0xf0) pksxdata(&f0, 1);
+  Xwtime = t;
+}
+
+static void pkstarttrack() {
+
+  Xwtime = 0;
+  Xeot = -1;
+  pkrecord(0L, Mf_trackno, 0, 0, 0, NULL, 0L);
+}
+
+static void pkendtrack() {
+
+  xendtrack(Mf_trackno);
+}
+
+/* The reader callbacks that send the events through the stages to
+   pkrecord(), for --packed, --json and --export-columns. */
+static void pkinit(char *opt) {
+
+  if (merge || splitch) {
+    fprintf(stderr, "--%s doesn't go with --merge or --split-channels\n", opt);
+    exit(1);
+  }
+  Mf_getc = memgetc;
+  Mf_error = myerror;
+  Mf_header = xheader;
+  Mf_starttrack = pkstarttrack;
+  Mf_endtrack = pkendtrack;
+  Mf_on = xnon;
+  Mf_off = xnoff;
+  Mf_pressure = xpressure;
+  Mf_parameter = xparameter;
+  Mf_pitchbend = xpitchbend;
+  Mf_program = xprogram;
+  Mf_chanpressure = xchanpressure;
+  Mf_sysex = xsysex;
+  Mf_arbitrary = xarbitrary;
+  Mf_metaraw = xmeta;
+  xtouchinit();
+  Xpacking = 1;
+  xstreaminit();
+}
+
+/* midicomp --packed [stages] in.mid [out] */
+void pkdecode(char *infile, char *outfile) {
+
+  static char obuf[XBUFSIZE];
+  unsigned char h[PK_HDRLEN];
+  int i;
+
+  pkinit(json ? "json" : "packed");
+  mapinput(infile);
+  if (strcmp(outfile, "-") == 0) F = fdopen(fileno(stdout), "wb");
+  else F = efopen(outfile, "wb");
+  setvbuf(F, obuf, _IOFBF, sizeof(obuf));
+
+  readheader();
+  if (Xformat < 0) mferror("no MThd header");
+  if (json) {
+    jsputs("{\"type\":\"MThd\"");
+    jsint("version", JS_VERSION, 0);
+    jsint("format", Xformat, 0);
+    jsint("ntrks", Xntrks, 0);
+    jsint("division", Xdivision, 0);
+    jsputs("}\n");
+  } else {
+    memcpy(h, "MCPK", 4);
+    h[4] = PK_VERSION;
+    pkle(h + 5, Xformat, 2);
+    pkle(h + 7, Xntrks, 2);
+    pkle(h + 9, Xdivision, 2);
+    if (fwrite(h, 1, PK_HDRLEN, F) != PK_HDRLEN) mferror("error writing");
+  }
+  while (readtrack()) ;
+  for (i = 0; i < Xnstages; i++)
+    if (Xplug[i] && Xplug[i]->pl->finish) (*Xplug[i]->pl->finish)(Xplug[i]->state);
+  if (Mf_skipped)
+    fprintf(stderr, "Skipped %d unknown chunk%s\n", Mf_skipped,
+            Mf_skipped == 1 ? "" : "s");
+  if (fclose(F) == EOF) { fprintf(stderr, "Output file error\n"); exit(1); }
+}
+
+/* --in-place file.mid: same-size edits patched into the file itself.
+
+   The file is walked once with the normal reader, and each event is put
+   through the stages by xpatch() instead of being written. When the
+   reader's callback runs, Mp is just past the event in the mapping, so a
+   changed data byte, channel nibble or meta payload is at a known offset
+   back from it; the patches are collected, and only applied (through a
+   read-write shared mapping) once the whole file has been seen to fit. An
+   edit that can't be made in place - a dropped event, a changed length or
+   type, a status that running status shares with an event mapped
+   differently, a change to a SysEx split into packets - makes it a full rewrite through a temporary file, as are
+   --where, --compact and plugins, which can always change lengths. */
+
+static long *Poff;
+static unsigned char *Pval;
+static int Pn, Psize, Pnofit, Prunto;
+static unsigned char *Psx;      /* a SysEx joined from packets, as read */
+static long Psxsize;
+
+static void xpatchbyte(unsigned char *at, int val) {
+
+  if (*at == val) return;
+  if (Pn >= Psize) {
+    Psize = Psize ? 2 * Psize : 1024;
+    Poff = realloc(Poff, Psize * sizeof(long));
+    Pval = realloc(Pval, Psize);
+    if (Poff == NULL || Pval == NULL) fatal("Out of memory");
+  }
+  Poff[Pn] = at - Mbase;
+  Pval[Pn++] = val;
+}
+
+static void xpatch(struct mfevent *ev) {
+
+  struct mfevent e;
+  unsigned char *at;
+  int i, n;
+
+  if (Pnofit) return;
+  e = *ev;
+  if (Mf_sxjoined) {
+    if (ev->leng > Psxsize) {
+      Psxsize = ev->leng;
+      if ((Psx = realloc(Psx, Psxsize)) == NULL) fatal("Out of memory");
+    }
+    memcpy(Psx, ev->msg, ev->leng);
+  }
+  for (i = 0; i < Xnstages; i++)
+    if (!(*Xstage[i])(&e)) { Pnofit = 1; return; }
+  if (e.time != ev->time || e.leng != ev->leng
+      || (e.status < 0xf0) != (ev->status < 0xf0)
+      || (e.status >= 0xf0 && (e.status != ev->status || e.c1 != ev->c1))) {
+    Pnofit = 1;
+    return;
+  }
+  if (ev->status >= 0xf0) {
+    if (Mf_sxjoined) {
+      /* the packets' own bytes lie between its bytes in the file, so it
+         can only be left as it is */
+      if (memcmp(Psx, e.msg, e.leng) != 0) Pnofit = 1;
+    } else if (ev->status == system_exclusive) {
+      /* msg starts with the F0, which isn't next to the data in the file */
+      for (i = 1; i < e.leng; i++) xpatchbyte(Mp - e.leng + i, e.msg[i]);
+    } else {
+      for (i = 0; i < e.leng; i++) xpatchbyte(Mp - e.leng + i, e.msg[i]);
+    }
+    return;
+  }
+  n = ((ev->status & 0xe0) == 0xc0) ? 1 : 2;
+  xpatchbyte(Mp - n, e.c1);
+  if (n == 2) xpatchbyte(Mp - 1, e.c2);
+  at = Mp - n - 1;
+  if (*at & 0x80) {
+    /* the last byte of a delta time never has the top bit set */
+    Prunto = (*at & 0xf0) | (e.status & 0xf);
+    xpatchbyte(at, Prunto);
+  } else if ((e.status & 0xf) != (Prunto & 0xf)) {
+    Pnofit = 1;
+  }
+}
+
+static void xpatchstart() {
+
+  Prunto = 0;
+}
+
+static int xpatchapply(char *name) {
+
+#ifdef HAVE_MMAP
+  unsigned char *m;
+  struct stat st;
+  int fd, i;
+
+  if ((fd = open(name, O_RDWR)) < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "Cannot open '%s', %s!\n", name, strerror(errno));
+    exit(1);
+  }
+  if (st.st_size != Mlen) mferror("file changed while being edited");
+  if (Pn > 0) {
+    m = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) { close(fd); return 0; }
+    for (i = 0; i < Pn; i++) m[Poff[i]] = Pval[i];
+    if (msync(m, st.st_size, MS_SYNC) < 0) {
+      fprintf(stderr, "%s: %s\n", name, strerror(errno));
+      exit(1);
+    }
+    munmap(m, st.st_size);
+  }
+  close(fd);
+  if (dbg) fprintf(stderr, "%s: %d bytes patched in place\n", name, Pn);
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+void xinplace(char *name) {
+
+  char *tmp, *real = NULL;
+  struct stat st;
+  int fd, ok = !compact;
+
+  for (fd = 0; fd < Xnstages; fd++)
+    if (Xplug[fd]) ok = 0;
+  for (fd = 0x80; fd < 0x100; fd++)
+    if (Wtab[fd] != W_KEEP) ok = 0;
+  if (ok) {
+    mapinput(name);
+    Mf_error = myerror;
+    Mf_getc = memgetc;
+    Mf_header = xheader;
+    Mf_starttrack = xpatchstart;
+    Mf_on = xnon;
+    Mf_off = xnoff;
+    Mf_pressure = xpressure;
+    Mf_parameter = xparameter;
+    Mf_pitchbend = xpitchbend;
+    Mf_program = xprogram;
+    Mf_chanpressure = xchanpressure;
+    Mf_sysex = xsysex;
+    Mf_arbitrary = xarbitrary;
+    Mf_metaraw = xmeta;
+    Xpatching = 1;
+    readheader();
+    if (Xformat < 0) mferror("no MThd header");
+    while (!Pnofit && readtrack()) ;
+    Xpatching = 0;
+    Mf_starttrack = NULLFUNC;
+    if (!Pnofit && xpatchapply(name)) return;
+    Mf_trackno = 0;
+  }
+
+  /* a full rewrite, renamed over the original - over the file a symlink
+     points to, not the link - and given the original's owner and mode */
+#ifdef HAVE_REALPATH
+  if ((real = realpath(name, NULL)) != NULL) name = real;
+#endif
+  if (stat(name, &st) < 0) {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    exit(1);
+  }
+  tmp = malloc(strlen(name) + 16);
+  if (tmp == NULL) fatal("Out of memory");
+  sprintf(tmp, "%s.mc-XXXXXX", name);
+  if ((fd = mkstemp(tmp)) < 0) {
+    fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+    exit(1);
+  }
+  close(fd);
+  xform(name, tmp);
+#ifdef HAVE_CHOWN
+  /* only root can give a file away; the group may still be kept */
+  if (chown(tmp, st.st_uid, st.st_gid) < 0 && chown(tmp, -1, st.st_gid) < 0 && dbg)
+    fprintf(stderr, "%s: owner not kept, %s\n", name, strerror(errno));
+#endif
+  if (chmod(tmp, st.st_mode & 07777) < 0) {
+    fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+    remove(tmp);
+    exit(1);
+  }
+  if (rename(tmp, name) < 0) {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    remove(tmp);
+    exit(1);
+  }
+  if (dbg) fprintf(stderr, "%s: rewritten\n", name);
+  free(tmp);
+  free(real);
+}
+
+/* Input mapping. Paths that need to jump around in the input file (the
+   track merge, and later the chunk walkers) map it instead of reading it
+   through stdio; a pipe, or a platform without mmap(), is read into memory
+   instead. memgetc() is the Mf_getc that reads from the mapping. mapfile()
+   returns -1 (with errno) where mapinput() gives up. */
+
+int mapfile(char *name) {
+
+  int fd;
+  long n, size;
+#ifdef HAVE_MMAP
+  struct stat st;
+#endif
+
+  if (strcmp(name, "-") == 0) fd = 0;
+  else if ((fd = open(name, O_RDONLY)) < 0) return -1;
+  Mmapped = 0;
+#ifdef HAVE_MMAP
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    Mbase = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (Mbase != MAP_FAILED) {
+      Mmapped = 1;
+      Mlen = st.st_size;
+      Mp = Mbase;
+      Mend = Mbase + Mlen;
+      close(fd);
+      return 0;
+    }
+  }
+#endif
+  Mbase = NULL;
+  Mlen = size = 0;
+  do {
+    if (Mlen == size) {
+      size = size ? 2 * size : XBUFSIZE;
+      if ((Mbase = realloc(Mbase, size)) == NULL) fatal("Out of memory");
+    }
+    n = read(fd, Mbase + Mlen, size - Mlen);
+    if (n < 0) {
+      if (fd != 0) close(fd);
+      return -1;
+    }
+    Mlen += n;
+  } while (n > 0);
+  if (fd != 0) close(fd);
+  Mp = Mbase;
+  Mend = Mbase + Mlen;
+  return 0;
+}
+
+void unmapfile() {
+
+#ifdef HAVE_MMAP
+  if (Mmapped) munmap(Mbase, Mlen);
+  else
+#endif
+  free(Mbase);
+  Mbase = Mp = Mend = NULL;
+  Mlen = 0;
+}
+
+void mapinput(char *name) {
+
+  if (mapfile(name) < 0) {
+    fprintf(stderr, "Cannot open '%s', %s!\n", name, strerror(errno));
+    exit(1);
+  }
+}
+
+int memgetc() {
+
+  return (Mp < Mend) ? *Mp++ : EOF;
+}
+
+/* --check file...: is each file a well formed SMF? The reader runs with
+   Mf_check set and no callbacks: no event is formatted or copied, and the
+   checks it adds - payloads and the last event inside their track, data
+   bytes below 0x80, one end of track closing each track, a finished SysEx,
+   the MThd fields and track count - throw to Ckjump with the first error,
+   which is reported on one line. Returns the number of bad files. */
+
+static jmp_buf Ckjump;
+static char Ckmsg[80];
+static int Ckntrks;
+
+static void checkerror(char *s) {
+
+  strncpy(Ckmsg, s, sizeof(Ckmsg) - 1);
+  longjmp(Ckjump, 1);
+}
+
+static void checkheader(int format, int ntrks, int division) {
+
+  Ckntrks = ntrks;
+  if (format > 2) mferror("unknown MThd format");
+  if (format == 0 && ntrks != 1) mferror("format 0 with more than one track");
+  if (division == 0) mferror("MThd division is 0");
+}
+
+static int checkfile(char *name) {
+
+  char mess[80];
+  int n;
+
+  if (mapfile(name) < 0) {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    return 1;
+  }
+  if (setjmp(Ckjump)) {
+    fprintf(stderr, "%s: %s at byte %ld\n", name, Ckmsg, (long) (Mp - Mbase));
+    unmapfile();
+    return 1;
+  }
+  Ckntrks = -1;
+  Mf_trackno = 0;
+  readheader();
+  if (Ckntrks < 0) mferror("no MThd header");
+  for (n = 0; readtrack(); n++) ;
+  if (n != Ckntrks) {
+    sprintf(mess, "MThd says %d tracks, found %d", Ckntrks, n);
+    checkerror(mess);
+  }
+  if (verbose && Mf_skipped)
+    fprintf(stderr, "%s: ok, %d unknown chunk%s skipped\n", name, Mf_skipped,
+            Mf_skipped == 1 ? "" : "s");
+  else if (verbose)
+    fprintf(stderr, "%s: ok\n", name);
+  unmapfile();
+  return 0;
+}
+
+int checkfiles(char **names, int n) {
+
+  int bad = 0;
+
+  Mf_check = 1;
+  Mf_error = checkerror;
+  Mf_getc = memgetc;
+  Mf_header = checkheader;
+  if (n == 0) return checkfile("-");
+  while (n-- > 0) bad += checkfile(*names++);
+  return bad;
+}
+
+/* --info file...: the MThd fields and the chunk directory, without reading
+   the chunks. After readheader() each chunk header is read and the chunk
+   seeked over, so the I/O is per chunk, not per byte; only a pipe, which
+   can't seek, has to be read through. Errors are reported like --check's. */
+
+static int Ifmt, Intrks, Idiv;
+
+static int infogetc() {
+
+  int c = getc(F);
+
+  if (c != EOF) Ipos++;
+  return c;
+}
+
+static void infoheader(int format, int ntrks, int division) {
+
+  Ifmt = format;
+  Intrks = ntrks;
+  Idiv = division;
+}
+
+static int infofile(char *name) {
+
+  unsigned char h[4];
+  struct stat st;
+  long id, pos, len, size = -1;
+  int i, n = 0, ntrk = 0;
+
+  if (strcmp(name, "-") == 0) F = stdin;
+  else if ((F = fopen(name, "rb")) == NULL) {
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    return 1;
+  }
+  if (fstat(fileno(F), &st) == 0 && S_ISREG(st.st_mode)) size = st.st_size;
+  if (setjmp(Ckjump)) {
+    fprintf(stderr, "%s: %s\n", name, Ckmsg);
+    if (F != stdin) fclose(F);
+    return 1;
+  }
+  Ifmt = -1;
+  Ipos = 0;
+  Mf_getc = infogetc;
+  readheader();
+  if (Ifmt < 0) mferror("no MThd header");
+  printf("%s: format %d, %d track%s, ", name, Ifmt,
+         Intrks, Intrks == 1 ? "" : "s");
+  if (Idiv & 0x8000)
+    printf("SMPTE %d fps, %d ticks/frame", 256 - ((Idiv >> 8) & 0xff), Idiv & 0xff);
+  else
+    printf("%d ticks/quarter", Idiv);
+  if (size >= 0) printf(", %ld bytes", size);
+  if (Mf_getc == riffgetc) {
+    printf(", RMID");
+    size = Ipos + Mf_riffleft;
+  }
+  printf("\n");
+  pos = Ipos;
+  while ((id = readid()) != EOF) {
+    len = read32bit();
+    for (i = 0; i < 4; i++) {
+      h[i] = (id >> (24 - 8*i)) & 0xff;
+      if (h[i] < 0x20 || h[i] > 0x7e) h[i] = '.';
+    }
+    printf("  %-3d %.4s at %-8ld %ld bytes", ++n, (char *) h, pos, len);
+    if (id == MTrk) ntrk++;
+    pos += 8 + len;
+    if (size >= 0 && pos > size) {
+      printf(" (truncated to %ld)\n", len - (pos - size));
+      break;
+    }
+    printf("\n");
+    skipbytes(len);
+  }
+  if (ntrk != Intrks)
+    printf("  %d track%s, MThd says %d\n", ntrk, ntrk == 1 ? "" : "s", Intrks);
+  if (F != stdin) fclose(F);
+  return 0;
+}
+
+int infofiles(char **names, int n) {
+
+  int bad = 0;
+
+  Mf_error = checkerror;
+  Mf_header = infoheader;
+  if (n == 0) return infofile("-");
+  while (n-- > 0) bad += infofile(*names++);
+  return bad;
+}
+
+/* --export-columns=DIR file...: the events of many files, for analysis
+   tools to map and scan, as a file of little-endian values per field:
+   file (u32, the line of files.txt naming the input), track (u16), tick
+   (u32, absolute in its track), status (u8), key (u8: n, c or p, a Meta's
+   type), value (u16: v, 14 bits for Pb) and payload_end (u64), where the
+   event's bytes in payload (u8) end; they start where the previous
+   event's end. Each DIR/name.col starts with COL_HDRLEN bytes: "MCCO",
+   COL_VERSION, the width of a value, two zero bytes and the count of
+   values (8 bytes). The events come through the stages as for --packed.
+   A file's events are held in memory until it has been read whole, and
+   files --check rejects are named and skipped. An export into a DIR that
+   holds one adds to it. Returns the number of files skipped. */
+
+static struct column {
+  char *name;
+  int width;
+  FILE *fp;
+  unsigned long n;                  /* values in the file */
+  unsigned char *buf;               /* the current input's, to add */
+  long len, size;
+} Col[] = {
+  {"file", 4}, {"track", 2}, {"tick", 4}, {"status", 1}, {"key", 1},
+  {"value", 2}, {"payload_end", 8}, {"payload", 1}
+};
+#define COL_NCOL  (int)(sizeof(Col) / sizeof(Col[0]))
+#define COL_PAYLOAD  (COL_NCOL - 1)
+static FILE *Colfiles;              /* files.txt */
+static unsigned long Colfile;       /* the current input's line in it */
+
+static void colgrow(struct column *c, long n) {
+
+  if (c->len + n > c->size) {
+    while (c->len + n > c->size) c->size = c->size ? 2 * c->size : XBUFSIZE;
+    if ((c->buf = realloc(c->buf, c->size)) == NULL) fatal("Out of memory");
+  }
+}
+
+static void colput(int k, unsigned long v) {
+
+  struct column *c = &Col[k];
+
+  colgrow(c, c->width);
+  pkle(c->buf + c->len, v, c->width);
+  c->len += c->width;
+}
+
+static void coldata(unsigned char *data, long n) {
+
+  struct column *c = &Col[COL_PAYLOAD];
+
+  colgrow(c, n);
+  memcpy(c->buf + c->len, data, n);
+  c->len += n;
+}
+
+static void colrecord(long time, int track, int status, int c1, int c2,
+                      unsigned char *msg, long leng) {
+
+  int key = c1, value = c2;
+
+  if (status == 0) return;
+  switch (status & 0xf0) {
+   case program_chng:
+    value = 0;
+    break;
+   case channel_aftertouch:
+    key = 0;
+    value = c1;
+    break;
+   case pitch_wheel:
+    key = 0;
+    value = c1 + 128 * c2;
+    break;
+   case system_exclusive:
+    if (status != meta_event) key = 0;
+    value = 0;
+  }
+  colput(0, Colfile);
+  colput(1, track);
+  colput(2, time);
+  colput(3, status);
+  colput(4, key);
+  colput(5, value);
+  colput(6, Col[COL_PAYLOAD].n + Col[COL_PAYLOAD].len + leng);
+  if (msg) coldata(msg, leng);
+}
+
+static void colheader(struct column *c) {
+
+  unsigned char h[COL_HDRLEN];
+
+  memcpy(h, "MCCO", 4);
+  h[4] = COL_VERSION;
+  h[5] = c->width;
+  h[6] = h[7] = 0;
+  pkle(h + 8, c->n, 8);
+  if (fseek(c->fp, 0L, SEEK_SET) != 0 || fwrite(h, 1, COL_HDRLEN, c->fp) != COL_HDRLEN) {
+    fprintf(stderr, "%s.col: %s\n", c->name, strerror(errno));
+    exit(1);
+  }
+}
+
+/* Open DIR's columns, making them if they aren't there, and check that
+   those that are hold a finished export. */
+static void colopen(char *dir) {
+
+  char path[PATH_MAX];
+  unsigned char h[COL_HDRLEN];
+  struct column *c;
+  int k, ch;
+
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+    exit(1);
+  }
+  for (k = 0; k < COL_NCOL; k++) {
+    c = &Col[k];
+    snprintf(path, sizeof(path), "%s/%s.col", dir, c->name);
+    if ((c->fp = fopen(path, "r+b")) == NULL) {
+      c->fp = efopen(path, "w+b");
+      colheader(c);
+      continue;
+    }
+    if (fread(h, 1, COL_HDRLEN, c->fp) != COL_HDRLEN || memcmp(h, "MCCO", 4) != 0
+        || h[4] != COL_VERSION || h[5] != c->width) {
+      fprintf(stderr, "%s: not a midicomp column of this version\n", path);
+      exit(1);
+    }
+    c->n = pkget(h + 8, 8);
+    if (fseek(c->fp, 0L, SEEK_END) != 0
+        || ftell(c->fp) != COL_HDRLEN + (long) c->n * c->width
+        || (k > 0 && k < COL_PAYLOAD && c->n != Col[0].n)) {
+      fprintf(stderr, "%s: the export there is unfinished or damaged\n", path);
+      exit(1);
+    }
+  }
+  snprintf(path, sizeof(path), "%s/files.txt", dir);
+  Colfiles = efopen(path, "a+");
+  rewind(Colfiles);
+  while ((ch = getc(Colfiles)) != EOF) Colfile += (ch == '\n');
+}
+
+/* Add one file; returns 1 if --check rejects it. */
+static int colexport(char *name) {
+
+  int i, limits = Llimits;
+
+  Mf_check = 1;
+  Mf_error = checkerror;
+  Mf_header = checkheader;
+  Mf_starttrack = Mf_endtrack = NULLFUNC;
+  Llimits = 0;
+  i = checkfile(name);
+  Llimits = limits;
+  Mf_check = 0;
+  Mf_error = myerror;
+  Mf_header = xheader;
+  Mf_starttrack = pkstarttrack;
+  Mf_endtrack = pkendtrack;
+  if (i) return 1;
+
+  mapinput(name);
+  Mf_trackno = 0;
+  Xformat = -1;
+  readheader();
+  while (readtrack()) ;
+  for (i = 0; i < Xnstages; i++)
+    if (Xplug[i] && Xplug[i]->pl->finish) (*Xplug[i]->pl->finish)(Xplug[i]->state);
+  unmapfile();
+
+  for (i = 0; i < COL_NCOL; i++) {
+    if (fseek(Col[i].fp, 0L, SEEK_END) != 0
+        || fwrite(Col[i].buf, 1, Col[i].len, Col[i].fp) != Col[i].len)
+      mferror("error writing");
+    Col[i].n += Col[i].len / Col[i].width;
+    Col[i].len = 0;
+  }
+  fprintf(Colfiles, "%s\n", name);
+  Colfile++;
+  return 0;
+}
+
+int exportcolumns(char **names, int n) {
+
+  char line[PATH_MAX + 2];
+  int bad = 0, k;
+  size_t len;
+
+  pkinit("export-columns");
+  colopen(exportdir);
+  if (n == 0) {
+    while (fgets(line, sizeof(line), stdin)) {
+      len = strlen(line);
+      while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+      if (len > 0) bad += colexport(line);
+    }
+  }
+  while (n-- > 0) bad += colexport(*names++);
+  for (k = 0; k < COL_NCOL; k++) {
+    colheader(&Col[k]);
+    if (fclose(Col[k].fp) == EOF) {
+      fprintf(stderr, "%s.col: %s\n", Col[k].name, strerror(errno));
+      exit(1);
+    }
+  }
+  if (fclose(Colfiles) == EOF) {
+    fprintf(stderr, "files.txt: %s\n", strerror(errno));
+    exit(1);
+  }
+  return bad;
+}
+
+/* Track merge (--merge, --to-format0).
+
+   Every MTrk chunk gets a cursor at its offset in the mapped file, and the
+   cursors sit in a min-heap keyed on the absolute time of their next event
+   (ties go to the lower track, and a track's own events keep their order).
+   Popping the minimum loads that cursor into the reader's globals, reads
+   one event through readevent() - so the normal callbacks and --where see
+   it - and reads the next delta to re-key the cursor. That's O(n log k)
+   for n events in k tracks, with one event per track decoded at a time. */
+
+static struct mcursor *Mcur;
+static struct mcursor **Mheap;
+static int Mncur, Mnheap;
+static long Meot;
+
+static void mcload(struct mcursor *m) {
+
+  Mp = m->p;
+  Mend = m->end;
+  Mf_toberead = m->left;
+  Mf_currtime = m->time;
+  Mf_trackno = m->track;
+}
+
+static void mcsave(struct mcursor *m) {
+
+  m->p = Mp;
+  m->left = Mf_toberead;
+  m->time = Mf_currtime;
+}
+
+static int mcless(struct mcursor *a, struct mcursor *b) {
+
+  return a->time < b->time || (a->time == b->time && a->track < b->track);
+}
+
+static void mcsiftdown(int i) {
+
+  struct mcursor *m = Mheap[i];
+  int c;
+
+  while ((c = 2*i + 1) < Mnheap) {
+    if (c+1 < Mnheap && mcless(Mheap[c+1], Mheap[c])) c++;
+    if (!mcless(Mheap[c], m)) break;
+    Mheap[i] = Mheap[c];
+    i = c;
+  }
+  Mheap[i] = m;
+}
+
+/* Find the MTrk chunks after the header that readheader() just read,
+   skipping chunks of other types. */
+static void mcfind() {
+
+  unsigned char *p = Mp, *end = Mend;
+  unsigned long len;
+  int size = 0;
+
+  Mncur = 0;
+  while (end - p >= 8) {
+    len = to32bit(p[4], p[5], p[6], p[7]);
+    if (to32bit(p[0], p[1], p[2], p[3]) != MTrk) {
+      p += 8;
+      p += (len < end - p) ? len : end - p;
+      continue;
+    }
+    if (Mncur == size) {
+      size = size ? 2 * size : 16;
+      Mcur = realloc(Mcur, size * sizeof(struct mcursor));
+      if (Mcur == NULL) fatal("Out of memory");
+    }
+    p += 8;
+    if (len > end - p) len = end - p;
+    Mcur[Mncur].p = p;
+    Mcur[Mncur].end = p + len;
+    Mcur[Mncur].left = len;
+    Mcur[Mncur].time = 0;
+    Mcur[Mncur].track = Mncur + 1;
+    Mcur[Mncur].ts.status = 0;
+    Mcur[Mncur].ts.sysexcontinue = 0;
+    Mncur++;
+    p += len;
+  }
+}
+
+/* Merge every track into one time-ordered stream of callbacks. End of
+   track events are swallowed (Meot keeps the latest) for the caller to
+   write once. */
+void mergetracks() {
+
+  struct mcursor *m;
+  int i;
+
+  mcfind();
+  Mheap = malloc((Mncur + 1) * sizeof(struct mcursor *));
+  if (Mheap == NULL) fatal("Out of memory");
+  Mnheap = 0;
+  Meot = -1;
+  for (i = 0; i < Mncur; i++) {
+    mcload(&Mcur[i]);
+    if (Mf_toberead <= 0) continue;
+    Mf_currtime = readvarinum();
+    mcsave(&Mcur[i]);
+    Mheap[Mnheap++] = &Mcur[i];
+  }
+  for (i = Mnheap/2 - 1; i >= 0; i--) mcsiftdown(i);
+  while (Mnheap > 0) {
+    m = Mheap[0];
+    mcload(m);
+    readevent(&m->ts);
+    if (Mf_toberead > 0) {
+      Mf_currtime += readvarinum();
+      mcsave(m);
+    } else {
+      Mheap[0] = Mheap[--Mnheap];
+    }
+    if (Mnheap > 0) mcsiftdown(0);
+  }
+  free(Mheap);
+}
+
+static void mergeeot() {
+
+  if (Mf_currtime > Meot) Meot = Mf_currtime;
+}
+
+/* --concat and --layer.
+
+   Every input is mapped and its header read up front, to pick the common
+   division (the least common multiple of the inputs', or the largest if
+   that won't fit in 15 bits) and, for --concat, the length of each input:
+   the latest end of track, found by a pass over its tracks with no
+   callbacks. mfwrite() then pulls the output tracks through xcombtrack(),
+   which decodes the matching input tracks straight from their mappings,
+   each scaled by xtime() and put through the stages as usual.
+
+   --layer writes every track of every input, in order, as format 1 (or 2
+   when an input is format 2). --concat writes the Nth tracks of the inputs
+   one after another as output track N, each input starting where the
+   longest before it ended, so format 0 inputs give a format 0 file. */
+
+static void xinhdr(int format, int ntrks, int division) {
+
+  Xin[Xnin].format = format;
+  Xin[Xnin].ntrks = ntrks;
+  Xin[Xnin].division = division;
+}
+
+static void xinend() {
+
+  if (Mf_currtime > Xin[Xnin].length) Xin[Xnin].length = Mf_currtime;
+}
+
+static long gcd(long a, long b) {
+
+  long t;
+
+  while (b) { t = a % b; a = b; b = t; }
+  return a;
+}
+
+/* Point the reader at track k of input j; returns 0 if it has no track k. */
+static int xinseek(int j, int k) {
+
+  Mbase = Xin[j].body;
+  Mlen = Xin[j].len - (Xin[j].body - Xin[j].base);
+  Mp = Mbase;
+  Mend = Xin[j].end;
+  mcfind();
+  if (k >= Mncur) return 0;
+  mcload(&Mcur[k]);
+  return 1;
+}
+
+static int xcombtrack(int which) {
+
+  struct trkstate ts;
+  long end = 0;
+  int j, k = which;
+
+  Xwtime = 0;
+  Xeot = -1;
+  for (j = 0; j < Xnin; j++) {
+    if (combine == OPT_LAYER && k >= Xin[j].ntrks) {
+      k -= Xin[j].ntrks;
+      continue;
+    }
+    Xmul = Xin[j].scale;
+    Xdiv = Xin[j].division;
+    Xoffset = end;
+    end += (Xin[j].length * Xmul + Xdiv / 2) / Xdiv;
+    if (xinseek(j, k)) {
+      if (combine == OPT_LAYER && Xmul == Xdiv && xpassthru(Mp, Mf_toberead))
+        break;
+      Mf_trackno = which + 1;
+      ts.status = 0;
+      ts.sysexcontinue = 0;
+      while (Mf_toberead > 0) {
+        Mf_currtime += readvarinum();
+        readevent(&ts);
+      }
+    }
+    if (combine == OPT_LAYER) break;
+  }
+  if (combine == OPT_CONCAT && Xeot >= 0 && Xeot < end) Xeot = end;
+  Xmul = Xdiv = 1;
+  Xoffset = 0;
+  xendtrack(which + 1);
+  return 1;
+}
+
+/* midicomp --concat|--layer [stages] in.mid... out.mid */
+void xcombine(char **in, int nin, char *outfile) {
+
+  static char obuf[XBUFSIZE];
+  long division = 0, d;
+  int format, ntrks = 0, i;
+
+  Xin = calloc(nin, sizeof(struct xinput));
+  if (Xin == NULL) fatal("Out of memory");
+  Mf_error = myerror;
+  Mf_getc = memgetc;
+  Mf_header = xinhdr;
+  Mf_endtrack = xinend;
+  format = (combine == OPT_LAYER) ? 1 : 0;
+  for (Xnin = 0; Xnin < nin; Xnin++) {
+    mapinput(in[Xnin]);
+    Xin[Xnin].base = Mbase;
+    Xin[Xnin].len = Mlen;
+    Xin[Xnin].format = -1;
+    readheader();
+    if (Xin[Xnin].format < 0) mferror("no MThd header");
+    Xin[Xnin].body = Mp;
+    Xin[Xnin].end = Mend;
+    d = Xin[Xnin].division;
+    if (combine == OPT_CONCAT) {
+      if (Xin[Xnin].format == 2)
+        mferror("can't concatenate the independent tracks of format 2");
+      while (readtrack()) ;
+    }
+    if (Xin[Xnin].format > format) format = Xin[Xnin].format;
+    if (combine == OPT_LAYER) ntrks += Xin[Xnin].ntrks;
+    else if (Xin[Xnin].ntrks > ntrks) ntrks = Xin[Xnin].ntrks;
+    if (d <= 0 || (d & 0x8000) || (division & 0x8000)) {
+      if (division && d != division) {
+        fprintf(stderr, "%s: can't combine SMPTE and differing divisions\n",
+                in[Xnin]);
+        exit(1);
+      }
+      division = d;
+    } else if (division == 0) {
+      division = d;
+    } else if (division * (d / gcd(division, d)) <= 0x7fff) {
+      division *= d / gcd(division, d);
+    } else if (d > division) {
+      division = d;
+    }
+  }
+  for (i = 0; i < Xnin; i++) {
+    Xin[i].scale = (Xin[i].division & 0x8000) ? Xin[i].division : division;
+    if (Xin[i].division <= 0) Xin[i].division = Xin[i].scale = 1;
+  }
+  if (ntrks > 0xffff) mferror("too many tracks");
+
+  if (strcmp(outfile, "-") == 0) F = fdopen(fileno(stdout), "wb");
+  else F = efopen(outfile, "wb");
+  setvbuf(F, obuf, _IOFBF, sizeof(obuf));
+  Mf_header = NULLFUNC;
+  Mf_endtrack = NULLFUNC;
+  Mf_on = xnon;
+  Mf_off = xnoff;
+  Mf_pressure = xpressure;
+  Mf_parameter = xparameter;
+  Mf_pitchbend = xpitchbend;
+  Mf_program = xprogram;
+  Mf_chanpressure = xchanpressure;
+  Mf_sysex = xsysex;
+  Mf_arbitrary = xarbitrary;
+  Mf_metaraw = xmeta;
+  Mf_putc = fileputc;
+  Mf_wtrack = xcombtrack;
+  if (compact) xaddstage(xscompact);
+  xtouchinit();
+  xstreaminit();
+  xheader(format, ntrks, (int) division);
+  mfwrite(format, ntrks, (int) division, F);
+  for (i = 0; i < Xnstages; i++)
+    if (Xplug[i] && Xplug[i]->pl->finish) (*Xplug[i]->pl->finish)(Xplug[i]->state);
+  if (compact) compactreport(F);
+  if (fclose(F) == EOF) { fprintf(stderr, "Output file error\n"); exit(1); }
+}
+
+/* --merge with text output: the decode of the equivalent format 0 file. */
+void mergetext(char *infile) {
+
+  mapinput(infile);
+  initfuncs();
+  Mf_getc = memgetc;
+  Mf_header = xheader;
+  Mf_eot = mergeeot;
+  readheader();
+  if (Xformat < 0) mferror("no MThd header");
+  if (Xformat == 2) mferror("can't merge the independent tracks of format 2");
+  myheader(0, 1, Xdivision);
+  mytrstart();
+  mergetracks();
+  if (Meot >= 0) {
+    Mf_currtime = (Meot > old_Mf_currtime) ? Meot : old_Mf_currtime;
+    mymeot();
+  }
+  mytrend();
+}
+
+static int xmergetrack(int which) {
+
+  Xwtime = 0;
+  Xeot = -1;
+  mergetracks();
+  xendtrack(which + 1);
+  return 1;
+}
+
+/* --split-channels: the merged events were sorted into a conductor track
+   (metas and SysEx) and one buffer per channel by xsplitadd(); write them
+   out as format 1, skipping unused channels, with the names held back
+   merged in where they go. Every track ends with the input. */
+static int xsplittrack(int which) {
+
+  struct xbuf *b = &Xsplit[Xsplitmap[which]], *nb = &Xsplitnames;
+  long eot = Xeot;
+  int i, j;
+
+  Xwtime = 0;
+  Xeot = -1;
+  xbuffix(b);
+  xbuffix(nb);
+  for (i = j = 0; ; ) {
+    while (j < nb->n && xsplitdest(&nb->ev[j]) != Xsplitmap[which]) j++;
+    if (j < nb->n && (i == b->n || nb->ev[j].time <= b->ev[i].time))
+      xwrite(&nb->ev[j++]);
+    else if (i < b->n)
+      xwrite(&b->ev[i++]);
+    else
+      break;
+  }
+  if (eot < Xwtime) eot = Xwtime;
+  mf_w_meta_event(eot - Xwtime, end_of_track, NULL, 0L);
+  Xeot = eot;
+  return 1;
+}
+
+/* Report a compile error at the current token. Like every error path of
+   the compile, it returns -1 for the caller to pass up; the track loop then
+   skips the rest of the line, so one pass reports every bad line. */
+int prs_error(char *s) {
+
+  int ln = (eol_seen? lineno-1 : lineno);
+
+  fprintf(stderr, "%d: %s\n", ln, s);
+  if (yyleng > 0 && *yytext != '\n')
+    fprintf(stderr, "*** %*s ***\n", yyleng, yytext);
+  return mc_error(NULL);
+}
+
+/* Recoverable parse/validation error (the compile path). Historically the
+   code called a bare error() that was never defined and silently linked to
+   glibc's error(int,int,const char*,...) — undefined behaviour that left
+   range checks non-aborting, so callers proceeded to write attacker-controlled
+   out-of-range data and reach divide-by-zero / NULL-deref paths. This is the
+   real definition: report and count the error, stopping once --max-errors
+   have been seen, and return -1 so the caller drops the event. */
+int mc_error(char *s) {
+
+  if (s) fprintf(stderr, "%d: %s\n", eol_seen ? lineno-1 : lineno, s);
+  if (++Errors == Maxerrors) {
+    fprintf(stderr, "Stopped after %d errors\n", Errors);
+    exit(1);
+  }
+  return -1;
+}
+
+/* Resync after an error: drop the rest of the line. */
+static void skipline() {
+
+  while (!eol_seen && yylex() != EOF) ;
+}
+
+/* Unrecoverable error (resource exhaustion etc.) — always fatal. */
+void fatal(char *s) {
+
+  fprintf(stderr, "Fatal: %s\n", s);
+  exit(1);
+}
+
+int syntax() {
+
+  return prs_error("Syntax error");
+}
+
+void translate() {
+
+  int err;
+
+  if (yylex() == MTHD) {
+    err = getint("MFile format", &Format) || getint("MFile #tracks", &Ntrks) ||
+          getint("MFile Clicks", &Clicks);
+    if (err) exit(1);
+    if (Clicks < 0) {
+      /* SMPTE division: negative frames/sec (high byte, -128..-1) and
+         ticks/frame (low byte, 0..255). Validate both operands BEFORE the
+         bitwise OR so a malformed resolution can't slip a bogus value
+         through; the reconstructed 16-bit value is 0x8000..0xffff. */
+      int res = 0;
+      if (Clicks < -128) {
+        error("MFile SMPTE frames/sec out of range");
+        exit(1);
+      }
+      if (getint("MFile SMPTE division", &res)) exit(1);
+      if (res < 0 || res > 255) {
+        error("MFile SMPTE ticks/frame out of range (0..255)");
+        exit(1);
+      }
+      Clicks = ((Clicks & 0xff) << 8) | res;
+    } else if (Clicks > 32767) {
+      error("MFile division out of range (0..32767)");
+      exit(1);
+    }
+    /* Clicks is now a 16-bit value (0..65535); this keeps the later
+       4 * Clicks / denom (TimeSig) computation from overflowing int. */
+    if (isword(yylex(), "terse")) {
+      terse = 1;
+      incs = 1;
+    } else if (!eol_seen) {
+      prs_error("Garbage deleted");
+      skipline();
+    }
+    checkeol();
+    mfwrite(Format, Ntrks, Clicks, F);
+  } else {
+    fprintf (stderr, "Missing MFile - can't continue\n");
+    exit(1);
+  }
+}
+
+/* Read one time value component into *t, bounded to the 28-bit SMF range
+   before it feeds the measure/beat multiplications, so a hostile but
+   parseable long can't signed-overflow newtime (undefined behaviour). */
+static int gettime(long *t) {
+
+  if (yylex() != INT) return prs_error("Illegal time value");
+  if (yyval < 0 || yyval > 0x0fffffffL) return prs_error("Time value out of range");
+  *t = yyval;
+  return 0;
+}
+
+/* The compiler's events go out through cwrite(), which writes them at
+   once, or with --sort holds them in Sbuf to be sorted by time at the end
+   of the track. Cwtime is the time of the last event written. */
+
+static long Cwtime;
+static int Prec = -1;           /* the Pattern being compiled, if any */
+static struct pattern *Pat;
+static int Npat, Patsize;
+static struct xbuf Sbuf;
+static struct srun *Srun;
+static int Snrun, Srunsize;
+static int *Sidx, *Stmp, Sidxsize;
+
+static void cemit(struct mfevent *e) {
+
+  unsigned char d[2];
+  unsigned long delta = e->time - Cwtime;
+
+  switch (e->status) {
+   case system_exclusive:
+    mf_w_sysex_event(delta, e->msg, e->leng);
+    break;
+   case 0xf7:
+    mf_w_arb_event(delta, e->msg, e->leng);
+    break;
+   case meta_event:
+    mf_w_meta_event(delta, e->c1, e->msg, e->leng);
+    break;
+   default:
+    d[0] = e->c1;
+    d[1] = e->c2;
+    mf_w_midi_event(delta, e->status & 0xf0, e->status & 0xf, d,
+                    (e->status & 0xe0) == 0xc0 ? 1L : 2L);
+  }
+  Cwtime = e->time;
+}
+
+/* Stable sort Sbuf's events by time into Sidx: a radix sort, a byte of the
+   time at a time, skipping the bytes every event has the same. */
+static void sortidx() {
+
+  struct xbuf *b = &Sbuf;
+  long count[256];
+  int i, shift, *t;
+
+  if (b->n > Sidxsize) {
+    Sidxsize = b->n;
+    Sidx = realloc(Sidx, Sidxsize * sizeof(int));
+    Stmp = realloc(Stmp, Sidxsize * sizeof(int));
+    if (Sidx == NULL || Stmp == NULL) fatal("Out of memory");
+  }
+  for (i = 0; i < b->n; i++) Sidx[i] = i;
+  for (shift = 0; shift < 32; shift += 8) {
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < b->n; i++) count[(b->ev[i].time >> shift) & 0xff]++;
+    if (b->n == 0 || count[(b->ev[0].time >> shift) & 0xff] == b->n) continue;
+    for (i = 1; i < 256; i++) count[i] += count[i-1];
+    for (i = b->n - 1; i >= 0; i--)
+      Stmp[--count[(b->ev[Sidx[i]].time >> shift) & 0xff]] = Sidx[i];
+    t = Sidx; Sidx = Stmp; Stmp = t;
+  }
+  xbuffix(b);
+}
+
+/* Sbuf is full: sort it and write it to a temporary file as a run. */
+static void sortspill() {
+
+  struct srun *r;
+  struct mfevent *e;
+  int i;
+
+  if (Snrun == Srunsize) {
+    Srunsize = Srunsize ? 2 * Srunsize : 16;
+    Srun = realloc(Srun, Srunsize * sizeof(struct srun));
+    if (Srun == NULL) fatal("Out of memory");
+  }
+  r = &Srun[Snrun++];
+  if ((r->fp = tmpfile()) == NULL) fatal("can't make a --sort temporary file");
+  r->left = Sbuf.n;
+  r->data = NULL;
+  r->dsize = 0;
+  sortidx();
+  for (i = 0; i < Sbuf.n; i++) {
+    e = &Sbuf.ev[Sidx[i]];
+    if (fwrite(e, sizeof(struct mfevent), 1, r->fp) != 1 ||
+        (e->leng > 0 && fwrite(e->msg, 1, e->leng, r->fp) != e->leng))
+      fatal("can't write a --sort temporary file");
+  }
+  rewind(r->fp);
+  xbufclear(&Sbuf);
+}
+
+/* A Pattern's events are all compiled; --where sees them as a Play writes
+   them, with the tick and the track they are written at. */
+#define CWHERE(st,c1,c2,trk,t) (Prec >= 0 || WHERE(st,c1,c2,trk,t))
+
+static void cwrite(struct mfevent *e) {
+
+  if (Prec >= 0) {
+    xbufadd(&Pat[Prec].ev, e);
+    return;
+  }
+  if (!sortrun) {
+    cemit(e);
+    return;
+  }
+  if (Sbuf.n >= sortrun) sortspill();
+  xbufadd(&Sbuf, e);
+}
+
+static void cmidi(long time, int status, unsigned char *data) {
+
+  struct mfevent e;
+
+  e.time = time;
+  e.status = status;
+  e.c1 = data[0];
+  e.c2 = data[1];
+  e.leng = 0;
+  e.msg = NULL;
+  cwrite(&e);
+}
+
+static void cdata(long time, int status, int type, unsigned char *msg, long leng) {
+
+  struct mfevent e;
+
+  e.time = time;
+  e.status = status;
+  e.c1 = type;
+  e.c2 = 0;
+  e.leng = leng;
+  e.msg = msg;
+  cwrite(&e);
+}
+
+/* Read the next event of run r; returns 0 at its end. */
+static int sortread(struct srun *r) {
+
+  if (r->left == 0) return 0;
+  r->left--;
+  if (fread(&r->ev, sizeof(struct mfevent), 1, r->fp) != 1)
+    fatal("can't read a --sort temporary file");
+  if (r->ev.leng > r->dsize) {
+    r->dsize = r->ev.leng;
+    if ((r->data = realloc(r->data, r->dsize)) == NULL) fatal("Out of memory");
+  }
+  if (r->ev.leng > 0 && fread(r->data, 1, r->ev.leng, r->fp) != r->ev.leng)
+    fatal("can't read a --sort temporary file");
+  r->ev.msg = r->data;
+  return 1;
+}
+
+/* Earlier runs hold earlier lines, so they win ties to keep the sort stable. */
+static int sortless(int a, int b) {
+
+  return Srun[a].ev.time < Srun[b].ev.time ||
+         (Srun[a].ev.time == Srun[b].ev.time && a < b);
+}
+
+static void sortsiftdown(int *heap, int n, int i) {
+
+  int r = heap[i], c;
+
+  while ((c = 2*i + 1) < n) {
+    if (c+1 < n && sortless(heap[c+1], heap[c])) c++;
+    if (!sortless(heap[c], r)) break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = r;
+}
+
+/* End of track: write out what --sort holds, in time order. A track that
+   outgrew one run is merged from its runs on disk. */
+static void sortflush() {
+
+  int i, n, *heap;
+
+  if (Snrun == 0) {
+    sortidx();
+    for (i = 0; i < Sbuf.n; i++) cemit(&Sbuf.ev[Sidx[i]]);
+    xbufclear(&Sbuf);
+    return;
+  }
+  if (Sbuf.n > 0) sortspill();
+  heap = malloc(Snrun * sizeof(int));
+  if (heap == NULL) fatal("Out of memory");
+  for (i = n = 0; i < Snrun; i++)
+    if (sortread(&Srun[i])) heap[n++] = i;
+  for (i = n/2 - 1; i >= 0; i--) sortsiftdown(heap, n, i);
+  while (n > 0) {
+    cemit(&Srun[heap[0]].ev);
+    if (!sortread(&Srun[heap[0]])) heap[0] = heap[--n];
+    if (n > 0) sortsiftdown(heap, n, 0);
+  }
+  free(heap);
+  for (i = 0; i < Snrun; i++) {
+    fclose(Srun[i].fp);
+    free(Srun[i].data);
+  }
+  Snrun = 0;
+}
+
+/* -c --packed: the record read ahead (Pkhave is 0 at the end), its payload
+   in Pkdata. A stream that isn't well formed stops the compile. */
+static struct mfevent Pkev;
+static unsigned char *Pkdata;
+static long Pkdsize, Pknrec;
+static int Pkhave;
+
+static void pkerror(char *s) {
+
+  fprintf(stderr, "%s %ld: %s\n", json ? "json line" : "packed record", Pknrec, s);
+  exit(1);
+}
+
+static void pkroom(long n) {
+
+  if (n > Pkdsize) {
+    while (n > Pkdsize) Pkdsize = Pkdsize ? 2 * Pkdsize : XBUFSIZE;
+    if ((Pkdata = realloc(Pkdata, Pkdsize)) == NULL) fatal("Out of memory");
+  }
+}
+
+static int pkread() {
+
+  unsigned char r[PK_RECLEN];
+  size_t n;
+
+  if ((n = fread(r, 1, PK_RECLEN, yyin)) == 0 && !ferror(yyin)) return 0;
+  Pknrec++;
+  if (n != PK_RECLEN) pkerror("cut short");
+  Pkev.time = pkget(r, 4);
+  Pkev.track = pkget(r + 4, 2);
+  Pkev.status = r[6];
+  Pkev.c1 = r[7];
+  Pkev.c2 = r[8];
+  Pkev.leng = pkget(r + 9, 4);
+  if (Llimits) {
+    limitevent();
+    limitpayload(Pkev.leng);
+  }
+  if (Pkev.time > 0x0fffffffL) pkerror("time out of range");
+  switch (Pkev.status) {
+   case 0:
+   case system_exclusive:
+   case 0xf7:
+   case meta_event:
+    break;
+   default:
+    if (Pkev.status < note_off || Pkev.status >= system_exclusive)
+      pkerror("bad status");
+    if (Pkev.c1 > 127 || Pkev.c2 > 127) pkerror("data byte out of range");
+  }
+  if (Pkev.leng > 0 && (Pkev.status < system_exclusive || Pkev.leng > 0x0fffffffL))
+    pkerror("bad payload length");
+  pkroom(Pkev.leng);
+  if (Pkev.leng > 0 && fread(Pkdata, 1, Pkev.leng, yyin) != Pkev.leng)
+    pkerror("payload cut short");
+  if (Pkev.status == system_exclusive && (Pkev.leng < 1 || Pkdata[0] != 0xf0))
+    pkerror("SysEx payload doesn't start with F0");
+  Pkev.msg = Pkdata;
+  return 1;
+}
+
+/* -c --json: each object's members go to Jsval[] (numbers, by Jskey[]),
+   Jstype and, from "data" or "text", Pkdata; members with other names are
+   skipped. Pknrec is the line the object starts on. */
+static long Jsval[JS_NKEY];
+static int Jshave;                  /* a bit per Jskey[] given */
+static char Jstype[8];
+static unsigned char *Jsbuf;        /* the last string read */
+static int Jswide;                  /* set if it had a character > \u00ff */
+static long Jsbsize, Jsline = 1;
+static unsigned char Jsin[XBUFSIZE];
+static int Jsinp, Jsinn;
+
+static int jsgetc() {
+
+  int c;
+
+  if (Jsinp == Jsinn) {
+    Jsinp = 0;
+    if ((Jsinn = fread(Jsin, 1, sizeof(Jsin), yyin)) == 0) return EOF;
+  }
+  if ((c = Jsin[Jsinp++]) == '\n') Jsline++;
+  return c;
+}
+
+/* Put back the character jsgetc() just returned. */
+static void jsungetc(int c) {
+
+  if (c == EOF) return;
+  Jsinp--;
+  if (c == '\n') Jsline--;
+}
+
+static int jsskip() {
+
+  int c;
+
+  while ((c = jsgetc()) == ' ' || c == '\t' || c == '\r' || c == '\n') ;
+  return c;
+}
+
+static void jsbufadd(long n, int c) {
+
+  if (n >= Jsbsize) {
+    Jsbsize = Jsbsize ? 2 * Jsbsize : 256;
+    if ((Jsbuf = realloc(Jsbuf, Jsbsize)) == NULL) fatal("Out of memory");
+  }
+  Jsbuf[n] = c;
+}
+
+static long jshex4() {
+
+  long u = 0;
+  int i, c;
+
+  for (i = 0; i < 4; i++) {
+    c = jsgetc();
+    if (!isxdigit(c)) pkerror("bad \\u escape");
+    u = 16 * u + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+  }
+  return u;
+}
+
+/* A string, its opening quote read, into Jsbuf; returns its length. The
+   characters are taken as Latin-1, each the byte of its code point,
+   whether it was escaped or put in UTF-8; one above \u00ff is put as a
+   ? and sets Jswide. */
+static long jsstr() {
+
+  static long least[] = {0, 0x80, 0x800, 0x10000};
+  long n = 0, u;
+  int c, k, len;
+
+  Jswide = 0;
+  while ((c = jsgetc()) != '"') {
+    if (c == EOF) pkerror("string cut short");
+    if (c < 0x20) pkerror("control character in a string");
+    if (c == '\\') {
+      switch (c = jsgetc()) {
+       case 'b': u = '\b'; break;
+       case 'f': u = '\f'; break;
+       case 'n': u = '\n'; break;
+       case 'r': u = '\r'; break;
+       case 't': u = '\t'; break;
+       case '"': case '\\': case '/': u = c; break;
+       case 'u':
+        u = jshex4();
+        if (u >= 0xd800 && u < 0xdc00) {
+          if (jsgetc() != '\\' || jsgetc() != 'u') pkerror("bad \\u escape");
+          c = jshex4();
+          if (c < 0xdc00 || c >= 0xe000) pkerror("bad \\u escape");
+          u = 0x10000 + ((u - 0xd800) << 10) + (c - 0xdc00);
+        }
+        break;
+       default:
+        pkerror("bad escape in a string");
+      }
+    } else if (c >= 0x80) {
+      k = c >= 0xf8 ? -1 : c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : -1;
+      if (k < 0) pkerror("bad UTF-8 in a string");
+      for (u = c & (0x3f >> k), len = k; k > 0; k--) {
+        if (((c = jsgetc()) & 0xc0) != 0x80) pkerror("bad UTF-8 in a string");
+        u = u << 6 | (c & 0x3f);
+      }
+      if (u < least[len] || (u >= 0xd800 && u < 0xe000) || u > 0x10ffff)
+        pkerror("bad UTF-8 in a string");
+    } else
+      u = c;
+    if (u > 0xff) {
+      Jswide = 1;
+      u = '?';
+    }
+    jsbufadd(n++, u);
+  }
+  return n;
+}
+
+/* A member's value; returns its first character's class: '"' for a
+   string (in Jsbuf, length in *n), '0' for a number (in *n), 't' for
+   true, false or null and '{' for an object or array, which is skipped. */
+static int jsvalue(long *n) {
+
+  int c = jsskip(), neg = 0, digits = 0, depth;
+
+  if (c == '"') {
+    *n = jsstr();
+    return '"';
+  }
+  if (c == '{' || c == '[') {
+    for (depth = 1; depth > 0; )
+      switch (jsgetc()) {
+       case '{': case '[': depth++; break;
+       case '}': case ']': depth--; break;
+       case '"': jsstr(); break;
+       case EOF: pkerror("object cut short");
+      }
+    return '{';
+  }
+  if (c == '-') {
+    neg = 1;
+    c = jsgetc();
+  }
+  if (isdigit(c)) {
+    for (*n = 0; isdigit(c); c = jsgetc())
+      if (++digits > 10) pkerror("number out of range");
+      else *n = 10 * *n + c - '0';
+    if (c == '.' || c == 'e' || c == 'E') pkerror("numbers must be whole");
+    if (neg) *n = -*n;
+    jsungetc(c);
+    return '0';
+  }
+  if (!neg && islower(c)) {
+    while (islower(c)) c = jsgetc();
+    jsungetc(c);
+    return 't';
+  }
+  pkerror("bad value");
+  return 0;
+}
+
+static void jspayload(long n, int hex) {
+
+  long i;
+  int d[2], j;
+
+  if (Llimits) limitpayload(hex ? n / 2 : n);
+  if (!hex) {
+    pkroom(n);
+    memcpy(Pkdata, Jsbuf, n);
+    Pkev.leng = n;
+    return;
+  }
+  if (n % 2) pkerror("odd number of hex digits in \"data\"");
+  pkroom(n / 2);
+  for (i = 0; i < n; i += 2) {
+    for (j = 0; j < 2; j++) {
+      d[j] = Jsbuf[i+j];
+      if (!isxdigit(d[j])) pkerror("\"data\" isn't hex");
+      d[j] = isdigit(d[j]) ? d[j] - '0' : tolower(d[j]) - 'a' + 10;
+    }
+    Pkdata[i/2] = 16 * d[0] + d[1];
+  }
+  Pkev.leng = n / 2;
+}
+
+/* Read an object; returns 0 at the end of the stream. */
+static int jsobject() {
+
+  char key[16];
+  long n = 0, kn;
+  int c, k, v, payload = 0;
+
+  if ((c = jsskip()) == EOF) return 0;
+  Pknrec = Jsline;
+  if (c != '{') pkerror("expected an object");
+  Jshave = 0;
+  Jstype[0] = '\0';
+  Pkev.leng = 0;
+  if ((c = jsskip()) == '}') return 1;
+  for (;;) {
+    if (c != '"') pkerror("expected a member name");
+    kn = jsstr();
+    if (kn >= sizeof(key)) kn = sizeof(key) - 1;
+    memcpy(key, Jsbuf, kn);
+    key[kn] = '\0';
+    if (jsskip() != ':') pkerror("expected ':'");
+    v = jsvalue(&n);
+    for (k = 0; k < JS_NKEY && strcmp(key, Jskey[k]) != 0; k++) ;
+    if (k < JS_NKEY) {
+      if (v != '0') pkerror("expected a number");
+      Jsval[k] = n;
+      Jshave |= 1 << k;
+    } else if (strcmp(key, "type") == 0) {
+      if (v != '"' || n >= sizeof(Jstype)) pkerror("bad \"type\"");
+      memcpy(Jstype, Jsbuf, n);
+      Jstype[n] = '\0';
+    } else if (strcmp(key, "data") == 0 || strcmp(key, "text") == 0) {
+      if (v != '"') pkerror("expected a string");
+      if (payload++) pkerror("both \"data\" and \"text\"");
+      if (Jswide) pkerror("a character above \\u00ff in a string");
+      jspayload(n, key[0] == 'd');
+    }
+    if ((c = jsskip()) == '}') return 1;
+    if (c != ',') pkerror("expected ',' or '}'");
+    c = jsskip();
+  }
+}
+
+static long jsfield(int k, long lo, long hi) {
+
+  char mess[80];
+
+  if (!(Jshave & 1 << k)) {
+    sprintf(mess, "no \"%s\"", Jskey[k]);
+    pkerror(mess);
+  }
+  if (Jsval[k] < lo || Jsval[k] > hi) {
+    sprintf(mess, "\"%s\" out of range", Jskey[k]);
+    pkerror(mess);
+  }
+  return Jsval[k];
+}
+
+/* The next object as a record, the same as pkread() makes them. */
+static int jsread() {
+
+  int i;
+
+  if (!jsobject()) return 0;
+  if (Llimits) limitevent();
+  Pkev.msg = Pkdata;
+  Pkev.c1 = Pkev.c2 = 0;
+  Pkev.track = jsfield(1, 1, 0xffff);
+  if (strcmp(Jstype, "MTrk") == 0) {
+    Pkev.status = Pkev.time = 0;
+    return 1;
+  }
+  Pkev.time = jsfield(0, 0, 0x0fffffffL);
+  for (i = 0; i < 7 && strcmp(Jstype, Jschan[i].name) != 0; i++) ;
+  if (i < 7) {
+    Pkev.status = (i + 8) << 4 | (jsfield(2, 1, 16) - 1);
+    if (Pkev.leng > 0) pkerror("a channel event has no payload");
+    if (Pkev.status >= pitch_wheel) {
+      Pkev.c1 = jsfield(4, 0, 16383) % 128;
+      Pkev.c2 = Jsval[4] / 128;
+    } else {
+      Pkev.c1 = jsfield(Jschan[i].k1, 0, 127);
+      if (Jschan[i].k2 >= 0) Pkev.c2 = jsfield(Jschan[i].k2, 0, 127);
+    }
+  } else if (strcmp(Jstype, "SysEx") == 0) {
+    Pkev.status = system_exclusive;
+    if (Pkev.leng < 1 || Pkdata[0] != 0xf0)
+      pkerror("SysEx payload doesn't start with F0");
+  } else if (strcmp(Jstype, "Arb") == 0) Pkev.status = 0xf7;
+  else if (strcmp(Jstype, "Meta") == 0) {
+    Pkev.status = meta_event;
+    Pkev.c1 = jsfield(7, 0, 255);
+  } else pkerror(Jstype[0] ? "unknown \"type\"" : "no \"type\"");
+  return 1;
+}
+
+static int pknext() {
+
+  return json ? jsread() : pkread();
+}
+
+/* A track's records, up to the next start of track. End of track is held
+   back under --compact and --sort as in mywritetrack(). */
+static int pkwritetrack(int which) {
+
+  long eot = -1;
+
+  if (!Pkhave || Pkev.status != 0 || Pkev.track != which + 1)
+    pkerror("expected the start of the next track");
+  Cwtime = 0;
+  while ((Pkhave = pknext()) && Pkev.status != 0) {
+    if (Pkev.track != which + 1) pkerror("record outside its track");
+    if (Pkev.time < Cwtime && !sortrun) pkerror("time out of order, try --sort");
+    if (!WHERE(Pkev.status, Pkev.c1, Pkev.c2, which+1, Pkev.time)) continue;
+    if ((compact || sortrun) &&
+        Pkev.status == meta_event && Pkev.c1 == end_of_track) {
+      if (Pkev.time > eot) eot = Pkev.time;
+      continue;
+    }
+    cwrite(&Pkev);
+  }
+  if (sortrun) sortflush();
+  if (eot >= 0)
+    mf_w_meta_event(eot < Cwtime ? 0 : eot - Cwtime, end_of_track, buffer, 0L);
+  return 1;
+}
+
+void pktranslate() {
+
+  unsigned char h[PK_HDRLEN];
+  char mess[80];
+  int version, format, ntrks, division;
+
+  if (json) {
+    if (!jsobject() || strcmp(Jstype, "MThd") != 0)
+      pkerror("not a --json stream");
+    version = jsfield(11, 0, 0xffff);
+    format = jsfield(8, 0, 0xffff);
+    ntrks = jsfield(9, 0, 0xffff);
+    division = jsfield(10, 0, 0xffff);
+  } else {
+    if (fread(h, 1, PK_HDRLEN, yyin) != PK_HDRLEN || memcmp(h, "MCPK", 4) != 0)
+      pkerror("not a --packed stream");
+    version = h[4];
+    format = pkget(h + 5, 2);
+    ntrks = pkget(h + 7, 2);
+    division = pkget(h + 9, 2);
+  }
+  if (version != (json ? JS_VERSION : PK_VERSION)) {
+    sprintf(mess, "version %d, this midicomp reads %d", version,
+            json ? JS_VERSION : PK_VERSION);
+    pkerror(mess);
+  }
+  Pkhave = pknext();
+  Mf_wtrack = pkwritetrack;
+  mfwrite(format, ntrks, division, F);
+  if (Pkhave) pkerror("more tracks than the header gives");
+}
+
+/* Note, Ramp and Play lines: the Off of each compiled Note, the next point
+   of each Ramp and the next event of each Play waits in Nq, a min-heap on
+   time (seq keeps events due at the same time in the order they were
+   queued), and is written once the events before it are. A Play keeps its
+   seq from one event to the next, so at a tie a repetition goes before
+   the ones after it. */
+
+static struct qevent *Nq;
+static int Nnq, Nqsize;
+static long Nseq;
+
+static int nqless(struct qevent *a, struct qevent *b) {
+
+  return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void nqpush(struct qevent *q) {
+
+  int i, p;
+
+  if (Nnq == Nqsize) {
+    Nqsize = Nqsize ? 2 * Nqsize : 64;
+    Nq = realloc(Nq, Nqsize * sizeof(struct qevent));
+    if (Nq == NULL) fatal("Out of memory");
+  }
+  for (i = Nnq++; i > 0 && nqless(q, &Nq[p = (i-1)/2]); i = p) Nq[i] = Nq[p];
+  Nq[i] = *q;
+}
+
+static void nqpop() {
+
+  struct qevent n = Nq[--Nnq];
+  int i = 0, c;
+
+  while ((c = 2*i + 1) < Nnq) {
+    if (c+1 < Nnq && nqless(&Nq[c+1], &Nq[c])) c++;
+    if (!nqless(&Nq[c], &n)) break;
+    Nq[i] = Nq[c];
+    i = c;
+  }
+  Nq[i] = n;
+}
+
+/* Queue an Off, or a Ramp's points after its first. */
+static void nqadd(long time, int status, int chan, int c1, long v,
+                  long dt, long dv, long left) {
+
+  struct qevent q;
+
+  q.time = time;
+  q.status = status;
+  q.chan = chan;
+  q.c1 = c1;
+  q.v = v;
+  q.dt = dt;
+  q.dv = dv;
+  q.left = left;
+  q.seq = Nseq++;
+  nqpush(&q);
+}
+
+/* Write the events queued by time upto (all of them if upto < 0). */
+static void qwrite(long upto, int which) {
+
+  struct qevent q;
+  struct xbuf *p;
+  struct mfevent e;
+  unsigned char d[2];
+  int st;
+
+  while (Nnq > 0 && (upto < 0 || Nq[0].time <= upto)) {
+    q = Nq[0];
+    nqpop();
+    /* a Ramp's points and a Play's events count as events */
+    if (Llimits && q.dt) limitevent();
+    if (q.status == 0) {
+      p = &Pat[q.c1].ev;
+      if (q.v == 0 && q.left > 0)
+        nqadd(q.dv + q.dt + p->ev[0].time, 0, 0, q.c1, 0, q.dt, q.dv + q.dt,
+              q.left - 1);
+      e = p->ev[q.v];
+      e.time = q.time;
+      st = e.status;
+      if (st == system_exclusive && e.leng > 0) st = e.msg[0];
+      if (CWHERE(st, e.c1, (st & 0xe0) == 0xc0 ? 0 : e.c2, which+1, e.time))
+        cwrite(&e);
+      if (++q.v < p->n) {
+        q.time = q.dv + p->ev[q.v].time;
+        nqpush(&q);
+      }
+      continue;
+    }
+    if (q.status == pitch_wheel) {
+      d[0] = q.v % 128;
+      d[1] = q.v / 128;
+    } else {
+      d[0] = q.c1;
+      d[1] = q.v;
+    }
+    if (CWHERE(q.status|q.chan, d[0], d[1], which+1, q.time))
+      cmidi(q.time, q.status|q.chan, d);
+    if (--q.left > 0) {
+      q.time += q.dt;
+      q.v += q.dv;
+      q.seq = Nseq++;
+      nqpush(&q);
+    }
+  }
+}
+
+/* Read =value after name, the value in lo..hi. The lexer doesn't know
+   these names, so the name and the = come as ERR tokens. */
+static int getfield(char *name, long lo, long hi, long *v) {
+
+  char ermesg[100];
+
+  if (yylex() != ERR || *yytext != '=' || yylex() != INT) return syntax();
+  if (yyval < lo || yyval > hi) {
+    sprintf(ermesg, "%s must be between %ld and %ld", name, lo, hi);
+    return error(ermesg);
+  }
+  *v = yyval;
+  return 0;
+}
+
+static int isword(int c, char *name) {
+
+  return c == ERR && strcasecmp(yytext, name) == 0;
+}
+
+/* Note ch= n= v= dur= [off=]: an On now and its Off dur ticks later, an
+   Off with velocity off= or else an On v=0. */
+static int getnote(long *dur, int *offst, int *offv) {
+
+  long v;
+  int c;
+
+  if (checkchan() || checknote() || checkval()) return -1;
+  if (!isword(yylex(), "dur")) return syntax();
+  if (getfield("dur", 0, 0x0fffffffL, dur)) return -1;
+  *offst = ON;
+  *offv = 0;
+  if ((c = yylex()) == EOL) return 0;
+  if (c != OFF) return syntax();        /* off= lexes as Off */
+  if (getfield("off", 0, 127, &v)) return -1;
+  *offst = OFF;
+  *offv = v;
+  return 0;
+}
+
+static int inrange(long v, long lo, long hi, char *mess) {
+
+  return (v < lo || v > hi) ? error(mess) : 0;
+}
+
+/* The terse dialect's channel events: the values alone, in the order of
+   the keywords they stand for, led by the channel when it changes. A Note
+   (opcode ERR) has n v dur, and may end with off=. */
+static int terseargs(int opcode, long *dur, int *offst, int *offv) {
+
+  long v[5], *p = v;
+  int n = 0, na, c;
+
+  while ((c = yylex()) == INT || c == NOTEVAL) {
+    if (c == NOTEVAL) noteval();
+    if (n < 5) v[n] = yyval;
+    n++;
+  }
+  switch (opcode) {
+   case PB:
+   case PRCH:
+   case CHPR: na = 1; break;
+   case ERR: na = 3; break;
+   default: na = 2;
+  }
+  if (n == na + 1) {
+    if (inrange(*p++, 1, 16, "Chan must be between 1 and 16")) return -1;
+    Tchan = v[0] - 1;
+  } else if (n != na) {
+    return syntax();
+  } else if (Tchan < 0) {
+    return error("No channel yet");
+  }
+  chan = Tchan;
+  switch (opcode) {
+   case PB:
+    if (inrange(p[0], 0, 16383, "Value must be between 0 and 16383")) return -1;
+    data[0] = p[0] % 128;
+    data[1] = p[0] / 128;
+    break;
+   case PRCH:
+    if (inrange(p[0], 0, 127, "Program number must be between 0 and 127"))
+      return -1;
+    data[0] = p[0];
+    break;
+   case CHPR:
+    if (inrange(p[0], 0, 127, "Value must be between 0 and 127")) return -1;
+    data[0] = data[1] = p[0];
+    break;
+   default:
+    if (inrange(p[0], 0, 127, opcode == PAR ?
+                "Controller must be between 0 and 127" :
+                "Note must be between 0 and 127") ||
+        inrange(p[1], 0, 127, "Value must be between 0 and 127"))
+      return -1;
+    data[0] = p[0];
+    data[1] = p[1];
+  }
+  if (opcode != ERR) return (c == EOL) ? 0 : syntax();
+  if (inrange(p[2], 0, 0x0fffffffL, "dur must be between 0 and 268435455"))
+    return -1;
+  *dur = p[2];
+  *offst = ON;
+  *offv = 0;
+  if (c == EOL) return 0;
+  if (c != OFF) return syntax();
+  if (getfield("off", 0, 127, &v[0])) return -1;
+  *offst = OFF;
+  *offv = v[0];
+  return 0;
+}
+
+/* Ramp Par ch= c= v= dv= dt= count=, or Ramp Pb ch= v= dv= dt= count=
+   (terse: Ramp Par [ch] c v dv dt count, Ramp Pb [ch] v dv dt count):
+   count events dt ticks apart, the value stepping by dv. Leaves the
+   first point in data and its value in *v. */
+static int getramp(int *opcode, long evtime, long *v, long *dv, long *dt,
+                   long *count) {
+
+  long p[6], hi;
+  int n = 0, na, c;
+
+  if ((*opcode = yylex()) != PAR && *opcode != PB) return syntax();
+  hi = (*opcode == PB) ? 16383 : 127;
+  if (terse) {
+    while ((c = yylex()) == INT) {
+      if (n < 6) p[n] = yyval;
+      n++;
+    }
+    if (c != EOL) return syntax();
+    na = (*opcode == PB) ? 4 : 5;
+    if (n == na + 1) {
+      if (inrange(p[0], 1, 16, "Chan must be between 1 and 16")) return -1;
+      Tchan = p[0] - 1;
+    } else if (n != na) {
+      return syntax();
+    } else if (Tchan < 0) {
+      return error("No channel yet");
+    }
+    chan = Tchan;
+    n -= na;
+    if (*opcode == PAR) {
+      if (inrange(p[n], 0, 127, "Controller must be between 0 and 127"))
+        return -1;
+      data[0] = p[n++];
+    }
+    if (inrange(p[n], 0, hi, *opcode == PB ? "Value must be between 0 and 16383"
+                : "Value must be between 0 and 127")) return -1;
+    *v = p[n++];
+    *dv = p[n++];
+    *dt = p[n++];
+    *count = p[n];
+    if (inrange(*dv, -hi, hi, *opcode == PB ? "dv must be between -16383 and 16383"
+                : "dv must be between -127 and 127") ||
+        inrange(*dt, 1, 0x0fffffffL, "dt must be between 1 and 268435455") ||
+        inrange(*count, 1, 0x0fffffffL, "count must be between 1 and 268435455"))
+      return -1;
+  } else {
+    if (checkchan()) return -1;
+    if (*opcode == PAR ? checkcon() || checkval() : splitval()) return -1;
+    *v = (*opcode == PB) ? data[0] + 128 * data[1] : data[1];
+    if (!isword(yylex(), "dv")) return syntax();
+    if (getfield("dv", -hi, hi, dv)) return -1;
+    if (!isword(yylex(), "dt")) return syntax();
+    if (getfield("dt", 1, 0x0fffffffL, dt)) return -1;
+    if (!isword(yylex(), "count")) return syntax();
+    if (getfield("count", 1, 0x0fffffffL, count)) return -1;
+  }
+  if (*v + (*count - 1) * *dv < 0 || *v + (*count - 1) * *dv > hi)
+    return error("Ramp runs out of range");
+  if (*count - 1 > (0x0fffffffL - evtime) / *dt)
+    return error("Ramp runs past the largest time");
+  if (*opcode == PB) {
+    data[0] = *v % 128;
+    data[1] = *v / 128;
+  } else {
+    data[1] = *v;
+  }
+  return 0;
+}
+
+/* Pattern name [len=L] ... EndPattern: the lines between are compiled
+   into Pat[] instead of the track, their times from the Pattern's start,
+   and the track carries on afterwards from where it was. Without len= a
+   repetition lasts the time of its last event rounded up to whole bars. */
+static long Pcurrtime, Pcwtime, PT0;
+static int PM0, PBeat, PMeasure;
+static struct qevent *PNq;
+static int PNnq, PNqsize;
+
+static int patfind(char *name) {
+
+  int i;
+
+  for (i = 0; i < Npat; i++)
+    if (strcasecmp(Pat[i].name, name) == 0) return i;
+  return -1;
+}
+
+static int patbegin(long *currtime) {
+
+  struct pattern *p;
+  long len = 0;
+  int c;
+
+  if (Prec >= 0) return error("Pattern inside a Pattern");
+  if (yylex() != ERR || !isalpha((unsigned char) *yytext)) return syntax();
+  if (patfind(yytext) >= 0) return error("Pattern defined twice");
+  if (Npat == Patsize) {
+    Patsize = Patsize ? 2 * Patsize : 16;
+    Pat = realloc(Pat, Patsize * sizeof(struct pattern));
+    if (Pat == NULL) fatal("Out of memory");
+  }
+  p = &Pat[Npat];
+  memset(p, 0, sizeof(struct pattern));
+  if ((p->name = strdup(yytext)) == NULL) fatal("Out of memory");
+  if ((c = yylex()) != EOL &&
+      (isword(c, "len") ? getfield("len", 1, 0x0fffffffL, &len) : syntax())) {
+    free(p->name);
+    return -1;
+  }
+  p->len = len;
+  Prec = Npat++;
+  Pcurrtime = *currtime;
+  Pcwtime = Cwtime;
+  PT0 = T0;
+  PM0 = M0;
+  PBeat = Beat;
+  PMeasure = Measure;
+  PNq = Nq;
+  PNnq = Nnq;
+  PNqsize = Nqsize;
+  Nq = NULL;
+  Nnq = Nqsize = 0;
+  *currtime = Cwtime = T0 = M0 = 0;
+  return 0;
+}
+
+static int patend(long *currtime, int which) {
+
+  struct pattern *p;
+  long bar, last;
+
+  if (Prec < 0) return error("EndPattern without Pattern");
+  if (Nnq) qwrite(-1, which);
+  p = &Pat[Prec];
+  Prec = -1;
+  xbuffix(&p->ev);
+  if (p->len == 0) {
+    bar = (long) Beat * Measure;
+    last = p->ev.n ? p->ev.ev[p->ev.n - 1].time : 0;
+    p->len = last > 0 ? (last + bar - 1) / bar * bar : bar;
+  }
+  free(Nq);
+  Nq = PNq;
+  Nnq = PNnq;
+  Nqsize = PNqsize;
+  *currtime = Pcurrtime;
+  Cwtime = Pcwtime;
+  T0 = PT0;
+  M0 = PM0;
+  Beat = PBeat;
+  Measure = PMeasure;
+  return 0;
+}
+
+/* Play name [times=N]: the Pattern's events from now on, N times over. */
+static int getplay(long evtime, int *pat, long *times) {
+
+  struct xbuf *p;
+  long last;
+  int c;
+
+  if (yylex() != ERR || !isalpha((unsigned char) *yytext)) return syntax();
+  if ((*pat = patfind(yytext)) < 0) return error("No such Pattern");
+  if (*pat == Prec) return error("Pattern plays itself");
+  *times = 1;
+  if ((c = yylex()) != EOL) {
+    if (!isword(c, "times")) return syntax();
+    if (getfield("times", 1, 0x0fffffffL, times)) return -1;
+  }
+  p = &Pat[*pat].ev;
+  last = p->n ? p->ev[p->n - 1].time : 0;
+  if (last > 0x0fffffffL - evtime ||
+      *times - 1 > (0x0fffffffL - evtime - last) / Pat[*pat].len)
+    return error("Play runs past the largest time");
+  return 0;
+}
+
+static int mywritetrack(int which) {
+
+  int opcode, c, err, pend;
+  long currtime = 0;    /* absolute time of the previous event */
+  long newtime, delta, evtime, t = 0;
+  long eot = -1;        /* --compact and --sort hold end-of-track */
+  int i = 0, k, kept;
+
+  Cwtime = 0;
+  Tchan = -1;
+
+  while ((opcode = yylex()) == EOL) ;
+  if (opcode != MTRK) {
+    prs_error("Missing MTrk");
+    skipline();
+  }
+  checkeol();
+  while(1) {
+    if (Llimits) limitevent();
+    err = 0;
+    pend = 0;
+    if (isword(c = yylex(), "Pattern") || isword(c, "EndPattern")) {
+      err = isword(c, "Pattern") ? patbegin(&currtime) : patend(&currtime, which);
+      if (err) skipline();
+      else checkeol();
+      continue;
+    }
+    if (c != INT && terse && c != EOL && c != TRKEND && c != MTRK &&
+        c != EOF) {
+      /* the terse dialect leaves out a delta time of 0 */
+      pend = c;
+      c = INT;
+      yyval = 0;
+    }
+    switch(c) {
+     case MTRK:
+      err = prs_error("Unexpected MTrk");
+      break;
+     case EOF:
+      error("Unexpected EOF");
+      exit(1);
+     case TRKEND:
+      checkeol();
+      if (Prec >= 0) {
+        prs_error("Missing EndPattern");
+        patend(&currtime, which);
+      }
+      if (Nnq) qwrite(-1, which);
+      if (sortrun) sortflush();
+      if (eot >= 0)
+        mf_w_meta_event(eot < Cwtime ? 0 : eot - Cwtime, end_of_track, buffer, 0L);
+      return 1;
+     case INT:
+      newtime = yyval;
+      if (newtime < 0 || newtime > 0x0fffffffL) {
+        err = prs_error("Time value out of range");
+        break;
+      }
+      if ((opcode = pend ? pend : yylex()) == '/') {
+        if ((err = gettime(&t))) break;
+        newtime = (newtime - M0) * Measure + t;
+        if (yylex() != '/') {
+          err = prs_error("Illegal time value");
+          break;
+        }
+        if ((err = gettime(&t))) break;
+        newtime = T0 + newtime * Beat + t;
+        opcode = yylex();
+      }
+      if (incs)
+	delta = newtime;
+      else
+	delta = newtime - currtime;
+      if (delta < 0 && (!sortrun || Prec >= 0)) {
+        err = prs_error("Illegal time value, did you forget -i option ?");
+        break;
+      }
+      /* events dropped by --where fold their time into the next write */
+      evtime = currtime + delta;
+      currtime = evtime;        /* even if the event turns out bad */
+      if (Nnq) qwrite(evtime, which);
+      delta = evtime - Cwtime;
+      kept = 1;
+      switch(opcode) {
+       case ON:
+       case OFF:
+       case POPR:
+        if (terse) err = terseargs(opcode, NULL, NULL, NULL);
+        else err = checkchan() || checknote() || checkval();
+        if (err) break;
+        kept = CWHERE(opcode|chan, data[0], data[1], which+1, evtime);
+        if (kept) cmidi(evtime, opcode|chan, data);
+        break;
+       case ERR:
+        if (isword(opcode, "Play")) {
+          long n;
+          if ((err = getplay(evtime, &i, &n))) break;
+          if (Pat[i].ev.n > 0)
+            nqadd(evtime + Pat[i].ev.ev[0].time, 0, 0, i, 0, Pat[i].len,
+                  evtime, n - 1);
+          break;
+        }
+        if (isword(opcode, "Ramp")) {
+          long v = 0, dv = 0, n = 0;
+          if ((err = getramp(&c, evtime, &v, &dv, &t, &n))) break;
+          kept = CWHERE(c|chan, data[0], data[1], which+1, evtime);
+          if (kept) cmidi(evtime, c|chan, data);
+          if (n > 1) nqadd(evtime + t, c, chan, data[0], v + dv, t, dv, n - 1);
+          break;
+        }
+        if (!isword(opcode, "Note")) {
+          err = prs_error("Unknown input");
+          break;
+        }
+        if (terse) err = terseargs(ERR, &t, &c, &k);
+        else err = getnote(&t, &c, &k);
+        if (err) break;
+        kept = CWHERE(ON|chan, data[0], data[1], which+1, evtime);
+        if (kept) {
+          cmidi(evtime, ON|chan, data);
+          nqadd(evtime + t, c, chan, data[0], k, 0, 0, 1);
+        }
+        break;
+       case PAR:
+        if (terse) err = terseargs(opcode, NULL, NULL, NULL);
+        else err = checkchan() || checkcon() || checkval();
+        if (err) break;
+        kept = CWHERE(opcode|chan, data[0], data[1], which+1, evtime);
+        if (kept) cmidi(evtime, opcode|chan, data);
+        break;
+       case PB:
+        if (terse) err = terseargs(opcode, NULL, NULL, NULL);
+        else err = checkchan() || splitval();
+        if (err) break;
+        kept = CWHERE(opcode|chan, data[0], data[1], which+1, evtime);
+        if (kept) cmidi(evtime, opcode|chan, data);
+        break;
+       case PRCH:
+        if (terse) err = terseargs(opcode, NULL, NULL, NULL);
+        else err = checkchan() || checkprog();
+        if (err) break;
+        kept = CWHERE(opcode|chan, data[0], 0, which+1, evtime);
+        if (kept) cmidi(evtime, opcode|chan, data);
+        break;
+       case CHPR:
+        if (terse) err = terseargs(opcode, NULL, NULL, NULL);
+        else err = checkchan() || checkval();
+        if (err) break;
+        data[0] = data[1];
+        kept = CWHERE(opcode|chan, data[0], 0, which+1, evtime);
+        if (kept) cmidi(evtime, opcode|chan, data);
+        break;
+       case SYSEX:
+       case ARB:
+        if ((err = gethex(1))) break;
+        kept = CWHERE(opcode == ARB ? 0xf7 : 0xf0, 0, 0, which+1, evtime);
+        if (kept) cdata(evtime, system_exclusive, 0, buffer, (long)buflen);
+        break;
+       case TEMPO:
+        if (yylex() != INT) {
+          err = syntax();
+          break;
+        }
+        data[0] = (yyval >> 16) & 0xff;
+        data[1] = (yyval >> 8) & 0xff;
+        data[2] = yyval & 0xff;
+        kept = CWHERE(0xff, set_tempo, 0, which+1, evtime);
+        if (kept) cdata(evtime, meta_event, set_tempo, data, 3L);
+        break;
+       case TIMESIG: {
+          int nn, denom, cc, bb;
+          if (yylex() != INT || yylex() != '/') {
+            err = syntax();
+            break;
+          }
+          nn = yyval;
+          /* numerator is written as one byte and also becomes Measure (a
+             multiplier in time math); keep it in a sane byte range. */
+          if (nn < 1 || nn > 255) {
+            err = error("TimeSig numerator out of range (1..255)");
+            break;
+          }
+          err = getbyte("Denom", &denom) || getbyte("clocks per click", &cc) ||
+                getbyte("32nd notes per 24 clocks", &bb);
+          if (err) break;
+          for(i = 0, k = 1 ; k < denom; i++, k <<= 1);
+          if (k != denom) {
+            err = error("Illegal TimeSig");
+            break;
+          }
+          data[0] = nn;
+          data[1] = i;
+          data[2] = cc;
+          data[3] = bb;
+          /* Beat/Measure are kept >= 1 (below and via the initial main()
+             defaults), so this divisor is never zero even for a hostile
+             header with a tiny Clicks or a zero/negative numerator. */
+          M0 += (newtime - T0) / (Beat * Measure);
+          T0 = newtime;
+          Measure = nn;
+          if (Measure < 1) Measure = 1;
+          Beat = 4 * Clicks / denom;
+          if (Beat < 1) Beat = 1;
+          kept = CWHERE(0xff, time_signature, 0, which+1, evtime);
+          if (kept) cdata(evtime, meta_event, time_signature, data, 4L);
+        }
+        break;
+       case SMPTE:
+        for(i = 0; i < 5 && !err; i++) {
+          err = getbyte("SMPTE", &k);
+          data[i] = k;
+        }
+        if (err) break;
+        kept = CWHERE(0xff, smpte_offset, 0, which+1, evtime);
+        if (kept) cdata(evtime, meta_event, smpte_offset, data, 5L);
+        break;
+       case KEYSIG:
+        if ((err = getint("Keysig", &i))) break;
+        data[0] = i;
+        if (i < -7 || i > 7) {
+          err = error("Key Sig must be between -7 and 7");
+          break;
+        }
+        if ((c=yylex()) != MINOR && c != MAJOR) {
+          err = syntax();
+          break;
+        }
+        data[1] = (c == MINOR);
+        kept = CWHERE(0xff, key_signature, 0, which+1, evtime);
+        if (kept) cdata(evtime, meta_event, key_signature, data, 2L);
+        break;
+       case SEQNR:
+        if ((err = get16val())) break;
+        kept = CWHERE(0xff, sequence_number, 0, which+1, evtime);
+        if (kept) cdata(evtime, meta_event, sequence_number, data, 2L);
+        break;
+       case META: {
+          int type = yylex();
+          switch(type) {
+           case TRKEND: type = end_of_track; break;
+           case TEXT:
+           case COPYRIGHT:
+           case SEQNAME:
+           case INSTRNAME:
+           case LYRIC:
+           case MARKER:
+           case CUE: type -= (META+1); break;
+           case INT:
+            /* Accept any 0..255 meta type to match the decoder (which
+               round-trips arbitrary meta bytes via Mf_metamisc); reject
+               larger values rather than silently truncating to a byte. */
+            if (yyval < 0 || yyval > 255)
+              err = error("Meta type must be between 0 and 255");
+            type = yyval;
+            break;
+           default: err = prs_error("Illegal Meta type");
+          }
+          if (err) break;
+          if (type == end_of_track && Prec >= 0) {
+            err = error("Meta TrkEnd in a Pattern");
+            break;
+          }
+          if (type == end_of_track && Nnq && !sortrun) {
+            /* the Offs of Notes still sounding go before it */
+            qwrite(-1, which);
+            if (evtime < Cwtime) evtime = Cwtime;
+            delta = evtime - Cwtime;
+          }
+          if (type == end_of_track)
+            buflen = 0;
+          else if ((err = gethex(0)))
+            break;
+          kept = CWHERE(0xff, type, 0, which+1, evtime);
+          if (kept && (compact || sortrun) && type == end_of_track) {
+            if (eot >= 0) compactdrop(meta_event, 0);
+            if (evtime > eot) eot = evtime;
+            kept = 0;
+          } else if (kept && compact && compactempty(meta_event, type, buflen)) {
+            compactdrop(meta_event, delta);
+            kept = 0;
+          }
+          if (kept) cdata(evtime, meta_event, type, buffer, (long)buflen);
+          break;
+        }
+       case SEQSPEC:
+        if ((err = gethex(0))) break;
+        kept = CWHERE(0xff, sequencer_specific, 0, which+1, evtime);
+        if (kept) cdata(evtime, meta_event, sequencer_specific, buffer, (long)buflen);
+        break;
+       default:
+        err = prs_error("Unknown input");
+        break;
+      }
+     case EOL:
+      break;
+     default:
+      err = prs_error("Unknown input");
+      break;
+    }
+    if (err) skipline();
+    else checkeol();
+  }
+}
+
+static int getbyte(char *mess, int *v) {
 
   char ermesg[100];
 
-  getint(mess);
-  if (yyval < 0 || yyval > 127) {
-    sprintf(ermesg, "Wrong value (%ld) for %s", yyval, mess);
-    error(ermesg);
-    yyval = 0;
+  if (getint(mess, v)) return -1;
+  if (*v < 0 || *v > 127) {
+    sprintf(ermesg, "Wrong value (%d) for %s", *v, mess);
+    return error(ermesg);
   }
-  return yyval;
+  return 0;
 }
 
-int getint(char *mess) {
+static int getint(char *mess, int *v) {
 
   char ermesg[100];
+
   if (yylex() != INT) {
     sprintf(ermesg, "Integer expected for %s", mess);
-    error(ermesg);
-    yyval = 0;
+    return error(ermesg);
   }
-  return yyval;
+  *v = yyval;
+  return 0;
 }
 
-static void checkchan() {
+static int checkchan() {
 
-  if (yylex() != CH || yylex() != INT) syntax();
-  if (yyval < 1 || yyval > 16) error("Chan must be between 1 and 16");
+  if (yylex() != CH || yylex() != INT) return syntax();
+  if (yyval < 1 || yyval > 16) return error("Chan must be between 1 and 16");
   chan = yyval-1;
+  return 0;
+}
+
+/* Set yyval to the note number of the NOTEVAL in yytext. */
+static void noteval() {
+
+  static int notes[] = {9, 11, 0, 2, 4, 5, 7};
+  char *p = yytext;
+  int c = *p++;
+
+  if (isupper(c)) c = tolower(c);
+  yyval = notes[c-'a'];
+  switch(*p) {
+   case '#':
+   case '+': yyval++; p++; break;
+   case 'b':
+   case 'B':
+   case '-': yyval--; p++; break;
+  }
+  yyval += 12 * atoi(p);
 }
 
-static void checknote() {
+static int checknote() {
 
   int c;
 
   if (yylex() != NOTE || ((c=yylex()) != INT && c != NOTEVAL))
-  syntax();
-  if (c == NOTEVAL) {
-    static int notes[] = {9, 11, 0, 2, 4, 5, 7};
-    char *p = yytext;
-    c = *p++;
-    if (isupper(c)) c = tolower(c);
-    yyval = notes[c-'a'];
-    switch(*p) {
-     case '#':
-     case '+': yyval++; p++; break;
-     case 'b':
-     case 'B':
-     case '-': yyval--; p++; break;
-     }
-     yyval += 12 * atoi(p);
-  }
+    return syntax();
+  if (c == NOTEVAL) noteval();
   if (yyval < 0 || yyval > 127)
-    error("Note must be between 0 and 127");
+    return error("Note must be between 0 and 127");
   data[0] = yyval;
+  return 0;
 }
 
-static void checkval() {
+static int checkval() {
 
-  if (yylex() != VAL || yylex() != INT) syntax();
+  if (yylex() != VAL || yylex() != INT) return syntax();
   if (yyval < 0 || yyval > 127)
-    error("Value must be between 0 and 127");
+    return error("Value must be between 0 and 127");
   data[1] = yyval;
+  return 0;
 }
 
-static void splitval() {
+static int splitval() {
 
-  if (yylex() != VAL || yylex() != INT) syntax();
+  if (yylex() != VAL || yylex() != INT) return syntax();
   if (yyval < 0 || yyval > 16383)
-     error("Value must be between 0 and 16383");
+    return error("Value must be between 0 and 16383");
   data[0] = yyval % 128;
   data[1] = yyval / 128;
+  return 0;
 }
 
-static void get16val() {
+static int get16val() {
 
-  if (yylex() != VAL || yylex() != INT) syntax();
+  if (yylex() != VAL || yylex() != INT) return syntax();
   if (yyval < 0 || yyval > 65535)
-    error("Value must be between 0 and 65535");
+    return error("Value must be between 0 and 65535");
   data[0] = (yyval >> 8) & 0xff;
   data[1] = yyval & 0xff;
+  return 0;
 }
 
-static void checkcon() {
+static int checkcon() {
 
   if (yylex() != CON || yylex() != INT)
-  syntax();
+    return syntax();
   if (yyval < 0 || yyval > 127)
-    error("Controller must be between 0 and 127");
+    return error("Controller must be between 0 and 127");
   data[0] = yyval;
+  return 0;
 }
 
-static void checkprog() {
+static int checkprog() {
 
-  if (yylex() != PROG || yylex() != INT) syntax();
+  if (yylex() != PROG || yylex() != INT) return syntax();
   if (yyval < 0 || yyval > 127)
-    error("Program number must be between 0 and 127");
+    return error("Program number must be between 0 and 127");
   data[0] = yyval;
+  return 0;
 }
 
 static void checkeol() {
@@ -1420,11 +6447,13 @@ static void checkeol() {
   if (eol_seen) return;
   if (yylex() != EOL) {
     prs_error ("Garbage deleted");
-    while (!eol_seen) yylex();
+    skipline();
   }
 }
 
-static void gethex() {
+/* Read a string or hex bytes into buffer[buflen]. The first skip bytes
+   (a SysEx or Arb status) aren't payload as far as --max-payload goes. */
+static int gethex(int skip) {
 
   int c;
 
@@ -1452,7 +6481,7 @@ rescan:
          case 't': c = '\t'; break;
          case 'x':
           if (sscanf (yytext+i, "%2x", &c) != 1)
-            prs_error ("Illegal \\x in string");
+            return prs_error ("Illegal \\x in string");
           i += 2;
           break;
          case '\r':
@@ -1463,8 +6492,10 @@ rescan:
       }
       buffer[buflen++] = c;
     }
+    limitpayload(buflen - skip);
   } else if (c == INT) {
     do {
+      limitpayload(buflen + 1 - skip);
       if (buflen >= bufsiz) {
         bufsiz += 128;
         if (buffer)
@@ -1474,14 +6505,15 @@ rescan:
         if (! buffer) fatal("Out of memory");
       }
       if (yyval < 0 || yyval > 255)
-        error("hex byte must be between 0 and 255");
+        return error("hex byte must be between 0 and 255");
       buffer[buflen++] = yyval;
       c = yylex();
     } while (c == INT);
-    if (c != EOL) prs_error("Unknown hex input");
+    if (c != EOL) return prs_error("Unknown hex input");
   } else {
-    prs_error("String or hex input expected");
+    return prs_error("String or hex input expected");
   }
+  return 0;
 }
 
 long bankno (char *s, int n) {
@@ -4,8 +4,13 @@
 A MIDI Compiler - convert SMF MIDI files to and from plain text.
 ***/
 
+#include "midicomp_plugin.h"
+
 #define MThd            0x4d546864L
 #define MTrk            0x4d54726bL
+#define RIFF            0x52494646L
+#define RMID            0x524d4944L
+#define RIFFDATA        0x64617461L
 #define MTHD            256
 #define MTRK            257
 #define TRKEND          258
@@ -118,6 +123,7 @@ A MIDI Compiler - convert SMF MIDI files to and from plain text.
 #define upperbyte(x)    ((unsigned char)((x & 0xff00)>>8))
 #define NULLFUNC        0
 #define MSGINCREMENT    128
+#define SXCHUNK         4096    /* bytes per Mf_sxdata() call */
 
 #ifdef NO_YYLENG_VAR
 #define yyleng          yylength
@@ -138,6 +144,27 @@ static int fold         = 0;
 static int notes        = 0;
 static int times        = 0;
 static int incs         = 0;
+static int compact      = 0;
+static int merge        = 0;
+static int splitch      = 0;
+static int combine      = 0;
+static int inplace      = 0;
+static int check        = 0;
+static int info         = 0;
+static int durations    = 0;
+static int ramps        = 0;      /* --ramps: print linear runs as Ramp */
+static int packed       = 0;      /* --packed: binary event stream */
+static int json         = 0;      /* --json: NDJSON event stream */
+static char *exportdir  = NULL;   /* --export-columns: the directory */
+static int terse        = 0;      /* the terse text dialect */
+static int Tchan        = -1;     /* its current channel, -1 for none */
+static long sortrun     = 0;      /* --sort: events held per run, 0 off */
+
+/* resource limits, 0 for none (see limitevent()) */
+#define LIMIT_EXIT      3
+static int Llimits      = 0;
+static long Lmaxevents  = 0, Lmaxpayload = 0, Lmaxout = 0, Lbudget = 0;
+static long Levents     = 0, Lout = 0, Lticks = 0, Lstart = 0;
 static char *Onmsg      = "On ch=%d n=%s v=%d\n";
 static char *Offmsg     = "Off ch=%d n=%s v=%d\n";
 static char *PoPrmsg    = "PoPr ch=%d n=%s v=%d\n";
@@ -145,8 +172,12 @@ static char *Parmsg     = "Par ch=%d c=%d v=%d\n";
 static char *Pbmsg      = "Pb ch=%d v=%d\n";
 static char *PrChmsg    = "PrCh ch=%d p=%d\n";
 static char *ChPrmsg    = "ChPr ch=%d v=%d\n";
-static jmp_buf erjump;
-static int err_cont     = 0;
+static char *Notemsg    = "Note ch=%d n=%s v=%d dur=%ld";
+static char *NoteOffmsg = " off=%d\n";
+static char *Rampmsg    = "Ramp Par ch=%d c=%d v=%d dv=%ld dt=%ld count=%ld\n";
+static char *RampPbmsg  = "Ramp Pb ch=%d v=%d dv=%ld dt=%ld count=%ld\n";
+static int Errors       = 0;      /* compile errors reported so far */
+static int Maxerrors    = 0;      /* --max-errors, 0 for no limit */
 static int TrkNr;
 static int Format, Ntrks;
 static int Measure, M0, Beat, Clicks;
@@ -163,15 +194,15 @@ extern int eol_seen;
 extern FILE  *yyin;
 
 static int  mywritetrack();
-static void checkchan();
-static void checknote();
-static void checkval();
-static void splitval();
-static void get16val();
-static void checkcon();
-static void checkprog();
+static int checkchan();
+static int checknote();
+static int checkval();
+static int splitval();
+static int get16val();
+static int checkcon();
+static int checkprog();
 static void checkeol();
-static void gethex();
+static int gethex(int);
 
 int (*Mf_getc)()        = NULLFUNC;
 void (*Mf_error)()      = NULLFUNC;
@@ -187,6 +218,11 @@ void (*Mf_program)()     = NULLFUNC;
 void (*Mf_chanpressure)() = NULLFUNC;
 void (*Mf_sysex)()       = NULLFUNC;
 void (*Mf_arbitrary)()   = NULLFUNC;
+void (*Mf_sxbegin)()     = NULLFUNC;    /* streaming SysEx/Arb, see sxstream() */
+void (*Mf_sxdata)()      = NULLFUNC;
+void (*Mf_sxend)()       = NULLFUNC;
+int Mf_sxjoined = 0;    /* set while Mf_sysex has a SysEx joined from packets */
+void (*Mf_metaraw)()     = NULLFUNC;
 void (*Mf_metamisc)()    = NULLFUNC;
 void (*Mf_seqnum)()      = NULLFUNC;
 void (*Mf_eot)()         = NULLFUNC;
@@ -199,7 +235,14 @@ void (*Mf_text)()        = NULLFUNC;
 
 static void badbyte();
 
+/* per-track reader state, so tracks can be read interleaved */
+struct trkstate {
+  int status;           /* running status */
+  int sysexcontinue;    /* inside a SysEx split over F7 packets */
+};
+
 static int readtrack();
+static void readevent(struct trkstate *);
 static void metaevent();
 static void sysex();
 static void chanmessage();
@@ -218,6 +261,12 @@ int (*Mf_wtrack)()      = NULLFUNC;
 int (*Mf_wtempotrack)() = NULLFUNC;
 
 int Mf_nomerge          = 0;
+int Mf_check            = 0;    /* --check: validate only, no callbacks */
+int Mf_skipped          = 0;    /* chunks skipped by readheader/readtrack */
+static long Mf_riffleft = 0;    /* bytes left in an RMID data chunk */
+static int Hexpos;              /* prhexdata()'s column */
+static int (*Mf_riffgetc)();
+static int Mf_eotseen   = 0;
 long Mf_currtime        = 0L;
 long old_Mf_currtime        = 0L;
 
@@ -236,14 +285,15 @@ static int dbg=0;
 unsigned char data[5];
 int chan;
 int Mf_RunStat = 0;
+static long Mf_rssaved = 0;
 static int laststat;
 static int lastmeta;
 int verbose = 0;
 
 int filegetc();
 int fileputc();
-int getint();
-int getbyte();
+static int getint(char *, int *);
+static int getbyte(char *, int *);
 int yylex();
 void WriteVarLen();
 int eputc(unsigned char);
@@ -252,11 +302,12 @@ void translate();
 void initfuncs();
 void mfread();
 void mferror();
-void mc_error(char *);
+int mc_error(char *);
 void fatal(char *);
 /* error() is the project's recoverable parse/validation error. It is NOT
-   glibc's error(3): map it to our mc_error() so a single definition serves
-   both midicomp.c and the generated lexer (which also calls error()). */
+   glibc's error(3): map it to our mc_error(), which reports and returns -1
+   for the caller to pass up. (The generated lexer maps its error() to
+   fatal() in t2mf.h.) */
 #define error mc_error
 
 void mymseq();
@@ -270,8 +321,296 @@ void prtime();
 void prtext();
 void prhex();
 void initfuncs();
-void prs_error();
-void syntax();
+int prs_error(char *);
+int syntax();
+static void skipline();
+
+/* --where event predicate: field ids, postfix opcodes and Wtab[] verdicts */
+#define WF_CH           1
+#define WF_TYPE         2
+#define WF_NOTE         3
+#define WF_CON          4
+#define WF_VAL          5
+#define WF_TRK          6
+#define WF_TIME         7
+#define WF_META         8
+#define WF_N            9
+
+#define WOP_FIELD       1
+#define WOP_CONST       2
+#define WOP_EQ          3
+#define WOP_NE          4
+#define WOP_LT          5
+#define WOP_LE          6
+#define WOP_GT          7
+#define WOP_GE          8
+#define WOP_AND         9
+#define WOP_OR          10
+#define WOP_NOT         11
+
+#define W_MAXCODE       256
+#define W_MAXSTACK      32
+#define W_KEEP          0
+#define W_DROP          1
+#define W_EVAL          2
+
+/* With no --where, Wtab[] is all W_KEEP and this is a single load. An
+   end-of-track is always kept, so a track doesn't end early; the deltas of
+   the events dropped before it fold into it like any other. */
+#define WHERE(st,c1,c2,trk,t) \
+  (Wtab[st] == W_KEEP || ((st) == 0xff && (c1) == end_of_track) \
+   || (Wtab[st] == W_EVAL && whereeval(st,c1,c2,trk,t)))
+
+extern signed char Wtab[];
+int Mf_trackno = 0;
+int whereeval(int, int, int, int, long);
+void wherecompile(char *);
+
+/* Binary transform path (SMF -> SMF) */
+#define XMAXSTAGE       16
+#define XBUFSIZE        65536
+#define XBATCH          256
+#define SORTRUN         (1L << 20)      /* --sort's default run length */
+#define PK_VERSION      1               /* --packed stream version */
+#define PK_HDRLEN       11              /* "MCPK", version, format, ntrks, division */
+#define PK_RECLEN       13              /* tick, track, status, c1, c2, length */
+#define JS_VERSION      1               /* --json stream version */
+#define COL_VERSION     1               /* --export-columns file version */
+#define COL_HDRLEN      16              /* "MCCO", version, width, 0, 0, count */
+
+/* long-only command line options */
+#define OPT_TRANSPOSE   1000
+#define OPT_VELOCITY    1001
+#define OPT_CHMAP       1002
+#define OPT_DROP        1003
+#define OPT_TEMPO       1004
+#define OPT_PLUGIN      1005
+#define OPT_COMPACT     1006
+#define OPT_THIN        1007
+#define OPT_MERGE       1008
+#define OPT_FORMAT0     1009
+#define OPT_SPLIT       1010
+#define OPT_CONCAT      1011
+#define OPT_LAYER       1012
+#define OPT_INPLACE     1013
+#define OPT_CHECK       1014
+#define OPT_INFO        1015
+#define OPT_MAXEVENTS   1016
+#define OPT_MAXPAYLOAD  1017
+#define OPT_MAXOUT      1018
+#define OPT_BUDGET      1019
+#define OPT_MAXERRORS   1020
+#define OPT_DURATIONS   1021
+#define OPT_SORT        1022
+#define OPT_TERSE       1023
+#define OPT_RAMPS       1024
+#define OPT_PACKED      1025
+#define OPT_JSON        1026
+#define OPT_EXPORT      1027
+
+/* a growable run of events with their payloads copied into one arena */
+struct xbuf {
+  struct mfevent *ev;
+  long *off;            /* payload offsets into data */
+  int n, size;
+  unsigned char *data;
+  long len, dsize;
+};
+
+/* A file held as arrays, a set per track, which mfread() loads when
+   Mf_model is set; event i of a track has its payload (a SysEx's starting
+   with its F0) at arena[off[i]] up to arena[off[i+1]]. */
+struct mftrack {
+  long n, size;         /* events, and room for */
+  long *tick;           /* absolute time in ticks */
+  unsigned char *status;  /* channel status, 0xf0 SysEx, 0xf7 Arb or 0xff Meta */
+  unsigned char *data1;   /* channel data bytes; data1 is a Meta's type */
+  unsigned char *data2;
+  long *off;            /* n + 1 of them */
+  unsigned char *raw;   /* the MTrk chunk as read, written back as it is */
+  long rawlen;          /* unless dirty is set */
+  int dirty;
+};
+
+struct mfmodel {
+  int format, ntrks, division;  /* as the MThd gives them */
+  int nread;            /* tracks read into trk[] */
+  struct mftrack *trk;
+  unsigned char *arena;
+  long len, size;
+  int sxwhole;          /* set before reading: SysEx packets joined into one */
+};
+
+static struct mfmodel *Mf_model = NULL;
+#define MODELMAX        (16L << 20)     /* larger inputs stream through the stages */
+
+/* a --plugin stage */
+struct xplugin {
+  struct mc_plugin *pl;
+  void *state;
+  char *args;
+  struct mc_host host;
+  int stage;            /* index in the stage list */
+  struct xbuf in;       /* the batch being collected */
+  struct xbuf out;      /* what the plugin emitted, not yet passed on */
+  struct xbuf held;     /* spare for xplugforward() */
+};
+
+static int Xnstages = 0;
+
+/* the mapped input file, and the read position memgetc() uses */
+static unsigned char *Mbase, *Mp, *Mend;
+static long Mlen;
+static int Mmapped;
+
+/* an input of --concat or --layer */
+struct xinput {
+  unsigned char *base, *body;   /* the mapping, and just past its MThd */
+  unsigned char *end;           /* the end of the SMF in it */
+  long len;
+  int format, ntrks;
+  long division, scale;         /* times are scaled by scale/division */
+  long length;                  /* latest end of track, for --concat */
+};
+
+/* --durations: a decoded Note whose line waits for its Off, or --ramps: a
+   Par or Pb that may start a Ramp. The text printed after it is held in
+   Nbuf from pos on until it is paired or its run ends. */
+struct nhole {
+  long pos;             /* where its line goes in Nbuf */
+  long on, dur;         /* dur is -1 until the Off is seen or the run ends */
+  int chan, pitch, vol; /* a Ramp's controller (128 for Pb) and first value */
+  int off;              /* Off velocity, -1 for an On v=0 */
+  char tch[4];          /* --terse: the channel as printed, if it is */
+  int below;            /* the next older Note held on this chan/pitch */
+  int ramp;             /* set for a Ramp */
+  long count, dt, dv;   /* its points, and their step in time and value */
+  long seq;             /* the order its last point (or the Note) was
+                           decoded in */
+};
+
+/* a compiled Note's Off, the rest of a Ramp, or a Play's next event,
+   waiting in Nq for its time */
+struct qevent {
+  long time, seq;
+  int status, chan;     /* status 0 for a Play */
+  int c1;               /* note or controller, or the Play's pattern */
+  long v;               /* velocity or value (the whole 14 bits of a Pb), or
+                           the index of the Play's next event */
+  long dt, dv, left;    /* a Ramp's step and the points still to write, or
+                           a Play's length, start and repetitions to come */
+};
+
+/* a Pattern block, compiled once and written again by each Play of it */
+struct pattern {
+  char *name;
+  struct xbuf ev;       /* its events, their times from its start */
+  long len;             /* from one repetition of a Play to the next */
+};
+
+/* --sort: a sorted run of a track's events spilled to a temporary file */
+struct srun {
+  FILE *fp;
+  long left;            /* events not yet read */
+  struct mfevent ev;    /* the next one */
+  unsigned char *data;
+  long dsize;
+};
+
+/* a track being read in the merge */
+struct mcursor {
+  unsigned char *p, *end;
+  long left;            /* Mf_toberead */
+  long time;            /* absolute time of the next event */
+  int track;
+  struct trkstate ts;
+};
+
+FILE *efopen();
+int mf_w_midi_event();
+int mf_w_meta_event();
+int mf_w_sysex_event();
+int mf_w_arb_event();
+void xaddstage();
+void xevent(struct mfevent *);
+void xbufadd(struct xbuf *, struct mfevent *);
+void xbuffix(struct xbuf *);
+void xbufclear(struct xbuf *);
+void xplugadd(struct xplugin *, struct mfevent *);
+void xplugin(char *);
+void xaddplugin(struct mc_plugin *, char *);
+void xthin(char *);
+void mapinput(char *);
+int mapfile(char *);
+void unmapfile();
+int checkfiles(char **, int);
+int infofiles(char **, int);
+void limit(char *, long);
+void limitevent();
+static void limitpayload(long);
+static void limitarg(long *, char *, char *);
+int outf(char *, ...);
+static void noteflush(int);
+static int rampjoin(int, int, int);
+static void ramphold(int, int, int);
+static char *tch(int);
+static int isword(int, char *);
+static void noteval();
+static int notepaired(int, int, int);
+static void qwrite(long, int);
+static int getramp(int *, long, long *, long *, long *, long *);
+static int patbegin(long *);
+static int patend(long *, int);
+static int getplay(long, int *, long *);
+static void cwrite(struct mfevent *);
+static void sortflush();
+int outc(int);
+static void checkevent(struct trkstate *, int);
+static void sxstream(struct trkstate *, int, long);
+void prhexdata(unsigned char *, int);
+static void mysxflush();
+int fileputc(int);
+void mf_w_sysex_begin(unsigned long, int, unsigned long);
+void mf_w_sysex_data(unsigned char *, int);
+int memgetc();
+int riffgetc();
+static int infogetc();
+static long Ipos;               /* --info: bytes read so far */
+void mergetracks();
+void mergetext(char *);
+static int xmergetrack(int);
+static int xsplittrack(int);
+void xcombine(char **, int, char *);
+void xinplace(char *);
+static void xpatch(struct mfevent *);
+int vlqlen(unsigned long);
+int compactempty(int, int, long);
+void compactdrop(int, unsigned long);
+void compactreport(FILE *);
+void xform(char *, char *);
+static void pkrecord(long, int, int, int, int, unsigned char *, long);
+static void pksxbegin(int, long);
+static void pksxdata(unsigned char *, int);
+static void jsrecord(long, int, int, int, int, unsigned char *, long);
+static void jsdata(unsigned char *, long);
+static void mfmodelread(struct mfmodel *);
+void mfmodelwrite(struct mfmodel *);
+void mfmodelfree(struct mfmodel *);
+void mftranspose(struct mfmodel *, int);
+void mfvelocity(struct mfmodel *, int);
+void mfchmap(struct mfmodel *, int *);
+void mftempo(struct mfmodel *, double);
+void mfdrop(struct mfmodel *, char *, char *);
+static void colrecord(long, int, int, int, int, unsigned char *, long);
+static void coldata(unsigned char *, long);
+int exportcolumns(char **, int);
+void pkdecode(char *, char *);
+void pktranslate();
+void xtranspose(char *);
+void xvelocity(char *);
+void xchmap(char *);
+void xdrop(char *);
+void xtempo(char *);
 
 /***
 * Version: v0.2.0 20260613
@@ -0,0 +1,57 @@
+/***
+# midicomp_plugin.h
+
+The C plugin ABI for midicomp's SMF -> SMF transform path.
+
+A plugin is a shared object loaded with `--plugin path.so[:args]`. It
+exports one symbol, `midicomp_plugin`, a struct mc_plugin. midicomp
+calls init() once with the text after the `:`, then hands it the decoded
+events of each track in batches through process(), in time order. The
+plugin passes on whatever it wants written with host->emit() - the same
+event, an edited copy, several events or none. Emitted events may be out
+of order within a batch; midicomp stable-sorts them by time before they
+go on to the next stage; those later than the first event of the next
+batch are held back and sorted in with what that batch emits. An event
+emitted earlier than one already written is moved up to that time.
+endtrack() is called after the last batch of a track and may emit
+trailing events; finish() after the file.
+
+Event payloads (msg) belong to midicomp and are only valid during the
+call; emit() copies what it is given, so a plugin may emit events that
+point at its own buffers.
+***/
+
+#ifndef MIDICOMP_PLUGIN_H
+#define MIDICOMP_PLUGIN_H
+
+#define MC_PLUGIN_ABI   1
+
+struct mfevent {
+  long time;            /* absolute time in ticks */
+  int track;            /* 1-based input track */
+  int status;           /* channel status, 0xf0 SysEx, 0xf7 Arb or 0xff Meta */
+  int c1, c2;           /* channel data bytes; c1 is the type of a Meta */
+  long leng;            /* payload length of SysEx, Arb and Meta */
+  unsigned char *msg;   /* payload (a SysEx includes its leading F0) */
+};
+
+struct mc_host {
+  int abi;              /* MC_PLUGIN_ABI of the running midicomp */
+  int format;           /* MThd format, track count and division */
+  int ntrks;
+  int division;
+  void (*emit)(struct mc_host *, struct mfevent *);
+  void *priv;           /* midicomp's, don't touch */
+};
+
+struct mc_plugin {
+  int abi;              /* set to MC_PLUGIN_ABI */
+  char *name;
+  /* returns the plugin's state, or NULL to refuse args and stop midicomp */
+  void *(*init)(char *args, struct mc_host *host);
+  void (*process)(void *state, struct mfevent *ev, int n, struct mc_host *host);
+  void (*endtrack)(void *state, int track, struct mc_host *host);
+  void (*finish)(void *state);
+};
+
+#endif
@@ -0,0 +1,99 @@
+/***
+# humanize.c
+
+Sample midicomp plugin: loosen the timing and velocity of note-ons.
+
+    midicomp --plugin=./humanize.so:t=10,v=8,seed=1 in.mid out.mid
+
+  t=N     delay each note-on by 0..N ticks (its note-off moves with it)
+  v=N     add -N..N to each note-on velocity (kept within 1..127)
+  seed=N  start of the pseudo-random sequence, for repeatable output
+
+Everything else passes through unchanged.
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "midicomp_plugin.h"
+
+struct humanize {
+  long t, v;
+  unsigned long seed;
+  long shift[16][128];  /* delay given to the sounding note, per ch/pitch */
+};
+
+/* A small LCG of our own, so output is the same with every libc. */
+static long hrand(struct humanize *h, long n) {
+
+  h->seed = h->seed * 1103515245UL + 12345UL;
+  return (long) ((h->seed >> 16) & 0x7fff) % (n + 1);
+}
+
+static void *hinit(char *args, struct mc_host *host) {
+
+  struct humanize *h = calloc(1, sizeof(struct humanize));
+  char *p = args;
+  char key[8];
+  long val;
+  int n;
+
+  if (h == NULL) return NULL;
+  h->seed = 1;
+  while (*p) {
+    if (sscanf(p, "%7[a-z]=%ld%n", key, &val, &n) != 2 || val < 0) {
+      free(h);
+      return NULL;
+    }
+    if (strcmp(key, "t") == 0) h->t = val;
+    else if (strcmp(key, "v") == 0) h->v = val;
+    else if (strcmp(key, "seed") == 0) h->seed = val;
+    else {
+      free(h);
+      return NULL;
+    }
+    p += n;
+    if (*p == ',') p++;
+  }
+  return h;
+}
+
+static void hprocess(void *state, struct mfevent *ev, int n,
+                     struct mc_host *host) {
+
+  struct humanize *h = state;
+  struct mfevent e;
+  long v;
+  int i, ch;
+
+  for (i = 0; i < n; i++) {
+    e = ev[i];
+    ch = e.status & 0xf;
+    if ((e.status & 0xf0) == 0x90 && e.c2 > 0) {
+      h->shift[ch][e.c1] = h->t ? hrand(h, h->t) : 0;
+      e.time += h->shift[ch][e.c1];
+      if (h->v) {
+        v = e.c2 + hrand(h, 2 * h->v) - h->v;
+        e.c2 = (v < 1) ? 1 : (v > 127) ? 127 : v;
+      }
+    } else if ((e.status & 0xf0) == 0x80 || (e.status & 0xf0) == 0x90) {
+      e.time += h->shift[ch][e.c1];
+      h->shift[ch][e.c1] = 0;
+    }
+    (*host->emit)(host, &e);
+  }
+}
+
+static void hfinish(void *state) {
+
+  free(state);
+}
+
+struct mc_plugin midicomp_plugin = {
+  MC_PLUGIN_ABI,
+  "humanize",
+  hinit,
+  hprocess,
+  NULL,
+  hfinish
+};
@@ -8,6 +8,39 @@
 #   verbose    decode -v -t ex1.mid        == ex1-verbose.txt (golden)
 #   roundtrip  text -> SMF -> text is stable (idempotent decode)
 #   canonical  midicomp's SMF output is byte-stable on re-compile
+#   where      --where filters the same events on decode and on compile
+#   transform  SMF -> SMF stages; untouched tracks are copied byte for byte
+#   plugin     the sample humanize plugin, loaded with --plugin (-DPLUGIN=)
+#   compact    --compact restores ex1.mid's running status byte for byte
+#   thin       --thin=4 on a dense controller/pitch bend track, and on a
+#              channel two format 1 tracks share
+#   merge      --merge of multi.txt; --to-format0 decodes to the same text
+#   split      --split-channels of multi.txt, one track per channel with its
+#              names, and of a format 0 file naming channels by prefix
+#   combine    --concat and --layer of inputs at 96 and 120 ppq
+#   inplace    --in-place patches ex1.mid without changing its size, and
+#              falls back to a rewrite when an edit drops events
+#   check      --check passes ex1.mid and fails each malformed .mid fixture
+#   info       --info header and chunk directory of multi.txt
+#   chunks     unknown chunks and an RMID wrapper around ex1.mid are skipped
+#   sysex      a SysEx sent in packets, streamed to text and copied to SMF
+#   limits     each --max-* limit stops the run with exit status 3
+#   errors     every bad line reported in one compile, and --max-errors
+#   durations  --durations pairs On/Off into Note lines, which compile back
+#   sort       --sort compiles times out of order, also spilling runs to disk
+#   terse      the terse dialect decodes and compiles back to the same events
+#   ramps      Ramp lines compile to their points, and --ramps finds the runs
+#              in thin.txt again, plain and terse, compiling back byte for byte
+#   patterns   Pattern blocks played in two tracks, overlapping and nested
+#   packed     --packed streams compile back to the same bytes, SysEx packets
+#              and all, stages apply on the way, and text is refused
+#   json       --json streams compile back to the same bytes, hand-written
+#              NDJSON with escapes and unknown members compiles, text is refused
+#   columns    --export-columns of two files and a bad one, then more added
+#              from a list on stdin through --where
+#   model      bulk stages on files up to MODELMAX bytes go through the
+#              in-memory model; its output is the streaming stages', byte
+#              for byte, SysEx packets left split or joined as they'd be
 
 function(run)
   # run(<result-var> <args...>) - execute midicomp, FATAL on non-zero exit
@@ -68,6 +101,490 @@ elseif(MODE STREQUAL "smpte")
   run(ARGS "${WORKDIR}/smpte1.mid" OUT "${WORKDIR}/smpte1.txt")
   must_match("${SRCDIR}/tests/fixtures/smpte.txt" "${WORKDIR}/smpte1.txt" "SMPTE round-trip")
 
+elseif(MODE STREQUAL "where")
+  # the predicate is evaluated in the reader (decode) and before the writer
+  # (compile); either way the same events must survive, at the same times.
+  set(expr "ch==10 && type==on && v>100 || type==par && c==64")
+  run(ARGS -c "${SRCDIR}/tests/fixtures/multi.txt" "${WORKDIR}/multi.mid")
+  run(ARGS "--where=${expr}" "${WORKDIR}/multi.mid" OUT "${WORKDIR}/where1.txt")
+  must_match("${SRCDIR}/tests/fixtures/where.txt" "${WORKDIR}/where1.txt" "--where decode")
+  run(ARGS "--where=${expr}" -c "${SRCDIR}/tests/fixtures/multi.txt" "${WORKDIR}/where.mid")
+  run(ARGS "--where=${expr}" "${WORKDIR}/where.mid" OUT "${WORKDIR}/where2.txt")
+  must_match("${SRCDIR}/tests/fixtures/where.txt" "${WORKDIR}/where2.txt" "--where compile")
+
+elseif(MODE STREQUAL "transform")
+  run(ARGS -c "${SRCDIR}/tests/fixtures/multi.txt" "${WORKDIR}/xf.mid")
+  run(ARGS "${WORKDIR}/xf.mid" "${WORKDIR}/xf-copy.mid")
+  must_match("${WORKDIR}/xf.mid" "${WORKDIR}/xf-copy.mid" "identity transform")
+  run(ARGS --transpose=12 --velocity=50 --chmap=10:11 --drop=pb,chpr,trkname
+           --tempo-scale=2 "${WORKDIR}/xf.mid" "${WORKDIR}/xf-out.mid")
+  run(ARGS "${WORKDIR}/xf-out.mid" OUT "${WORKDIR}/xf-out.txt")
+  must_match("${SRCDIR}/tests/fixtures/transform.txt" "${WORKDIR}/xf-out.txt" "transform stages")
+  # tracks the stages can't touch are copied verbatim, running status and all
+  run(ARGS "${SRCDIR}/ex1.mid" "${WORKDIR}/xf-ex1.mid")
+  must_match("${SRCDIR}/ex1.mid" "${WORKDIR}/xf-ex1.mid" "pass-through of ex1.mid")
+  run(ARGS --compact -c "${SRCDIR}/tests/fixtures/multi.txt" "${WORKDIR}/xf-rs.mid")
+  run(ARGS --tempo-scale=2 "${WORKDIR}/xf-rs.mid" "${WORKDIR}/xf-rs2.mid")
+  run(ARGS --tempo-scale=0.5 "${WORKDIR}/xf-rs2.mid" "${WORKDIR}/xf-rs3.mid")
+  must_match("${WORKDIR}/xf-rs.mid" "${WORKDIR}/xf-rs3.mid" "pass-through of untouched tracks")
+  # meta type 0xaf is not an end-of-track
+  file(WRITE "${WORKDIR}/xf-af.txt" "MFile 1 2 96\nMTrk\n0 Tempo 500000\n10 Meta TrkEnd\n"
+    "TrkEnd\nMTrk\n0 Meta 0xaf 01\n0 On ch=1 n=60 v=1\n1 On ch=1 n=62 v=1\n"
+    "10 Meta TrkEnd\nTrkEnd\n")
+  run(ARGS --compact -c "${WORKDIR}/xf-af.txt" "${WORKDIR}/xf-af.mid")
+  run(ARGS --tempo-scale=2 "${WORKDIR}/xf-af.mid" "${WORKDIR}/xf-af2.mid")
+  file(READ "${WORKDIR}/xf-af2.mid" af HEX)
+  if(NOT af MATCHES "00ffaf010100903c01013e0109ff2f00$")
+    message(FATAL_ERROR "a track with meta 0xaf isn't copied verbatim: ${af}")
+  endif()
+
+elseif(MODE STREQUAL "plugin")
+  if(NOT PLUGIN)
+    message(STATUS "SKIP: no plugin support on this platform")
+    return()
+  endif()
+  run(ARGS -c "${SRCDIR}/tests/fixtures/multi.txt" "${WORKDIR}/pl.mid")
+  run(ARGS "--plugin=${PLUGIN}:t=10,v=8,seed=1" "${WORKDIR}/pl.mid" "${WORKDIR}/pl-out.mid")
+  run(ARGS "${WORKDIR}/pl-out.mid" OUT "${WORKDIR}/pl-out.txt")
+  must_match("${SRCDIR}/tests/fixtures/humanize.txt" "${WORKDIR}/pl-out.txt" "humanize plugin")
+  # a track of several batches: notes delayed past the end of one batch
+  # mustn't move the next batch's controllers, which humanize leaves alone
+  set(txt "MFile 0 1 96\nMTrk\n")
+  foreach(i RANGE 149)
+    math(EXPR t "${i} * 4")
+    math(EXPR t1 "${t} + 1")
+    math(EXPR t2 "${t} + 2")
+    math(EXPR t3 "${t} + 3")
+    math(EXPR v "${i} % 128")
+    string(APPEND txt "${t} On ch=1 n=60 v=90\n${t1} Par ch=1 c=7 v=${v}\n"
+      "${t2} Off ch=1 n=60 v=0\n${t3} Par ch=1 c=10 v=${v}\n")
+  endforeach()
+  string(APPEND txt "600 Meta TrkEnd\nTrkEnd\n")
+  file(WRITE "${WORKDIR}/batches.txt" "${txt}")
+  run(ARGS -c "${WORKDIR}/batches.txt" "${WORKDIR}/batches.mid")
+  run(ARGS "--plugin=${PLUGIN}:t=30,seed=1" "${WORKDIR}/batches.mid" "${WORKDIR}/batches-out.mid")
+  run(ARGS "${WORKDIR}/batches-out.mid" OUT "${WORKDIR}/batches-out.txt")
+  file(STRINGS "${WORKDIR}/batches.txt" par1 REGEX " Par ")
+  file(STRINGS "${WORKDIR}/batches-out.txt" par2 REGEX " Par ")
+  if(NOT par1 STREQUAL par2)
+    message(FATAL_ERROR "humanize moved controllers across a batch")
+  endif()
+
+elseif(MODE STREQUAL "compact")
+  # ex1.mid was written with running status; a compact re-encode gives it back
+  run(ARGS --compact "${SRCDIR}/ex1.mid" "${WORKDIR}/cp1.mid")
+  must_match("${SRCDIR}/ex1.mid" "${WORKDIR}/cp1.mid" "compact transform")
+  # the compile path: same events back, minus empty and redundant ones
+  run(ARGS --compact -c "${SRCDIR}/tests/fixtures/compact.txt" "${WORKDIR}/cp2.mid")
+  run(ARGS "${WORKDIR}/cp2.mid" OUT "${WORKDIR}/cp2.txt")
+  must_match("${SRCDIR}/tests/fixtures/compact-out.txt" "${WORKDIR}/cp2.txt" "compact compile")
+
+elseif(MODE STREQUAL "thin")
+  run(ARGS -c "${SRCDIR}/tests/fixtures/thin.txt" "${WORKDIR}/thin.mid")
+  run(ARGS --thin=4 "${WORKDIR}/thin.mid" "${WORKDIR}/thin-out.mid")
+  run(ARGS "${WORKDIR}/thin-out.mid" OUT "${WORKDIR}/thin-out.txt")
+  must_match("${SRCDIR}/tests/fixtures/thin-out.txt" "${WORKDIR}/thin-out.txt" "thin")
+  run(ARGS -c "${SRCDIR}/tests/fixtures/thin-shared.txt" "${WORKDIR}/thin-shared.mid")
+  run(ARGS --thin=4 "${WORKDIR}/thin-shared.mid" "${WORKDIR}/thin-shared-out.mid")
+  run(ARGS "${WORKDIR}/thin-shared-out.mid" OUT "${WORKDIR}/thin-shared-out.txt")
+  must_match("${SRCDIR}/tests/fixtures/thin-shared-out.txt" "${WORKDIR}/thin-shared-out.txt"
+    "thin of a channel shared by two tracks")
+  # a format 1 file whose tracks share no channel is thinned as format 0
+  file(READ "${SRCDIR}/tests/fixtures/thin.txt" t)
+  string(REPLACE "MFile 0 " "MFile 1 " t "${t}")
+  file(WRITE "${WORKDIR}/thin1.txt" "${t}")
+  run(ARGS -c "${WORKDIR}/thin1.txt" "${WORKDIR}/thin1.mid")
+  run(ARGS --thin=4 "${WORKDIR}/thin1.mid" "${WORKDIR}/thin1-out.mid")
+  run(ARGS "${WORKDIR}/thin1-out.mid" OUT "${WORKDIR}/thin1-out.txt")
+  file(READ "${WORKDIR}/thin1-out.txt" t)
+  string(REPLACE "MFile 1 " "MFile 0 " t "${t}")
+  file(WRITE "${WORKDIR}/thin1-out.txt" "${t}")
+  must_match("${SRCDIR}/tests/fixtures/thin-out.txt" "${WORKDIR}/thin1-out.txt"
+    "thin of a format 1 file")
+
+elseif(MODE STREQUAL "merge")
+  run(ARGS -c "${SRCDIR}/tests/fixtures/multi.txt" "${WORKDIR}/merge.mid")
+  run(ARGS --merge "${WORKDIR}/merge.mid" OUT "${WORKDIR}/merge.txt")
+  must_match("${SRCDIR}/tests/fixtures/merge.txt" "${WORKDIR}/merge.txt" "merge")
+  run(ARGS --to-format0 "${WORKDIR}/merge.mid" "${WORKDIR}/merge0.mid")
+  run(ARGS "${WORKDIR}/merge0.mid" OUT "${WORKDIR}/merge0.txt")
+  must_match("${SRCDIR}/tests/fixtures/merge.txt" "${WORKDIR}/merge0.txt" "to-format0")
+
+elseif(MODE STREQUAL "split")
+  run(ARGS -c "${SRCDIR}/tests/fixtures/multi.txt" "${WORKDIR}/split.mid")
+  run(ARGS --split-channels "${WORKDIR}/split.mid" "${WORKDIR}/split1.mid")
+  run(ARGS "${WORKDIR}/split1.mid" OUT "${WORKDIR}/split.txt")
+  must_match("${SRCDIR}/tests/fixtures/split.txt" "${WORKDIR}/split.txt" "split-channels")
+  run(ARGS -c "${SRCDIR}/tests/fixtures/split-prefix.txt" "${WORKDIR}/split0.mid")
+  run(ARGS --split-channels "${WORKDIR}/split0.mid" "${WORKDIR}/split2.mid")
+  run(ARGS "${WORKDIR}/split2.mid" OUT "${WORKDIR}/split2.txt")
+  must_match("${SRCDIR}/tests/fixtures/split-prefix-out.txt" "${WORKDIR}/split2.txt"
+    "split-channels with channel prefixes")
+
+elseif(MODE STREQUAL "combine")
+  set(fx "${SRCDIR}/tests/fixtures")
+  run(ARGS -c "${fx}/concat-a.txt" "${WORKDIR}/concat-a.mid")
+  run(ARGS -c "${fx}/concat-b.txt" "${WORKDIR}/concat-b.mid")
+  run(ARGS --concat "${WORKDIR}/concat-a.mid" "${WORKDIR}/concat-b.mid"
+      "${WORKDIR}/concat-a.mid" "${WORKDIR}/concat.mid")
+  run(ARGS "${WORKDIR}/concat.mid" OUT "${WORKDIR}/concat.txt")
+  must_match("${fx}/concat.txt" "${WORKDIR}/concat.txt" "concat")
+  run(ARGS --layer "${WORKDIR}/concat-a.mid" "${WORKDIR}/concat-b.mid"
+      "${WORKDIR}/layer.mid")
+  run(ARGS "${WORKDIR}/layer.mid" OUT "${WORKDIR}/layer.txt")
+  must_match("${fx}/layer.txt" "${WORKDIR}/layer.txt" "layer")
+
+elseif(MODE STREQUAL "inplace")
+  set(stages --tempo-scale=2 --chmap=1:3 --velocity=50)
+  configure_file("${SRCDIR}/ex1.mid" "${WORKDIR}/ip.mid" COPYONLY)
+  run(ARGS --in-place ${stages} "${WORKDIR}/ip.mid")
+  file(READ "${SRCDIR}/ex1.mid" before HEX)
+  file(READ "${WORKDIR}/ip.mid" after HEX)
+  string(LENGTH "${before}" before)
+  string(LENGTH "${after}" after)
+  if(NOT before EQUAL after)
+    message(FATAL_ERROR "in-place: size changed from ${before} to ${after}")
+  endif()
+  run(ARGS ${stages} "${SRCDIR}/ex1.mid" "${WORKDIR}/ip-x.mid")
+  run(ARGS "${WORKDIR}/ip.mid" OUT "${WORKDIR}/ip.txt")
+  run(ARGS "${WORKDIR}/ip-x.mid" OUT "${WORKDIR}/ip-x.txt")
+  must_match("${WORKDIR}/ip-x.txt" "${WORKDIR}/ip.txt" "in-place patch")
+  # notes transposed out of range are dropped: not same-size
+  configure_file("${SRCDIR}/ex1.mid" "${WORKDIR}/ip2.mid" COPYONLY)
+  run(ARGS --in-place --transpose=100 "${WORKDIR}/ip2.mid")
+  run(ARGS --transpose=100 "${SRCDIR}/ex1.mid" "${WORKDIR}/ip2-x.mid")
+  must_match("${WORKDIR}/ip2-x.mid" "${WORKDIR}/ip2.mid" "in-place rewrite")
+  # a SysEx joined from packets isn't patched over the packets' headers
+  configure_file("${SRCDIR}/tests/fixtures/sysex-packets.mid" "${WORKDIR}/ip4.mid" COPYONLY)
+  run(ARGS --in-place --transpose=1 "${WORKDIR}/ip4.mid")
+  run(ARGS --transpose=1 "${SRCDIR}/tests/fixtures/sysex-packets.mid" "${WORKDIR}/ip4-x.mid")
+  must_match("${WORKDIR}/ip4-x.mid" "${WORKDIR}/ip4.mid" "in-place SysEx packets")
+  # the rewrite replaces the file a symlink points to, keeping its mode
+  if(UNIX AND NOT CMAKE_VERSION VERSION_LESS 3.14)
+    file(REMOVE_RECURSE "${WORKDIR}/ip3")
+    file(COPY "${SRCDIR}/ex1.mid" DESTINATION "${WORKDIR}/ip3"
+      FILE_PERMISSIONS OWNER_READ OWNER_WRITE OWNER_EXECUTE GROUP_READ)
+    file(CREATE_LINK ex1.mid "${WORKDIR}/ip3/link.mid" SYMBOLIC)
+    run(ARGS --in-place --transpose=100 "${WORKDIR}/ip3/link.mid")
+    if(NOT IS_SYMLINK "${WORKDIR}/ip3/link.mid")
+      message(FATAL_ERROR "in-place rewrite replaced a symlink")
+    endif()
+    must_match("${WORKDIR}/ip2-x.mid" "${WORKDIR}/ip3/ex1.mid" "in-place rewrite through a symlink")
+    # find_program() only finds executable files, so this sees the mode bits
+    find_program(ipx ex1.mid PATHS "${WORKDIR}/ip3" NO_DEFAULT_PATH)
+    if(NOT ipx)
+      message(FATAL_ERROR "in-place rewrite lost the file's mode")
+    endif()
+  endif()
+
+elseif(MODE STREQUAL "check")
+  run(ARGS --check "${SRCDIR}/ex1.mid")
+  foreach(f meta-keysig-len0 meta-tempo-len0 meta-smpte-len0 header-division0 huge-varlen
+          header-ntrks2)
+    execute_process(
+      COMMAND "${BIN}" --check "${SRCDIR}/ex1.mid" "${SRCDIR}/tests/fixtures/${f}.mid"
+      ERROR_VARIABLE err RESULT_VARIABLE rc)
+    if(NOT rc EQUAL 1 OR NOT err MATCHES "^[^\n]*${f}.mid: [^\n]*\n$")
+      message(FATAL_ERROR "check ${f}: exit '${rc}', diagnostic '${err}'")
+    endif()
+  endforeach()
+
+elseif(MODE STREQUAL "info")
+  run(ARGS -c "${SRCDIR}/tests/fixtures/multi.txt" "${WORKDIR}/info.mid")
+  run(ARGS --info IN "${WORKDIR}/info.mid" OUT "${WORKDIR}/info.txt")
+  must_match("${SRCDIR}/tests/fixtures/info.txt" "${WORKDIR}/info.txt" "info")
+
+elseif(MODE STREQUAL "chunks")
+  foreach(f unknown-chunk.mid rmid.rmi)
+    run(ARGS "${SRCDIR}/tests/fixtures/${f}" OUT "${WORKDIR}/${f}.txt")
+    must_match("${SRCDIR}/ex1-plain.txt" "${WORKDIR}/${f}.txt" "decode ${f}")
+    run(ARGS --check "${SRCDIR}/tests/fixtures/${f}")
+    run(ARGS "${SRCDIR}/tests/fixtures/${f}" "${WORKDIR}/${f}.mid")
+    must_match("${SRCDIR}/ex1.mid" "${WORKDIR}/${f}.mid" "transform ${f}")
+  endforeach()
+
+elseif(MODE STREQUAL "sysex")
+  set(fx "${SRCDIR}/tests/fixtures")
+  run(ARGS -f40 "${fx}/sysex-packets.mid" OUT "${WORKDIR}/sysex.txt")
+  must_match("${fx}/sysex-packets.txt" "${WORKDIR}/sysex.txt" "sysex decode")
+  run(ARGS "${fx}/sysex-packets.mid" "${WORKDIR}/sysex.mid")
+  must_match("${fx}/sysex-packets.mid" "${WORKDIR}/sysex.mid" "sysex copy")
+
+elseif(MODE STREQUAL "limits")
+  function(tripped what)
+    execute_process(COMMAND "${BIN}" ${ARGN}
+      OUTPUT_QUIET ERROR_VARIABLE err RESULT_VARIABLE rc)
+    if(NOT rc EQUAL 3 OR NOT err MATCHES "Limit exceeded: ${what}=")
+      message(FATAL_ERROR "${what}: exit '${rc}', '${err}'")
+    endif()
+  endfunction()
+  set(ex1 "${SRCDIR}/ex1.mid")
+  tripped(max-events --max-events=10 "${ex1}")
+  tripped(max-events --max-events=10 -c "${SRCDIR}/ex1-plain.txt" "${WORKDIR}/lim.mid")
+  # tracks no stage touches are still counted, not copied past the limits
+  tripped(max-events --max-events=3 "${ex1}" "${WORKDIR}/lim.mid")
+  tripped(max-payload --max-payload=2 "${SRCDIR}/tests/fixtures/sysex-packets.mid"
+    "${WORKDIR}/lim.mid")
+  tripped(max-output-bytes --max-output-bytes=100 "${ex1}")
+  tripped(max-output-bytes --max-output-bytes=100 "${ex1}" "${WORKDIR}/lim.mid")
+  tripped(max-payload --max-payload=2 "${SRCDIR}/tests/fixtures/sysex-packets.mid")
+  # compiling counts a payload as decoding it does, the SysEx status aside
+  file(WRITE "${WORKDIR}/lim-sx.txt"
+    "MFile 0 1 96\nMTrk\n0 SysEx f0 01 02 03 04 05 06 07 08 09 f7\n0 Meta TrkEnd\nTrkEnd\n")
+  tripped(max-payload --max-payload=9 -c "${WORKDIR}/lim-sx.txt" "${WORKDIR}/lim.mid")
+  run(ARGS --max-payload=10 -c "${WORKDIR}/lim-sx.txt" "${WORKDIR}/lim.mid")
+  run(ARGS --max-payload=10 "${WORKDIR}/lim.mid" OUT "${WORKDIR}/lim-sx2.txt")
+  # limits that aren't reached change nothing
+  run(ARGS --max-events=1000 --max-payload=64 --max-output-bytes=100000
+           --time-budget-ms=60000 "${ex1}" OUT "${WORKDIR}/lim.txt")
+  must_match("${SRCDIR}/ex1-plain.txt" "${WORKDIR}/lim.txt" "limits not reached")
+
+elseif(MODE STREQUAL "errors")
+  set(bad "${SRCDIR}/tests/fixtures/bad-lines.txt")
+  execute_process(COMMAND "${BIN}" -c "${bad}" "${WORKDIR}/bad.mid"
+    ERROR_VARIABLE err RESULT_VARIABLE rc)
+  if(NOT rc EQUAL 1)
+    message(FATAL_ERROR "bad lines compiled with exit '${rc}'")
+  endif()
+  foreach(ln 4 5 6 7 9 10)
+    if(NOT err MATCHES "(^|\n)${ln}: ")
+      message(FATAL_ERROR "line ${ln} not reported: ${err}")
+    endif()
+  endforeach()
+  if(NOT err MATCHES "6 errors")
+    message(FATAL_ERROR "no error count: ${err}")
+  endif()
+  # the good lines still make it through
+  run(ARGS "${WORKDIR}/bad.mid" OUT "${WORKDIR}/bad.txt")
+  must_match("${SRCDIR}/tests/fixtures/bad-lines-out.txt" "${WORKDIR}/bad.txt"
+             "bad lines skipped")
+  execute_process(COMMAND "${BIN}" --max-errors=2 -c "${bad}" "${WORKDIR}/bad.mid"
+    ERROR_VARIABLE err RESULT_VARIABLE rc)
+  if(NOT rc EQUAL 1 OR NOT err MATCHES "Stopped after 2 errors" OR err MATCHES "6: ")
+    message(FATAL_ERROR "--max-errors=2: exit '${rc}', '${err}'")
+  endif()
+
+elseif(MODE STREQUAL "durations")
+  set(fx "${SRCDIR}/tests/fixtures")
+  run(ARGS -c "${fx}/durations.txt" "${WORKDIR}/dur.mid")
+  run(ARGS --durations "${WORKDIR}/dur.mid" OUT "${WORKDIR}/dur.txt")
+  must_match("${fx}/durations-out.txt" "${WORKDIR}/dur.txt" "--durations decode")
+  # Note lines compile to the same events, also with delta times
+  run(ARGS -c "${WORKDIR}/dur.txt" "${WORKDIR}/dur2.mid")
+  run(ARGS "${WORKDIR}/dur2.mid" OUT "${WORKDIR}/dur2.txt")
+  must_match("${fx}/durations-plain.txt" "${WORKDIR}/dur2.txt" "Note compile")
+  run(ARGS -i --durations "${WORKDIR}/dur.mid" OUT "${WORKDIR}/duri.txt")
+  run(ARGS -i -c "${WORKDIR}/duri.txt" "${WORKDIR}/dur3.mid")
+  run(ARGS "${WORKDIR}/dur3.mid" OUT "${WORKDIR}/dur3.txt")
+  must_match("${fx}/durations-plain.txt" "${WORKDIR}/dur3.txt" "Note compile -i")
+  # a note byte above 127 isn't paired, just printed
+  run(ARGS "${fx}/note-highbyte.mid" OUT "${WORKDIR}/hb.txt")
+  run(ARGS --durations "${fx}/note-highbyte.mid" OUT "${WORKDIR}/hb-dur.txt")
+  must_match("${WORKDIR}/hb.txt" "${WORKDIR}/hb-dur.txt" "--durations of note 240")
+
+elseif(MODE STREQUAL "sort")
+  set(fx "${SRCDIR}/tests/fixtures")
+  execute_process(COMMAND "${BIN}" -c "${fx}/unsorted.txt" "${WORKDIR}/uns.mid"
+    OUTPUT_QUIET ERROR_QUIET RESULT_VARIABLE rc)
+  if(NOT rc EQUAL 1)
+    message(FATAL_ERROR "unsorted times compiled without --sort")
+  endif()
+  # --sort=2 holds two events in memory, so every track is merged from runs
+  foreach(opt --sort --sort=2)
+    run(ARGS ${opt} -c "${fx}/unsorted.txt" "${WORKDIR}/uns.mid")
+    run(ARGS "${WORKDIR}/uns.mid" OUT "${WORKDIR}/uns.txt")
+    must_match("${fx}/unsorted-out.txt" "${WORKDIR}/uns.txt" "${opt}")
+  endforeach()
+  # sorted input compiles the same with --sort
+  run(ARGS -c "${SRCDIR}/ex1-plain.txt" "${WORKDIR}/ex1c.mid")
+  run(ARGS --sort -c "${SRCDIR}/ex1-plain.txt" "${WORKDIR}/ex1s.mid")
+  must_match("${WORKDIR}/ex1c.mid" "${WORKDIR}/ex1s.mid" "--sort of sorted input")
+
+elseif(MODE STREQUAL "terse")
+  set(fx "${SRCDIR}/tests/fixtures")
+  run(ARGS -c "${fx}/multi.txt" "${WORKDIR}/multi.mid")
+  run(ARGS "${WORKDIR}/multi.mid" OUT "${WORKDIR}/multi-plain.txt")
+  run(ARGS --terse "${WORKDIR}/multi.mid" OUT "${WORKDIR}/multi-terse.txt")
+  must_match("${fx}/multi-terse.txt" "${WORKDIR}/multi-terse.txt" "--terse decode")
+  run(ARGS -c "${WORKDIR}/multi-terse.txt" "${WORKDIR}/terse.mid")
+  run(ARGS "${WORKDIR}/terse.mid" OUT "${WORKDIR}/terse.txt")
+  must_match("${WORKDIR}/multi-plain.txt" "${WORKDIR}/terse.txt" "terse compile")
+  # with Note lines, note names and the channel changing mid-track
+  run(ARGS -c "${fx}/durations.txt" "${WORKDIR}/dur.mid")
+  run(ARGS "${WORKDIR}/dur.mid" OUT "${WORKDIR}/dur-plain.txt")
+  run(ARGS --terse --durations -n "${WORKDIR}/dur.mid" OUT "${WORKDIR}/dur-terse.txt")
+  run(ARGS -c "${WORKDIR}/dur-terse.txt" "${WORKDIR}/dur2.mid")
+  run(ARGS "${WORKDIR}/dur2.mid" OUT "${WORKDIR}/dur2.txt")
+  must_match("${WORKDIR}/dur-plain.txt" "${WORKDIR}/dur2.txt" "terse Note compile")
+
+elseif(MODE STREQUAL "ramps")
+  set(fx "${SRCDIR}/tests/fixtures")
+  run(ARGS -c "${fx}/ramps.txt" "${WORKDIR}/ramps.mid")
+  run(ARGS "${WORKDIR}/ramps.mid" OUT "${WORKDIR}/ramps.txt")
+  must_match("${fx}/ramps-plain.txt" "${WORKDIR}/ramps.txt" "Ramp compile")
+  run(ARGS -c "${fx}/thin.txt" "${WORKDIR}/thin.mid")
+  run(ARGS --ramps "${WORKDIR}/thin.mid" OUT "${WORKDIR}/thin-ramps.txt")
+  must_match("${fx}/thin-ramps.txt" "${WORKDIR}/thin-ramps.txt" "--ramps decode")
+  foreach(opt --ramps --terse)
+    run(ARGS --ramps ${opt} "${WORKDIR}/thin.mid" OUT "${WORKDIR}/thin2.txt")
+    run(ARGS -c "${WORKDIR}/thin2.txt" "${WORKDIR}/thin2.mid")
+    must_match("${WORKDIR}/thin.mid" "${WORKDIR}/thin2.mid" "--ramps ${opt} round trip")
+  endforeach()
+  run(ARGS --ramps "${WORKDIR}/ramps.mid" OUT "${WORKDIR}/ramps2.txt")
+  run(ARGS -c "${WORKDIR}/ramps2.txt" "${WORKDIR}/ramps2.mid")
+  must_match("${WORKDIR}/ramps.mid" "${WORKDIR}/ramps2.mid" "--ramps round trip")
+  # a controller byte above 127 isn't made a run, just printed
+  run(ARGS "${fx}/par-highbyte.mid" OUT "${WORKDIR}/hb.txt")
+  run(ARGS --ramps "${fx}/par-highbyte.mid" OUT "${WORKDIR}/hb-ramps.txt")
+  must_match("${WORKDIR}/hb.txt" "${WORKDIR}/hb-ramps.txt" "--ramps of controller 200")
+  # a point doesn't join a run across the Off of a Note begun after it
+  run(ARGS -c "${fx}/multi.txt" "${WORKDIR}/multi.mid")
+  run(ARGS --durations --ramps "${WORKDIR}/multi.mid" OUT "${WORKDIR}/multi-dr.txt")
+  run(ARGS -c "${WORKDIR}/multi-dr.txt" "${WORKDIR}/multi-dr.mid")
+  must_match("${WORKDIR}/multi.mid" "${WORKDIR}/multi-dr.mid"
+    "--durations --ramps round trip")
+  # a Ramp's points count against --max-events, not just its line
+  execute_process(COMMAND "${BIN}" --max-events=15 -c "${fx}/ramps.txt"
+    "${WORKDIR}/lim.mid" OUTPUT_QUIET ERROR_QUIET RESULT_VARIABLE rc)
+  if(NOT rc EQUAL 3)
+    message(FATAL_ERROR "Ramp points not counted by --max-events: exit '${rc}'")
+  endif()
+
+elseif(MODE STREQUAL "patterns")
+  set(fx "${SRCDIR}/tests/fixtures")
+  run(ARGS -c "${fx}/patterns.txt" "${WORKDIR}/pat.mid")
+  run(ARGS "${WORKDIR}/pat.mid" OUT "${WORKDIR}/pat.txt")
+  must_match("${fx}/patterns-out.txt" "${WORKDIR}/pat.txt" "Play compile")
+  run(ARGS --sort -c "${fx}/patterns.txt" "${WORKDIR}/pats.mid")
+  must_match("${WORKDIR}/pat.mid" "${WORKDIR}/pats.mid" "Play compile with --sort")
+  # --where sees each Play's events at the tick and in the track they land
+  foreach(w "time<400 || trk==2" "time>=300 && time<700")
+    run(ARGS -w "${w}" "${WORKDIR}/pat.mid" OUT "${WORKDIR}/patw.txt")
+    run(ARGS -w "${w}" -c "${fx}/patterns.txt" "${WORKDIR}/patw.mid")
+    run(ARGS "${WORKDIR}/patw.mid" OUT "${WORKDIR}/patw2.txt")
+    must_match("${WORKDIR}/patw.txt" "${WORKDIR}/patw2.txt" "Play compile with -w '${w}'")
+  endforeach()
+  # a Play's events count against --max-events, not just its line
+  execute_process(COMMAND "${BIN}" --max-events=30 -c "${fx}/patterns.txt"
+    "${WORKDIR}/lim.mid" OUTPUT_QUIET ERROR_QUIET RESULT_VARIABLE rc)
+  if(NOT rc EQUAL 3)
+    message(FATAL_ERROR "Play events not counted by --max-events: exit '${rc}'")
+  endif()
+
+elseif(MODE STREQUAL "packed")
+  set(fx "${SRCDIR}/tests/fixtures")
+  run(ARGS -c "${fx}/multi.txt" "${WORKDIR}/multi.mid")
+  run(ARGS --packed "${WORKDIR}/multi.mid" "${WORKDIR}/multi.pk")
+  run(ARGS -c --packed "${WORKDIR}/multi.pk" "${WORKDIR}/multi2.mid")
+  must_match("${WORKDIR}/multi.mid" "${WORKDIR}/multi2.mid" "packed round trip")
+  run(ARGS --packed "${fx}/sysex-packets.mid" "${WORKDIR}/sx.pk")
+  run(ARGS -c --packed "${WORKDIR}/sx.pk" "${WORKDIR}/sx.mid")
+  must_match("${fx}/sysex-packets.mid" "${WORKDIR}/sx.mid" "packed SysEx packets")
+  run(ARGS --packed --transpose=12 "-w" "ch!=2" "${WORKDIR}/multi.mid"
+      "${WORKDIR}/tr.pk")
+  run(ARGS -c --packed "${WORKDIR}/tr.pk" "${WORKDIR}/tr.mid")
+  run(ARGS "${WORKDIR}/tr.mid" OUT "${WORKDIR}/tr.txt")
+  run(ARGS --transpose=12 "-w" "ch!=2" "${WORKDIR}/multi.mid" "${WORKDIR}/tr2.mid")
+  run(ARGS "${WORKDIR}/tr2.mid" OUT "${WORKDIR}/tr2.txt")
+  must_match("${WORKDIR}/tr2.txt" "${WORKDIR}/tr.txt" "packed with stages")
+  execute_process(COMMAND "${BIN}" -c --packed "${fx}/multi.txt" "${WORKDIR}/x.mid"
+    OUTPUT_QUIET ERROR_VARIABLE err RESULT_VARIABLE rc)
+  if(NOT rc EQUAL 1 OR NOT err MATCHES "not a --packed stream")
+    message(FATAL_ERROR "text compiled as --packed: exit '${rc}', '${err}'")
+  endif()
+
+elseif(MODE STREQUAL "json")
+  set(fx "${SRCDIR}/tests/fixtures")
+  run(ARGS -c "${fx}/multi.txt" "${WORKDIR}/multi.mid")
+  run(ARGS --json "${WORKDIR}/multi.mid" "${WORKDIR}/multi.json")
+  run(ARGS -c --json "${WORKDIR}/multi.json" "${WORKDIR}/multi2.mid")
+  must_match("${WORKDIR}/multi.mid" "${WORKDIR}/multi2.mid" "json round trip")
+  run(ARGS --json "${fx}/sysex-packets.mid" "${WORKDIR}/sx.json")
+  run(ARGS -c --json "${WORKDIR}/sx.json" "${WORKDIR}/sx.mid")
+  must_match("${fx}/sysex-packets.mid" "${WORKDIR}/sx.mid" "json SysEx packets")
+  run(ARGS -c --json "${fx}/events.json" "${WORKDIR}/events.mid")
+  run(ARGS "${WORKDIR}/events.mid" OUT "${WORKDIR}/events.txt")
+  must_match("${fx}/events-out.txt" "${WORKDIR}/events.txt" "hand-written json")
+  run(ARGS --json "${WORKDIR}/events.mid" "${WORKDIR}/events.json")
+  run(ARGS -c --json "${WORKDIR}/events.json" "${WORKDIR}/events2.mid")
+  must_match("${WORKDIR}/events.mid" "${WORKDIR}/events2.mid" "json text escapes")
+  # a text is Latin-1, so a character above \u00ff can't be written
+  foreach(t "\\u20ac" "€")
+    file(WRITE "${WORKDIR}/wide.json"
+      "{\"type\":\"MThd\",\"version\":1,\"format\":0,\"ntrks\":1,\"division\":96}\n"
+      "{\"type\":\"MTrk\",\"track\":1}\n"
+      "{\"tick\":0,\"track\":1,\"type\":\"Meta\",\"meta\":1,\"text\":\"${t}\"}\n")
+    execute_process(COMMAND "${BIN}" -c --json "${WORKDIR}/wide.json" "${WORKDIR}/x.mid"
+      OUTPUT_QUIET ERROR_VARIABLE err RESULT_VARIABLE rc)
+    if(NOT rc EQUAL 1 OR NOT err MATCHES "json line 3: a character above")
+      message(FATAL_ERROR "json text '${t}': exit '${rc}', '${err}'")
+    endif()
+  endforeach()
+  execute_process(COMMAND "${BIN}" -c --json "${fx}/multi.txt" "${WORKDIR}/x.mid"
+    OUTPUT_QUIET ERROR_VARIABLE err RESULT_VARIABLE rc)
+  if(NOT rc EQUAL 1 OR NOT err MATCHES "json line 1: expected an object")
+    message(FATAL_ERROR "text compiled as --json: exit '${rc}', '${err}'")
+  endif()
+
+elseif(MODE STREQUAL "columns")
+  set(fx "${SRCDIR}/tests/fixtures")
+  set(cols "${WORKDIR}/columns")
+  file(REMOVE_RECURSE "${cols}")
+  run(ARGS -c "${fx}/multi.txt" "${WORKDIR}/multi.mid")
+  execute_process(COMMAND "${BIN}" "--export-columns=${cols}" "${WORKDIR}/multi.mid"
+    "${fx}/sysex-packets.mid" "${fx}/header-division0.mid"
+    ERROR_VARIABLE err RESULT_VARIABLE rc)
+  if(NOT rc EQUAL 1 OR NOT err MATCHES "header-division0.mid: MThd division is 0")
+    message(FATAL_ERROR "bad file in --export-columns: exit '${rc}', '${err}'")
+  endif()
+  file(READ "${cols}/status.col" st HEX)
+  set(want "4d43434f010100001e00000000000000"
+    "ffffffffffc0b0b090e09080b080d0a0" "ffff999989899989f0fff0f7f7ff")
+  string(JOIN "" want ${want})
+  if(NOT st STREQUAL want)
+    message(FATAL_ERROR "status.col is ${st}")
+  endif()
+  file(READ "${cols}/payload.col" pl HEX)
+  set(want "4d43434f010100002300000000000000" "6d756c746907a12004021808061a80"
+    "6472756d73f07e7f0901f7f04110421240f70102")
+  string(JOIN "" want ${want})
+  if(NOT pl STREQUAL want)
+    message(FATAL_ERROR "payload.col is ${pl}")
+  endif()
+  file(WRITE "${WORKDIR}/columns.lst" "${WORKDIR}/multi.mid\n")
+  run(ARGS "--export-columns=${cols}" "--where=type==on" IN "${WORKDIR}/columns.lst")
+  file(STRINGS "${cols}/files.txt" names)
+  list(LENGTH names n)
+  file(READ "${cols}/value.col" v HEX)
+  if(NOT n EQUAL 3 OR NOT v MATCHES "^4d43434f0102000026000000")
+    message(FATAL_ERROR "adding to an export: ${n} files, value.col ${v}")
+  endif()
+
+elseif(MODE STREQUAL "model")
+  set(fx "${SRCDIR}/tests/fixtures")
+  run(ARGS --compact -c "${fx}/model.txt" "${WORKDIR}/model.mid")
+  run(ARGS --transpose=10 --velocity=150 --chmap=2:4 --tempo-scale=1.5 --drop=text
+    "${WORKDIR}/model.mid" "${WORKDIR}/model-out.mid")
+  must_match("${fx}/model-out.mid" "${WORKDIR}/model-out.mid" "model stages")
+  run(ARGS --drop=eot "${fx}/sysex-packets.mid" "${WORKDIR}/mdsx.mid")
+  must_match("${fx}/sysex-packets.mid" "${WORKDIR}/mdsx.mid" "model SysEx packets")
+  run(ARGS --drop=arb "${fx}/sysex-packets.mid" "${WORKDIR}/mdsx2.mid")
+  run(ARGS "${WORKDIR}/mdsx2.mid" OUT "${WORKDIR}/mdsx2.txt")
+  file(READ "${WORKDIR}/mdsx2.txt" sx)
+  if(NOT sx MATCHES "\n16 SysEx f0 41 10 42 12 40 f7\n16 Meta TrkEnd\n")
+    message(FATAL_ERROR "--drop=arb doesn't join the SysEx packets:\n${sx}")
+  endif()
+  # meta types 0x83 and 0xd1 are not TrkName and Tempo
+  file(WRITE "${WORKDIR}/mdhi.txt" "MFile 0 1 96\nMTrk\n0 Meta 0x83 01\n"
+    "0 Meta 0xd1 07 a1 20\n0 Tempo 500000\n0 Meta TrkEnd\nTrkEnd\n")
+  run(ARGS -c "${WORKDIR}/mdhi.txt" "${WORKDIR}/mdhi.mid")
+  run(ARGS --drop=trkname --tempo-scale=2 "${WORKDIR}/mdhi.mid" "${WORKDIR}/mdhi2.mid")
+  run(ARGS "${WORKDIR}/mdhi2.mid" OUT "${WORKDIR}/mdhi2.txt")
+  file(READ "${WORKDIR}/mdhi2.txt" hi)
+  if(NOT hi MATCHES "\n0 Meta 0x83 01\n0 Meta 0xd1 07 a1 20\n0 Tempo 250000\n")
+    message(FATAL_ERROR "model stages took a meta type for another:\n${hi}")
+  endif()
+
 elseif(MODE STREQUAL "security")
   # Adversarial inputs that previously crashed (NULL deref, OOB read, SIGFPE)
   # or triggered UB. Assert midicomp handles each WITHOUT crashing: a clean